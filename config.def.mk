@@ -1,6 +1,7 @@
 PREFIX?=/usr/local
 INCLUDEDIR?=${PREFIX}/include
 BINDIR?=${PREFIX}/lib
+LIBDIR?=${PREFIX}/lib
 DESTDIR?=
 
 CC?=gcc
@@ -37,13 +37,90 @@ struct livec_opts {
 	arcp_t builddir; /**< The directory in which we build the dso
 	                  *   files. */
 	arcp_t entry; /**< Name of entry point. */
+	arcp_t ab_function; /**< Name of the function to run when comparing
+	                     *   each new generation against the previous
+	                     *   one, or NULL to disable the comparison. It
+	                     *   takes the entry's arguments, must return,
+	                     *   and must not have side effects. */
+	int ab_cpu; /**< CPU to pin the comparison runs to, or -1. */
+	int ab_runs; /**< Number of runs of each generation per
+	              *   comparison. */
+	int profile; /**< Time every profile'th autolinked call in each
+	              *   thread, or 0 to disable autolink
+	              *   instrumentation. */
+	int rollback; /**< Milliseconds a generation has to run before it
+	               *   is known to be good, or 0 to disable rolling
+	               *   back to the last good generation on a crash.
+	               *   Standalone only. */
+	int history; /**< Number of generations to keep loaded for
+	              *   switching between, or 0 for no history.
+	              *   Standalone only. */
+	unsigned long history_mem; /**< Maximum total size of the DSOs in
+	                            *   the history, in KiB, or 0 for no
+	                            *   limit. */
+	bool hotpatch; /**< Whether to patch the functions of old
+	                *   generations to jump directly to their new
+	                *   versions. */
+	arcp_t events; /**< File to write the JSON lines event log to, or
+	                *   NULL for no event log. */
+	bool export_map; /**< Whether to export only the symbols livec
+	                  *   looks up from each DSO. */
+	int stress; /**< Number of threads to call livec_stress() from
+	             *   while stressing relinking, or 0 to run
+	             *   normally. */
+	int stress_reloads; /**< Number of reloads when stressing. */
+	int stress_interval; /**< Microseconds between reloads when
+	                      *   stressing. */
+	arcp_t report_dir; /**< Directory to write a code report to for
+	                    *   each generation, or NULL for no
+	                    *   reports. */
+	arcp_t fifo; /**< Fifo from which to read source to compile in
+	              *   place of the file, or NULL. */
+	int build_nice; /**< Nice value for compiler jobs. */
+	bool build_idle; /**< Whether to run compiler jobs with idle cpu
+	                  *   and io priority. */
+	arcp_t build_cpus; /**< List of cpus to run compiler jobs on, such
+	                    *   as "0-3,6", or NULL for any. */
+	arcp_t build_cgroup; /**< Cgroup directory to run compiler jobs in,
+	                      *   or NULL. */
+	arcp_t log; /**< File to write livec_log() messages to, or NULL
+	             *   for stderr. */
+	bool heap_track; /**< Whether to account for heap allocations by the
+	                  *   generation whose code made them. */
+	bool perf_map; /**< Whether to write the functions of each
+	                *   generation to /tmp/perf-<pid>.map. */
+	arcp_t perf_keep; /**< Directory to keep a copy of each unloaded
+	                   *   generation's DSO in, or NULL. */
+	bool lazy_relink; /**< Whether to relink each typed autolink on its
+	                   *   first call after a reload, rather than all of
+	                   *   them on the reload. */
+	bool hugepages; /**< Whether to move the text of each generation
+	                 *   onto transparent huge pages. */
+	bool warmup; /**< Whether to fault in each new generation and run
+	              *   its livec_warmup() before switching to it. */
+	int pool_threads; /**< Number of livec_pool_spawn() workers, or 0 for
+	                   *   one per online CPU. */
 };
 
 /**
- * The global options structure.
+ * The global options structure. These are the options of the standalone
+ * livec. Options that aren't specific to one file (ab_*, profile, rollback,
+ * history*, hotpatch, events, stress*, log, and perf_*) are always taken from
+ * here. Most of them apply to every context, but rollback and history only
+ * apply to the standalone context: they are driven by its crash handling
+ * and by SIGUSR1 and SIGUSR2, which belong to the host application when livec
+ * is embedded. Embedded contexts are never rolled back or switched through a
+ * history, and livec_create() warns when either is set.
  */
 extern struct livec_opts livec_opts;
 
+/**
+ * A livecoding context, for embedding livec in a host application. Each
+ * context watches, compiles, and loads one file, and has its own generations
+ * and autolink functions.
+ */
+struct livec;
+
 /**
  * The type of function the Live C process expects; patterned on C's main.
  */
@@ -58,6 +135,11 @@ struct dso_entry {
 	livec_proc proc; /**< The entry function */
 	void *dlhandle; /**< The handle for the dso file */
 	char *dsofile; /**< The filename of the dso file */
+	unsigned long generation; /**< Sequence number of this load */
+	size_t dsosize; /**< Size of the dso file */
+	struct livec *livec; /**< The context that loaded the dso file */
+	unsigned int threads; /**< Number of threads running its entry
+	                       *   function */
 };
 
 /**
@@ -72,6 +154,66 @@ extern pthread_key_t entry_key;
  */
 extern arcp_t state; 
 
+/**
+ * Create a livecoding context for a host application. The context compiles
+ * filename with "cc" into $TMPDIR (or /tmp), and loads it with "main" as the
+ * entry function; these and the other file-specific options can be changed
+ * through livec_options() before the first load. Unlike in the standalone
+ * livec, the entry function of each generation gets no arguments. It is run
+ * in a thread of its own, from which it can create its autolink functions;
+ * livec_reload() waits for it to return, while under livec_watch() it is
+ * left running, so that one which loops doesn't hold up the next reload.
+ *
+ * @param filename the file to compile.
+ * @returns the context, or NULL on error.
+ */
+struct livec *livec_create(char *filename);
+
+/**
+ * Get the options of a context. Only the file-specific options are used;
+ * see livec_opts.
+ */
+struct livec_opts *livec_options(struct livec *lc);
+
+/**
+ * Compile and load the file of a context now, and run the entry function of
+ * the new generation to completion.
+ *
+ * @returns 0 on success, -1 if compiling or loading failed, or the entry
+ * function could not be run or died.
+ */
+int livec_reload(struct livec *lc);
+
+/**
+ * Load the file of a context, and then watch it on a background thread,
+ * reloading it whenever it changes. Don't call livec_reload() on a context
+ * that is being watched. Compile and load errors are reported as they
+ * happen; only failing to set up the watch is returned.
+ *
+ * @returns 0 on success, -1 on error.
+ */
+int livec_watch(struct livec *lc);
+
+/**
+ * Get the function an autolink of a context currently links to, for calling
+ * from the host.
+ *
+ * @param lc the context.
+ * @param fname the name of the autolink.
+ * @param ref where to put a reference which keeps the function's generation
+ * loaded; release it with arcp_release() once done calling.
+ * @returns the function, or NULL if there is no such autolink.
+ */
+void *livec_autolink(struct livec *lc, char *fname, struct arcp_region **ref);
+
+/**
+ * Stop watching, and drop the generations and autolinks of a context. The
+ * context itself is freed once no code of its generations is running any
+ * more, unless it created typed autolinks: their slots keep the context, and
+ * the generations they last linked to, for good.
+ */
+void livec_destroy(struct livec *lc);
+
 /**
  * Create an autolink function. An autolink function is automatically relinked
  * on recompile to a new function of the corresponding name.
@@ -91,8 +233,546 @@ void *autolink_create(void *fptr, char *fname, char *signature);
 	autolink_create(fptr, #fptr, signature)
 
 /**
- * Destroy an autolink function.
+ * A typed autolink function. The slot is updated in place on recompile, so a
+ * call through it costs an indirect call and a few plain stores to a record
+ * of the calling thread's own, which keep the function called loaded until
+ * the call returns; nothing shared is written, but the call can't be a tail
+ * call. Slots belong to livec and are shared by all generations.
+ */
+struct autolink_slot {
+	void *fptr; /**< The function currently linked to. */
+	unsigned long generation; /**< The generation fptr was linked
+	                           *   from. */
+	const unsigned long *link_generation; /**< The generation the slot
+	                                       *   should be linked from;
+	                                       *   while it differs, calls
+	                                       *   relink the slot first.
+	                                       *   Without lazy relinking,
+	                                       *   this is &generation. */
+	struct livec *livec; /**< The context the slot belongs to, which
+	                      *   it holds a reference to. */
+	bool resolving; /**< Whether the slot is being relinked. */
+	struct arcp_region *target; /**< Keeps the function fptr points to
+	                             *   loaded. */
+	void *retired; /**< Functions fptr pointed to before, kept loaded
+	                *   until no call can still be in them. */
+};
+
+/**
+ * Create a typed autolink function. Usually used through
+ * AUTOLINK_TYPED_CREATE.
+ *
+ * @param fptr the function pointer for the initial link.
+ * @param fname the function name.
+ * @returns the slot through which to call the function, or NULL on error.
+ */
+struct autolink_slot *autolink_slot_create(void *fptr, char *fname);
+
+/**
+ * Relink a typed autolink to the generation it should be linked from, and
+ * return the function it links to. If another thread is already relinking
+ * it, the function it links to until then is returned.
+ */
+void *autolink_slot_resolve(struct autolink_slot *slot);
+
+/**
+ * Get the function a typed autolink currently links to, relinking it first
+ * if there has been a reload since it was last linked.
+ */
+static inline void *autolink_slot_fptr(struct autolink_slot *slot) {
+	if(__builtin_expect(__atomic_load_n(&slot->generation,
+	                                    __ATOMIC_ACQUIRE)
+	                    != __atomic_load_n(slot->link_generation,
+	                                       __ATOMIC_ACQUIRE), 0)) {
+		return autolink_slot_resolve(slot);
+	}
+	return __atomic_load_n(&slot->fptr, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * A thread's record of its calls under way through typed autolinks. Only the
+ * thread writes it; relinking reads it to tell when a function no slot points
+ * to any more can be let go.
+ */
+struct autolink_reader {
+	struct autolink_reader *next; /**< The next record on the list. */
+	unsigned long epoch; /**< The relink epoch in which the outermost
+	                      *   call under way started, or 0 if no call
+	                      *   is. */
+	unsigned long depth; /**< The number of calls under way. */
+	bool in_use; /**< Whether a thread owns this record. */
+};
+
+/**
+ * The relink epoch, which moves on each time a slot is pointed elsewhere.
+ */
+extern unsigned long autolink_epoch;
+
+/**
+ * The calling thread's record, or NULL until its first call.
+ */
+extern __thread struct autolink_reader *autolink_self
+	__attribute__((tls_model("initial-exec")));
+
+/**
+ * Get a record for the calling thread and make it autolink_self.
+ */
+struct autolink_reader *autolink_reader_get(void);
+
+/**
+ * Start a call through a typed autolink: get the function it currently links
+ * to, which stays loaded until the matching autolink_slot_leave().
+ */
+static inline void *autolink_slot_enter(struct autolink_slot *slot) {
+	struct autolink_reader *self;
+
+	self = autolink_self;
+	if(__builtin_expect(self == NULL, 0)) {
+		self = autolink_reader_get();
+	}
+	if(self->depth++ == 0) {
+		__atomic_store_n(&self->epoch,
+		                 __atomic_load_n(&autolink_epoch,
+		                                 __ATOMIC_ACQUIRE),
+		                 __ATOMIC_RELAXED);
+		/* relinking fences every thread before it reads the record,
+		 * so only the compiler need keep this ahead of the load */
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	}
+	return autolink_slot_fptr(slot);
+}
+
+/**
+ * Finish a call through a typed autolink started with autolink_slot_enter().
+ */
+static inline void autolink_slot_leave(void) {
+	struct autolink_reader *self;
+
+	self = autolink_self;
+	if(--self->depth == 0) {
+		__atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Declare a typed autolink function, fname##_call, which calls the current
+ * version of fname. It is a static inline function specific to the signature,
+ * and can be inlined at the call site. For example:
+ *
+ *     float gain(float x);
+ *     AUTOLINK_TYPED(float, gain, (float x), (x))
+ *
+ * declares gain_call(float x). The call only works after
+ * AUTOLINK_TYPED_CREATE(gain) has been run.
+ *
+ * A version of the function stays loaded as long as a call into it is under
+ * way.
+ *
+ * @param rtype the return type.
+ * @param fname the function name.
+ * @param params the parenthesized parameter list, with names.
+ * @param args the parenthesized parameter names.
+ */
+#define AUTOLINK_TYPED(rtype, fname, params, args)			\
+	static struct autolink_slot *fname##_autolink;			\
+	static inline rtype fname##_call params {			\
+		rtype autolink_ret_;					\
+		autolink_ret_ = ((rtype (*) params)			\
+			autolink_slot_enter(fname##_autolink)) args;	\
+		autolink_slot_leave();					\
+		return autolink_ret_;					\
+	}
+
+/**
+ * Declare a typed autolink function returning void. See AUTOLINK_TYPED.
+ */
+#define AUTOLINK_TYPED_VOID(fname, params, args)			\
+	static struct autolink_slot *fname##_autolink;			\
+	static inline void fname##_call params {			\
+		((void (*) params)					\
+			autolink_slot_enter(fname##_autolink)) args;	\
+		autolink_slot_leave();					\
+	}
+
+/**
+ * Create the typed autolink function declared with AUTOLINK_TYPED for fname.
+ *
+ * @returns the slot, or NULL on error.
+ */
+#define AUTOLINK_TYPED_CREATE(fname)					\
+	(fname##_autolink = autolink_slot_create((void *) fname, #fname))
+
+/**
+ * The signature of a kernel: a function that processes a block of n elements
+ * at once, from in to out. What the elements are is up to the kernel; data is
+ * passed through as is.
+ */
+typedef void (*autolink_kernel_fn)(const void *in, void *out, size_t n,
+                                   void *data);
+
+/**
+ * Create a kernel autolink. A kernel autolink is a typed autolink for a
+ * function processing a whole block, so the cost of finding the current
+ * version of the function is paid once per block rather than once per
+ * element, and the kernel can be vectorized. Each call through it runs one
+ * version of the kernel on the whole block; a new version takes over on the
+ * next block. Usually used through AUTOLINK_KERNEL_CREATE.
+ *
+ * @param fptr the kernel for the initial link.
+ * @param fname the kernel name.
+ * @returns the slot through which to call the kernel, or NULL on error.
+ */
+struct autolink_slot *autolink_kernel_create(autolink_kernel_fn fptr,
+                                             char *fname);
+
+/**
+ * Declare a kernel autolink, fname##_block(in, out, n, data), which runs the
+ * current version of the kernel fname on one block. For example:
+ *
+ *     void gain(const void *in, void *out, size_t n, void *data);
+ *     AUTOLINK_KERNEL(gain)
+ *
+ * The call only works after AUTOLINK_KERNEL_CREATE(gain) has been run.
+ */
+#define AUTOLINK_KERNEL(fname)						\
+	static struct autolink_slot *fname##_autolink;			\
+	static inline void fname##_block(const void *in, void *out,	\
+	                                 size_t n, void *data) {	\
+		((autolink_kernel_fn)					\
+			autolink_slot_enter(fname##_autolink))		\
+			(in, out, n, data);				\
+		autolink_slot_leave();					\
+	}
+
+/**
+ * Create the kernel autolink declared with AUTOLINK_KERNEL for fname.
+ *
+ * @returns the slot, or NULL on error.
+ */
+#define AUTOLINK_KERNEL_CREATE(fname)					\
+	(fname##_autolink = autolink_kernel_create(fname, #fname))
+
+/**
+ * Run a kernel autolink over an array, one block at a time. Each block is
+ * run by whatever version of the kernel is current when it starts.
+ *
+ * @param slot the kernel's slot.
+ * @param in the input elements, or NULL.
+ * @param insize the size of an input element.
+ * @param out the output elements, or NULL.
+ * @param outsize the size of an output element.
+ * @param n the number of elements.
+ * @param block the number of elements per block, at least 1.
+ * @param data passed to the kernel.
+ */
+static inline void autolink_kernel_map(struct autolink_slot *slot,
+                                       const void *in, size_t insize,
+                                       void *out, size_t outsize, size_t n,
+                                       size_t block, void *data) {
+	size_t i, len;
+	for(i = 0; i < n; i += len) {
+		len = n - i < block ? n - i : block;
+		((autolink_kernel_fn) autolink_slot_enter(slot))
+			(in == NULL ? NULL : (const char *) in + i * insize,
+			 out == NULL ? NULL : (char *) out + i * outsize,
+			 len, data);
+		autolink_slot_leave();
+	}
+}
+
+/**
+ * Destroy an autolink function. Calls through a typed autolink's slot keep
+ * going to the version it last linked to, which stays loaded.
  */
 int autolink_destroy(char *fname);
 
+/**
+ * Number of buckets in the autolink latency histogram.
+ */
+#define AUTOLINK_STATS_BUCKETS 32
+
+/**
+ * Call statistics for an autolink function. These are only collected when
+ * livec was started with profiling enabled.
+ */
+struct autolink_stats {
+	unsigned long long calls; /**< Calls since the last reload. */
+	unsigned long long samples; /**< Number of timed calls. */
+	unsigned long long sample_ns; /**< Total time of the timed calls. */
+	unsigned long long histogram[AUTOLINK_STATS_BUCKETS];
+	/**< Timed calls by duration; bucket i counts calls
+	 *   taking from 2^i up to 2^(i+1) ns. */
+};
+
+/**
+ * Get the call statistics of an autolink function.
+ *
+ * @param fname the function name.
+ * @param stats the structure to fill in.
+ * @returns 0 on success, -1 with errno set to EINVAL if there is no such
+ * autolink.
+ */
+int autolink_stats(char *fname, struct autolink_stats *stats);
+
+/**
+ * Estimate a percentile of the call time from an autolink's statistics.
+ *
+ * @param stats statistics as returned by autolink_stats().
+ * @param p the percentile, between 0 and 1.
+ * @returns an upper bound for the percentile, in ns.
+ */
+unsigned long long autolink_stats_percentile(struct autolink_stats *stats,
+                                             double p);
+
+/**
+ * Print the call statistics of all autolink functions to stderr.
+ */
+void autolink_stats_dump(void);
+
+/**
+ * Statistics of a periodic callback.
+ */
+struct livec_periodic_stats {
+	unsigned long long ticks; /**< Number of calls. */
+	unsigned long long misses; /**< Number of ticks skipped because
+	                            *   the previous one overran. */
+	unsigned long long max_jitter_ns; /**< The latest a tick has
+	                                   *   started. */
+	struct autolink_stats jitter; /**< How late ticks started; use
+	                               *   autolink_stats_percentile()
+	                               *   on it. */
+};
+
+/**
+ * Call an autolinked function periodically, on its own thread. Ticks are
+ * scheduled against absolute deadlines, so they don't drift, and each tick
+ * calls the newest version of the function. If a periodic callback of the
+ * same name already exists in the calling thread's context, as when a new
+ * generation runs the same setup code, it is updated with the new period,
+ * priority, and argument instead; callbacks of other contexts are separate.
+ *
+ * @param fptr the callback.
+ * @param fname the name of the callback.
+ * @param period_ns the period, in ns.
+ * @param priority the SCHED_FIFO priority of the thread, or 0 to leave it
+ * with normal scheduling.
+ * @param arg the argument to pass to the callback.
+ * @returns 0 on success, -1 on error.
+ */
+int livec_periodic_create(void (*fptr)(void *), char *fname,
+                          unsigned long long period_ns, int priority,
+                          void *arg);
+
+/**
+ * Create a periodic callback, convenience version which sets the name to be
+ * the same as the name of the passed in function.
+ */
+#define LIVEC_PERIODIC_CREATE(fptr, period_ns, priority, arg)		\
+	livec_periodic_create(fptr, #fptr, period_ns, priority, arg)
+
+/**
+ * Stop a periodic callback of the calling thread's context. A tick that is
+ * under way finishes first.
+ *
+ * @returns 0 on success, -1 with errno set to EINVAL if there is no such
+ * callback.
+ */
+int livec_periodic_destroy(char *fname);
+
+/**
+ * Get the statistics of a periodic callback of the calling thread's context.
+ *
+ * @returns 0 on success, -1 with errno set to EINVAL if there is no such
+ * callback.
+ */
+int livec_periodic_stats(char *fname, struct livec_periodic_stats *stats);
+
+/**
+ * Ring types, for livec_ring_open().
+ */
+#define LIVEC_RING_SPSC 0 /**< One producer thread, one consumer thread. */
+#define LIVEC_RING_MPSC 1 /**< Any number of producer threads, one consumer
+                           *   thread. */
+
+/**
+ * A lock-free ring buffer of fixed-size elements. Rings are named, and belong
+ * to livec rather than to any generation, so a new generation can reattach to
+ * the rings of the old one by opening them by the same names. Pushing and
+ * popping never lock or allocate.
+ */
+struct livec_ring;
+
+/**
+ * Open the ring of the given name, creating it if it does not exist.
+ *
+ * @param name the name of the ring.
+ * @param elemsize the size of each element.
+ * @param nelem the minimum capacity, in elements; rounded up to a power of
+ * two.
+ * @param type LIVEC_RING_SPSC or LIVEC_RING_MPSC.
+ * @returns the ring, or NULL on error. If the ring exists with a different
+ * type or element size, or a smaller capacity, errno is set to EINVAL.
+ */
+struct livec_ring *livec_ring_open(char *name, size_t elemsize, size_t nelem,
+                                   int type);
+
+/**
+ * Release a ring returned by livec_ring_open(). The ring itself stays around
+ * under its name until it is unlinked.
+ */
+void livec_ring_close(struct livec_ring *ring);
+
+/**
+ * Remove a ring from the set of named rings. It is freed once every user has
+ * closed it.
+ *
+ * @returns 0 on success, -1 with errno set to EINVAL if there is no such ring.
+ */
+int livec_ring_unlink(char *name);
+
+/**
+ * Push up to n elements onto a ring.
+ *
+ * @returns the number of elements pushed, which is less than n if the ring is
+ * full.
+ */
+size_t livec_ring_push(struct livec_ring *ring, const void *elems, size_t n);
+
+/**
+ * Pop up to n elements off of a ring. Only one thread may pop from a ring at
+ * a time.
+ *
+ * @returns the number of elements popped, which is less than n if the ring is
+ * empty.
+ */
+size_t livec_ring_pop(struct livec_ring *ring, void *elems, size_t n);
+
+/**
+ * Log a message, printf style. The message is formatted into a ring buffer
+ * belonging to the calling thread, and written out to the log by a background
+ * thread, so this never blocks, takes a lock, or makes a system call; the
+ * first call in a thread allocates the thread's buffer. Messages are
+ * truncated to 239 bytes. If the thread's buffer is full, the message is
+ * dropped, and the number of dropped messages is written to the log instead.
+ *
+ * @returns 0 on success, -1 if the message was dropped.
+ */
+int livec_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * Allocate memory backed by transparent huge pages, for state or arenas that
+ * are big enough for TLB misses to matter. The size is rounded up to a
+ * multiple of the huge page size, 2 MiB, and the memory is zeroed.
+ *
+ * @returns the memory, or NULL on error, with errno set.
+ */
+void *livec_hugepage_alloc(size_t size);
+
+/**
+ * Free memory allocated with livec_hugepage_alloc().
+ *
+ * @param size the size it was allocated with.
+ */
+void livec_hugepage_free(void *ptr, size_t size);
+
+/**
+ * A data file mapped into memory by livec_asset_open().
+ */
+struct livec_asset;
+
+/**
+ * One mapping of an asset. The mapping stays valid until the last reference
+ * to it is released. It only keeps the contents the file had when it was
+ * mapped if the file is replaced by a rename, since the mapping keeps the old
+ * file; if the file is written in place, the changes show through, and
+ * reading past a shortened end faults.
+ */
+struct livec_asset_map {
+	struct arcp_region;
+	const void *data; /**< The contents of the file, or NULL if it is
+	                   *   empty. */
+	size_t len; /**< The length of the file. */
+	unsigned long version; /**< Incremented each time the file is
+	                        *   mapped again. */
+};
+
+/**
+ * Map a data file, such as a wavetable or lookup table, read-only into
+ * memory, and map it again whenever it changes. Opening the same path again,
+ * in any generation, gets the same asset without rereading the file, and the
+ * asset stays open for the life of the process.
+ *
+ * Save a changed asset by writing a new file and renaming it over the old
+ * one. A file written in place changes under the current mapping, which can
+ * fault if the file shrinks.
+ *
+ * @param path the file.
+ * @returns the asset, or NULL on error, with errno set.
+ */
+struct livec_asset *livec_asset_open(const char *path);
+
+/**
+ * Get the current mapping of an asset, which must be released with
+ * arcp_release() when done. Readers holding on to a mapping keep it, while
+ * new readers get the new one once the file changes.
+ *
+ * @returns the mapping, or NULL if the asset could not be mapped.
+ */
+struct livec_asset_map *livec_asset_acquire(struct livec_asset *asset);
+
+/**
+ * A group of tasks spawned on the pool, to wait for together. Initialize it
+ * with LIVEC_POOL_GROUP_INIT. It must outlast the tasks in it, so wait for
+ * them before it goes out of scope.
+ */
+struct livec_pool_group {
+	unsigned long pending; /**< Tasks spawned and not yet finished. */
+	unsigned long failed; /**< Tasks that took a fatal signal. */
+};
+
+#define LIVEC_POOL_GROUP_INIT { 0, 0 }
+
+/**
+ * Run a task on livec's work-stealing pool. The pool is started on first
+ * use, with --pool-threads workers. The task runs on behalf of the
+ * generation that spawned it, which stays loaded until the task finishes, so
+ * a reload never pulls code out from under a running task.
+ *
+ * A fatal signal in a task is handled as in a run thread: it counts as a
+ * crash of the generation that spawned the task, for --rollback, and the
+ * thread running it exits. The tasks that thread was running are counted as
+ * failed in their groups, and a worker is replaced. Recovery is best-effort;
+ * any lock the task held stays held.
+ *
+ * @param group the group to count the task in, or NULL.
+ * @returns 0 on success, -1 on error.
+ */
+int livec_pool_spawn(struct livec_pool_group *group, void (*fn)(void *),
+                     void *arg);
+
+/**
+ * Wait for every task in a group to finish, running pool tasks in the
+ * calling thread meanwhile.
+ *
+ * @returns 0 on success, -1 if any of the tasks failed.
+ */
+int livec_pool_wait(struct livec_pool_group *group);
+
+/**
+ * Call fn over the range [begin, end) on the pool, grain iterations at a
+ * time, with the calling thread taking part, and wait for it to finish.
+ *
+ * @param grain iterations per call to fn; 0 is taken as 1.
+ * @returns 0 on success, -1 if any call to fn failed.
+ */
+int livec_pool_parallel_for(size_t begin, size_t end, size_t grain,
+                            void (*fn)(size_t begin, size_t end, void *arg),
+                            void *arg);
+
+/**
+ * Print each pool worker's utilization, tasks run, and tasks stolen since
+ * the last report to stderr. This is done on each reload.
+ */
+void livec_pool_report(void);
+
 #endif /* ! LIVEC_H*/
@@ -0,0 +1,371 @@
+/* ab.c A/B comparison between consecutive generations
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+#include <atomickit/string.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * Each generation is measured by running the comparison function several
+ * times, once the generation is current, so that autolinked calls from it
+ * reach its own code, and the measurements are compared against those of
+ * the generation measured before it. The comparison function has to return,
+ * and must leave shared state alone; it can't create autolinks.
+ * Measurements run on a thread of their own, one generation at a time.
+ */
+
+/* a new generation this much slower than the old one is a regression */
+#define AB_REGRESSION_THRESHOLD 0.05
+
+enum {
+	AB_WALL,
+	AB_CYCLES,
+	AB_INSTRUCTIONS,
+	AB_CACHE_MISSES,
+	AB_ITLB_MISSES,
+	AB_DTLB_MISSES,
+	AB_NMETRICS
+};
+
+static const char *ab_metric_names[AB_NMETRICS] = {
+	"wall ns", "cycles", "instructions", "cache misses", "iTLB misses",
+	"dTLB misses"
+};
+
+#define AB_TLB_MISSES(tlb) ((tlb)					\
+                            | (PERF_COUNT_HW_CACHE_OP_READ << 8)	\
+                            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/* the hardware counters, for metrics AB_CYCLES on; the first one leads the
+ * group and must be available, the rest are counted if they are */
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} ab_counters[] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HW_CACHE, AB_TLB_MISSES(PERF_COUNT_HW_CACHE_ITLB) },
+	{ PERF_TYPE_HW_CACHE, AB_TLB_MISSES(PERF_COUNT_HW_CACHE_DTLB) }
+};
+
+#define AB_NCOUNTERS (sizeof(ab_counters) / sizeof(ab_counters[0]))
+
+/* a single timed run of one generation */
+struct ab_run {
+	livec_proc fn; /**< The function to run. */
+	unsigned int counted; /**< Bit mask of the metrics measured. */
+	uint64_t values[AB_NMETRICS]; /**< The measurements. */
+};
+
+/* all of the runs of one generation */
+struct ab_result {
+	unsigned long generation; /**< The generation measured. */
+	int nruns; /**< The number of runs. */
+	struct ab_run runs[]; /**< The runs. */
+};
+
+/* one generation is measured at a time */
+static pthread_mutex_t ab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* whether the calling thread is running the comparison function */
+static __thread bool ab_measuring = false;
+
+/**
+ * Whether the calling thread is running the A/B comparison function, which
+ * must not have side effects.
+ */
+bool ab_active() {
+	return ab_measuring;
+}
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd) {
+	return syscall(SYS_perf_event_open, attr, 0 /* this thread */,
+	               -1 /* any cpu */, group_fd, 0);
+}
+
+/* open the counter group; returns the group leader, or -1, and leaves -1
+ * in fds for the counters that aren't available */
+static int ab_counters_open(int *fds) {
+	struct perf_event_attr attr;
+	size_t i;
+
+	for(i = 0; i < AB_NCOUNTERS; i++) {
+		memset(&attr, 0, sizeof(struct perf_event_attr));
+		attr.size = sizeof(struct perf_event_attr);
+		attr.type = ab_counters[i].type;
+		attr.config = ab_counters[i].config;
+		attr.disabled = i == 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		fds[i] = perf_event_open(&attr, i == 0 ? -1 : fds[0]);
+		if((fds[i] < 0) && (i == 0)) {
+			return -1;
+		}
+	}
+	return fds[0];
+}
+
+static void ab_counters_close(int *fds) {
+	size_t i;
+	for(i = 0; i < AB_NCOUNTERS; i++) {
+		if(fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+}
+
+/* the content of the measuring thread; runs on behalf of the generation
+ * being measured */
+static void ab_measure(struct ab_run *run) {
+	int fds[AB_NCOUNTERS];
+	int leader;
+	size_t i, n;
+	ssize_t len;
+	struct timespec start, end;
+	struct {
+		uint64_t nr;
+		uint64_t values[AB_NCOUNTERS];
+	} group;
+
+	leader = ab_counters_open(fds);
+	run->counted = 1 << AB_WALL;
+	if(leader >= 0) {
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+	ab_measuring = true;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run->fn(args.argc, args.argv);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ab_measuring = false;
+	if(leader >= 0) {
+		ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		len = read(leader, &group, sizeof(group));
+		if((len > 0) && (group.nr <= AB_NCOUNTERS)
+		   && (len == (ssize_t) (sizeof(uint64_t) * (1 + group.nr)))) {
+			/* the group has only the counters that opened, in
+			 * order */
+			for(i = 0, n = 0; (i < AB_NCOUNTERS) && (n < group.nr);
+			    i++) {
+				if(fds[i] < 0) {
+					continue;
+				}
+				run->values[AB_CYCLES + i] = group.values[n++];
+				run->counted |= 1 << (AB_CYCLES + i);
+			}
+		}
+		ab_counters_close(fds);
+	}
+	run->values[AB_WALL] = (end.tv_sec - start.tv_sec) * 1000000000ULL
+		+ end.tv_nsec - start.tv_nsec;
+}
+
+static int uint64_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* median of one metric over all runs; sorts the scratch array */
+static uint64_t ab_median(struct ab_run *runs, int nruns, int metric,
+                          uint64_t *scratch) {
+	int i;
+	for(i = 0; i < nruns; i++) {
+		scratch[i] = runs[i].values[metric];
+	}
+	qsort(scratch, nruns, sizeof(uint64_t), uint64_cmp);
+	return scratch[nruns / 2];
+}
+
+static void ab_report(struct ab_result *old, struct ab_result *new,
+                      char *fname) {
+	int i;
+	unsigned int counted;
+	uint64_t scratch[old->nruns > new->nruns ? old->nruns : new->nruns];
+	uint64_t oldm[AB_NMETRICS], newm[AB_NMETRICS];
+	double delta, worst;
+
+	/* only report a counter if every run has it */
+	counted = ~0U;
+	for(i = 0; i < old->nruns; i++) {
+		counted &= old->runs[i].counted;
+	}
+	for(i = 0; i < new->nruns; i++) {
+		counted &= new->runs[i].counted;
+	}
+
+	fprintf(stderr, PROCTEXT("A/B '%s': generation %lu -> %lu,"
+	                         " median of %d runs\n"),
+	        fname, old->generation, new->generation, new->nruns);
+	worst = 0;
+	for(i = 0; i < AB_NMETRICS; i++) {
+		if(!(counted & (1 << i))) {
+			continue;
+		}
+		oldm[i] = ab_median(old->runs, old->nruns, i, scratch);
+		newm[i] = ab_median(new->runs, new->nruns, i, scratch);
+		delta = oldm[i] == 0 ? 0
+			: ((double) newm[i] - (double) oldm[i]) / oldm[i];
+		fprintf(stderr, "  %-14s %14llu %14llu %+7.1f%%\n",
+		        ab_metric_names[i],
+		        (unsigned long long) oldm[i],
+		        (unsigned long long) newm[i],
+		        delta * 100.0);
+		/* instructions and cache misses may legitimately go up when
+		 * the code gets faster; judge on time and cycles */
+		if((i == AB_WALL || i == AB_CYCLES) && delta > worst) {
+			worst = delta;
+		}
+	}
+	if(counted == 1 << AB_WALL) {
+		fprintf(stderr, "  (hardware counters unavailable)\n");
+	}
+	if(worst > AB_REGRESSION_THRESHOLD) {
+		fprintf(stderr, ERRORTEXT("Warning: generation %lu is %.1f%%"
+		                          " slower than generation %lu\n"),
+		        new->generation, worst * 100.0, old->generation);
+	}
+}
+
+static void ab_result_free(struct ab_result *result) {
+	if(result != NULL) {
+		afree(result, sizeof(struct ab_result)
+		      + sizeof(struct ab_run) * result->nruns);
+	}
+}
+
+/**
+ * Forget the A/B measurements of a context that is going away.
+ */
+void ab_forget(struct livec *lc) {
+	ab_result_free(lc->ab_last);
+	lc->ab_last = NULL;
+}
+
+/* measure a generation while it is current, and compare it against the
+ * generation of its context measured last */
+static void ab_measure_generation(struct dso_entry *entry) {
+	int i, nruns;
+	struct astr *fname;
+	struct livec *lc = entry->livec;
+	livec_proc fn;
+	struct ab_result *result;
+
+	fname = (struct astr *) arcp_load(&livec_opts.ab_function);
+	if(fname == NULL) {
+		return;
+	}
+	fn = (livec_proc) dlsym(entry->dlhandle, astr_cstr(fname));
+	if(fn == NULL) {
+		fprintf(stderr,
+		        ERRORTEXT("A/B: could not find '%s' function in %s\n"),
+		        astr_cstr(fname), entry->dsofile);
+		goto out0;
+	}
+
+	nruns = livec_opts.ab_runs;
+	result = amalloc(sizeof(struct ab_result)
+	                 + sizeof(struct ab_run) * nruns);
+	if(result == NULL) {
+		perror(ERRORTEXT("Failed to allocate memory for A/B runs"));
+		goto out0;
+	}
+	result->generation = entry->generation;
+	result->nruns = nruns;
+
+	pthread_mutex_lock(&ab_lock);
+	for(i = 0; i < nruns; i++) {
+		/* only while it is current do its autolinked calls reach its
+		 * own code */
+		if(entry != (struct dso_entry *)
+		   arcp_load_phantom(&lc->current_entry)) {
+			fprintf(stderr, ERRORTEXT("A/B: generation %lu was"
+			                          " replaced before it was"
+			                          " measured\n"),
+			        entry->generation);
+			goto out1;
+		}
+		result->runs[i].fn = fn;
+		if(run_sync(entry, (void (*)(void *)) ab_measure,
+		            &result->runs[i], livec_opts.ab_cpu) != 0) {
+			fprintf(stderr, ERRORTEXT("A/B: generation %lu died\n"),
+			        entry->generation);
+			goto out1;
+		}
+	}
+	if(lc->ab_last != NULL) {
+		ab_report(lc->ab_last, result, astr_cstr(fname));
+	}
+	ab_result_free(lc->ab_last);
+	lc->ab_last = result;
+	result = NULL;
+out1:
+	pthread_mutex_unlock(&ab_lock);
+	ab_result_free(result);
+out0:
+	arcp_release(fname);
+}
+
+/* the content of the A/B thread */
+static void *thread_ab(struct dso_entry *entry) {
+	ab_measure_generation(entry);
+	arcp_release(entry);
+	return NULL;
+}
+
+/**
+ * Compare the given generation, which has just been made current, against
+ * the one measured before it, by timing the comparison function in each
+ * while it was current. This happens on a thread of its own, and does
+ * nothing unless a comparison function was configured.
+ */
+void ab_compare(struct dso_entry *entry) {
+	int r;
+	pthread_t thread;
+
+	if(arcp_load_phantom(&livec_opts.ab_function) == NULL) {
+		return;
+	}
+	r = pthread_create(&thread, NULL, (void *(*)(void *)) thread_ab,
+	                   arcp_acquire(entry));
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create A/B thread")
+		        ": %s\n", strerror(r));
+		arcp_release(entry);
+		return;
+	}
+	pthread_detach(thread);
+}
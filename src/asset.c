@@ -0,0 +1,250 @@
+/* asset.c Hot-reloadable memory-mapped data files
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <alloca.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * Assets are kept on a list that only ever grows, since code in any
+ * generation may hold a pointer to one. Each has the current mapping of its
+ * file in an arcp_t; a watcher thread maps the file again when it changes and
+ * stores the new mapping, and the old one is unmapped when its last reader
+ * releases it.
+ */
+
+struct livec_asset {
+	struct livec_asset *next; /**< The next asset on the list. */
+	char *path; /**< The file. */
+	char *name; /**< The file name, within path. */
+	int dwatch; /**< The inotify watch on the file's directory. */
+	arcp_t map; /**< The current struct livec_asset_map. */
+	unsigned long version; /**< The version of the last mapping. */
+};
+
+static struct livec_asset *assets = NULL;
+
+/* serializes opening assets, so that each path is opened once */
+static pthread_mutex_t asset_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t asset_once = PTHREAD_ONCE_INIT;
+
+static int asset_notify_fd = -1;
+
+static void asset_map_destroy(struct livec_asset_map *map) {
+	if(map->data != NULL) {
+		munmap((void *) map->data, map->len);
+	}
+	afree(map, sizeof(struct livec_asset_map));
+}
+
+/* map the asset's file and make it the current mapping */
+static int asset_map(struct livec_asset *asset) {
+	int fd;
+	struct stat st;
+	struct livec_asset_map *map;
+	void *data = NULL;
+
+	fd = open(asset->path, O_RDONLY|O_CLOEXEC);
+	if(fd == -1) {
+		return -1;
+	}
+	if(fstat(fd, &st) != 0) {
+		goto error0;
+	}
+	if(st.st_size != 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			goto error0;
+		}
+	}
+	close(fd);
+
+	map = amalloc(sizeof(struct livec_asset_map));
+	if(map == NULL) {
+		if(data != NULL) {
+			munmap(data, st.st_size);
+		}
+		return -1;
+	}
+	arcp_region_init(map,
+	                 (void (*)(struct arcp_region *)) asset_map_destroy);
+	map->data = data;
+	map->len = st.st_size;
+	map->version = ++asset->version;
+	arcp_store(&asset->map, map);
+	arcp_release(map);
+	return 0;
+
+error0:
+	close(fd);
+	return -1;
+}
+
+/* map again the assets named by an inotify event */
+static void asset_changed(struct inotify_event *event) {
+	struct livec_asset *asset;
+
+	pthread_mutex_lock(&asset_lock);
+	for(asset = assets; asset != NULL; asset = asset->next) {
+		if((asset->dwatch != event->wd)
+		   || (strcmp(asset->name, event->name) != 0)) {
+			continue;
+		}
+		if(asset_map(asset) != 0) {
+			fprintf(stderr, ERRORTEXT("Failed to map asset %s")
+			        ": %s\n", asset->path, strerror(errno));
+		} else {
+			fprintf(stderr, PROCTEXT("Reloaded asset %s\n"),
+			        asset->path);
+		}
+	}
+	pthread_mutex_unlock(&asset_lock);
+}
+
+/* the content of the asset watcher thread */
+static void *thread_asset_watch(void *arg __attribute__((unused))) {
+	uint8_t inotify_buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	struct inotify_event *event;
+	size_t i;
+	ssize_t len;
+
+	for(;;) {
+		len = read(asset_notify_fd, inotify_buf,
+		           sizeof(struct inotify_event) + NAME_MAX + 1);
+		if(len <= 0) {
+			if((len < 0) && (errno == EINTR)) {
+				continue;
+			}
+			perror(ERRORTEXT("read() of inotify event failed"));
+			continue;
+		}
+		for(i = 0; i <= len - sizeof(struct inotify_event);) {
+			event = (struct inotify_event *) &inotify_buf[i];
+			i += sizeof(struct inotify_event) + event->len;
+			if((event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO))
+			   && (event->len != 0)) {
+				asset_changed(event);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void setup_assets(void) {
+	int r;
+	pthread_t thread;
+
+	asset_notify_fd = inotify_init1(IN_CLOEXEC);
+	if(asset_notify_fd < 0) {
+		perror(ERRORTEXT("Failed to initialize inotify system for"
+		                 " assets"));
+		return;
+	}
+	r = pthread_create(&thread, NULL, thread_asset_watch, NULL);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create asset watcher"
+		                          " thread") ": %s\n",
+		        strerror(r));
+		close(asset_notify_fd);
+		asset_notify_fd = -1;
+		return;
+	}
+	pthread_detach(thread);
+}
+
+struct livec_asset *livec_asset_open(const char *path) {
+	struct livec_asset *asset;
+	size_t len;
+	char *dirbuf;
+
+	pthread_once(&asset_once, setup_assets);
+
+	pthread_mutex_lock(&asset_lock);
+	for(asset = assets; asset != NULL; asset = asset->next) {
+		if(strcmp(asset->path, path) == 0) {
+			goto out;
+		}
+	}
+
+	asset = amalloc(sizeof(struct livec_asset));
+	if(asset == NULL) {
+		goto error0;
+	}
+	len = strlen(path);
+	asset->path = amalloc(len + 1);
+	if(asset->path == NULL) {
+		goto error1;
+	}
+	strcpy(asset->path, path);
+	asset->name = strrchr(asset->path, '/');
+	asset->name = asset->name == NULL ? asset->path : asset->name + 1;
+	arcp_init(&asset->map, NULL);
+	asset->version = 0;
+	if(asset_map(asset) != 0) {
+		goto error2;
+	}
+
+	/* watch the directory, since a new version is usually renamed into
+	 * place */
+	asset->dwatch = -1;
+	if(asset_notify_fd >= 0) {
+		dirbuf = alloca(len + 1);
+		strcpy(dirbuf, path);
+		asset->dwatch = inotify_add_watch(asset_notify_fd,
+		                                  dirname(dirbuf),
+		                                  IN_CLOSE_WRITE|IN_MOVED_TO);
+		if(asset->dwatch < 0) {
+			fprintf(stderr, ERRORTEXT("Failed to watch asset %s")
+			        ": %s\n", path, strerror(errno));
+		}
+	}
+	asset->next = assets;
+	assets = asset;
+out:
+	pthread_mutex_unlock(&asset_lock);
+	return asset;
+
+error2:
+	afree(asset->path, len + 1);
+error1:
+	afree(asset, sizeof(struct livec_asset));
+error0:
+	pthread_mutex_unlock(&asset_lock);
+	return NULL;
+}
+
+struct livec_asset_map *livec_asset_acquire(struct livec_asset *asset) {
+	return (struct livec_asset_map *) arcp_load(&asset->map);
+}
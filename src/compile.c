@@ -16,13 +16,24 @@
  * You should have received a copy of the GNU General Public License
  * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <alloca.h>
 #include <libgen.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <atomickit/rcp.h>
 #include <atomickit/string.h>
 #include <atomickit/malloc.h>
@@ -31,13 +42,355 @@
 #include "local.h"
 
 static const char *compiletmpl
-	= "%s -march=native %s %s -shared -fPIC -DPIC -o %s %s";
+	= "%s -march=native %s %s %s -shared -fPIC -DPIC -o %s %s";
+
+/* write a linker version script exporting only the symbols livec looks up:
+ * the entry, the A/B comparison function, and the autolinked functions */
+static int write_export_map(struct livec *lc, char *mapfile) {
+	FILE *map;
+	struct astr *entry;
+	struct astr *ab_function;
+
+	map = fopen(mapfile, "wxe");
+	if(map == NULL) {
+		fprintf(stderr, ERRORTEXT("Failed to create export map %s")
+		        ": %s\n", mapfile, strerror(errno));
+		return -1;
+	}
+	entry = (struct astr *) arcp_load(&lc->opts->entry);
+	ab_function = (struct astr *) arcp_load(&livec_opts.ab_function);
+	fprintf(map, "{\n\tglobal:\n");
+	fprintf(map, "\t\t%s;\n", astr_cstr(entry));
+	if((ab_function != NULL)
+	   && (strcmp(astr_cstr(ab_function), astr_cstr(entry)) != 0)) {
+		fprintf(map, "\t\t%s;\n", astr_cstr(ab_function));
+	}
+	if(livec_opts.stress != 0) {
+		fprintf(map, "\t\tlivec_stress;\n");
+	}
+	if(livec_opts.warmup) {
+		fprintf(map, "\t\tlivec_warmup;\n");
+	}
+	autolink_export(lc, map, astr_cstr(entry));
+	fprintf(map, "\tlocal:\n\t\t*;\n};\n");
+	arcp_release(entry);
+	arcp_release(ab_function);
+	if(fclose(map) != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to write export map %s")
+		        ": %s\n", mapfile, strerror(errno));
+		unlink(mapfile);
+		return -1;
+	}
+	return 0;
+}
+
+/* from linux/ioprio.h, which isn't exported to userspace everywhere */
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+/* stack for the child that isolates a compiler job; it only makes system
+ * calls */
+#define BUILD_STACK_SIZE (64 * 1024)
+
+/**
+ * How to keep a compiler job from getting in the way of the run threads.
+ * Everything is worked out before starting the child, so the child only
+ * has to make system calls.
+ */
+struct build_isolation {
+	bool nice; /**< Whether to change the nice value. */
+	int nice_value; /**< The nice value to change to. */
+	bool idle; /**< Whether to use idle cpu and io priority. */
+	bool cpus; /**< Whether to restrict the cpus. */
+	cpu_set_t cpuset; /**< The cpus to restrict to. */
+	int cgroup_fd; /**< The cgroup's cgroup.procs, or -1. */
+};
+
+/* what the child that isolates a compiler job needs */
+struct build_child {
+	struct build_isolation *iso; /**< The isolation to apply. */
+	char **argv; /**< The command to exec. */
+	int stdin_fd; /**< The source pipe, or -1. */
+	sigset_t *mask; /**< The signal mask to exec with. */
+	int error; /**< Errno of a failed exec, or 0. */
+};
+
+/* parse a cpu list such as "0-3,6" */
+static int parse_cpu_list(char *list, cpu_set_t *cpuset) {
+	char *end;
+	long first, last;
+	CPU_ZERO(cpuset);
+	for(;;) {
+		first = strtol(list, &end, 10);
+		if((end == list) || (first < 0) || (first >= CPU_SETSIZE)) {
+			return -1;
+		}
+		last = first;
+		if(*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if((end == list) || (last < first)
+			   || (last >= CPU_SETSIZE)) {
+				return -1;
+			}
+		}
+		for(; first <= last; first++) {
+			CPU_SET(first, cpuset);
+		}
+		if(*end == '\0') {
+			return 0;
+		}
+		if(*end != ',') {
+			return -1;
+		}
+		list = end + 1;
+	}
+}
+
+static void build_prepare(struct livec *lc, struct build_isolation *iso) {
+	struct astr *scpus;
+	struct astr *scgroup;
+
+	iso->nice = lc->opts->build_nice != 0;
+	iso->nice_value = lc->opts->build_nice;
+	iso->idle = lc->opts->build_idle;
+	iso->cpus = false;
+	iso->cgroup_fd = -1;
+
+	scpus = (struct astr *) arcp_load(&lc->opts->build_cpus);
+	if(scpus != NULL) {
+		if(parse_cpu_list(astr_cstr(scpus), &iso->cpuset) == 0) {
+			iso->cpus = true;
+		} else {
+			fprintf(stderr, ERRORTEXT("Invalid build cpu list '%s'\n"),
+			        astr_cstr(scpus));
+		}
+		arcp_release(scpus);
+	}
+
+	scgroup = (struct astr *) arcp_load(&lc->opts->build_cgroup);
+	if(scgroup != NULL) {
+		char procs[astr_len(scgroup) + 13 /* "/cgroup.procs" */ + 1];
+		strcpy(procs, astr_cstr(scgroup));
+		strcat(procs, "/cgroup.procs");
+		iso->cgroup_fd = open(procs, O_WRONLY|O_CLOEXEC);
+		if(iso->cgroup_fd < 0) {
+			fprintf(stderr, ERRORTEXT("Failed to open %s") ": %s\n",
+			        procs, strerror(errno));
+		}
+		arcp_release(scgroup);
+	}
+}
+
+/* whether a compiler job needs anything done to it before exec */
+static bool build_isolated(struct build_isolation *iso) {
+	return iso->nice || iso->idle || iso->cpus || (iso->cgroup_fd >= 0);
+}
+
+/* in the child: apply the isolation to ourselves; failures are ignored,
+ * since the build is better run unisolated than not at all */
+static void build_isolate(struct build_isolation *iso) {
+	struct sched_param param;
+	char pid[24];
+	int i;
+	pid_t p;
+
+	if(iso->cgroup_fd >= 0) {
+		/* format our pid by hand; no stdio in the child */
+		i = sizeof(pid);
+		p = getpid();
+		do {
+			pid[--i] = '0' + p % 10;
+			p /= 10;
+		} while(p != 0);
+		if(write(iso->cgroup_fd, pid + i, sizeof(pid) - i) < 0) {
+			/* stay where we are */
+		}
+	}
+	if(iso->cpus) {
+		sched_setaffinity(0, sizeof(cpu_set_t), &iso->cpuset);
+	}
+	if(iso->nice) {
+		setpriority(PRIO_PROCESS, 0, iso->nice_value);
+	}
+	if(iso->idle) {
+		param.sched_priority = 0;
+		sched_setscheduler(0, SCHED_IDLE, &param);
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		        IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+	}
+}
+
+/* the content of the child that isolates a compiler job. It shares our
+ * memory until it execs, like a vfork() child, so it only makes system
+ * calls; our signal handlers are reset first, since they would run on our
+ * memory too */
+static int build_child(struct build_child *child) {
+	struct sigaction act;
+	struct sigaction old;
+	int sig;
+
+	memset(&act, 0, sizeof(struct sigaction));
+	act.sa_handler = SIG_DFL;
+	sigemptyset(&act.sa_mask);
+	for(sig = 1; sig < _NSIG; sig++) {
+		if((sigaction(sig, NULL, &old) == 0)
+		   && (old.sa_handler != SIG_DFL)
+		   && (old.sa_handler != SIG_IGN)) {
+			sigaction(sig, &act, NULL);
+		}
+	}
+	if(child->stdin_fd >= 0) {
+		dup2(child->stdin_fd, STDIN_FILENO);
+	}
+	build_isolate(child->iso);
+	sigprocmask(SIG_SETMASK, child->mask, NULL);
+	execv("/bin/sh", child->argv);
+	child->error = errno;
+	return 127;
+}
+
+/* start a compiler job that needs isolating. A plain fork() would mark
+ * every writable page of ours copy-on-write, and the run threads would
+ * then fault on them; a child sharing our memory until it execs, as
+ * posix_spawn() uses, leaves them alone */
+static pid_t build_clone(struct build_isolation *iso, char **argv,
+                         int stdin_fd) {
+	struct build_child child;
+	sigset_t all, mask;
+	void *stack;
+	pid_t pid;
+
+	stack = mmap(NULL, BUILD_STACK_SIZE, PROT_READ|PROT_WRITE,
+	             MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+	if(stack == MAP_FAILED) {
+		return -1;
+	}
+	child.iso = iso;
+	child.argv = argv;
+	child.stdin_fd = stdin_fd;
+	child.mask = &mask;
+	child.error = 0;
+
+	/* no signal handler may run in the child before it resets them */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &mask);
+	/* we're suspended until the child execs or exits */
+	pid = clone((int (*)(void *)) build_child,
+	            (char *) stack + BUILD_STACK_SIZE,
+	            CLONE_VM|CLONE_VFORK|SIGCHLD, &child);
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+	munmap(stack, BUILD_STACK_SIZE);
+
+	if((pid > 0) && (child.error != 0)) {
+		/* the exec failed; reap the child */
+		waitpid(pid, NULL, 0);
+		errno = child.error;
+		return -1;
+	}
+	return pid;
+}
+
+/* start a compiler job that needs nothing done to it */
+static pid_t build_spawn(char **argv, int stdin_fd) {
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+	int r;
+
+	r = posix_spawn_file_actions_init(&actions);
+	if(r != 0) {
+		errno = r;
+		return -1;
+	}
+	if(stdin_fd >= 0) {
+		r = posix_spawn_file_actions_adddup2(&actions, stdin_fd,
+		                                     STDIN_FILENO);
+	}
+	if(r == 0) {
+		r = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv,
+		                environ);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	if(r != 0) {
+		errno = r;
+		return -1;
+	}
+	return pid;
+}
+
+/* run the compile command, isolated as configured, feeding it the source on
+ * its stdin if given; returns the wait status, or -1 */
+static int run_compiler(struct livec *lc, char *compilecmd, char *source,
+                        size_t len) {
+	struct build_isolation iso;
+	char *argv[] = { "sh", "-c", compilecmd, NULL };
+	int pipefd[2] = { -1, -1 };
+	pid_t pid;
+	ssize_t r;
+	int status = -1;
+
+	if((source != NULL) && (pipe2(pipefd, O_CLOEXEC) != 0)) {
+		perror(ERRORTEXT("Failed to create pipe to compiler"));
+		return -1;
+	}
+	build_prepare(lc, &iso);
+
+	if(build_isolated(&iso)) {
+		pid = build_clone(&iso, argv, pipefd[0]);
+	} else {
+		pid = build_spawn(argv, pipefd[0]);
+	}
+	if(pid < 0) {
+		perror(ERRORTEXT("Failed to start compiler"));
+	}
+
+	if(source != NULL) {
+		close(pipefd[0]);
+		while((pid > 0) && (len > 0)) {
+			r = write(pipefd[1], source, len);
+			if(r < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				/* the compiler gave up early; its status
+				 * tells why */
+				break;
+			}
+			source += r;
+			len -= r;
+		}
+		close(pipefd[1]);
+	}
+	if(iso.cgroup_fd >= 0) {
+		close(iso.cgroup_fd);
+	}
+	if(pid < 0) {
+		return -1;
+	}
+	while(waitpid(pid, &status, 0) < 0) {
+		if(errno != EINTR) {
+			perror(ERRORTEXT("Failed to wait for compiler"));
+			return -1;
+		}
+	}
+	return status;
+}
 
 /**
  * (Re-)compile the file and return the temporarily allocated dso file.
+ *
+ * @param lc the context whose options to compile with.
+ * @param sfilename the source file name; the DSO is named after it.
+ * @param source the source to compile, or NULL to compile the file. Given
+ * source is piped to the compiler, with the file's directory in the include
+ * path, so the file itself is never read.
+ * @param len the length of the source.
  */
-char *compile(struct astr *sfilename) {
+char *compile(struct livec *lc, struct astr *sfilename, char *source,
+              size_t len) {
 	int r;
+	uint64_t start;
 	struct astr *sbuilddir;
 	struct astr *scompiler;
 	struct astr *sldflags;
@@ -46,14 +399,17 @@ char *compile(struct astr *sfilename) {
 	char *extension;
 	char *cflags;
 	char *ldflags;
+	char *extraflags;
+	char *mapfile = NULL;
 	char *dsofile;
+	char *input;
 	char *compilecmd;
 
 	/* load all the configuration options */
-	sbuilddir = (struct astr *) arcp_load(&livec_opts.builddir);
-	scompiler = (struct astr *) arcp_load(&livec_opts.compiler);
-	sldflags = (struct astr *) arcp_load(&livec_opts.ldflags);
-	scflags = (struct astr *) arcp_load(&livec_opts.cflags);
+	sbuilddir = (struct astr *) arcp_load(&lc->opts->builddir);
+	scompiler = (struct astr *) arcp_load(&lc->opts->compiler);
+	sldflags = (struct astr *) arcp_load(&lc->opts->ldflags);
+	scflags = (struct astr *) arcp_load(&lc->opts->cflags);
 
 	if(sbuilddir == NULL) {
 		fprintf(stderr,
@@ -130,24 +486,82 @@ char *compile(struct astr *sfilename) {
 		close(tmpfd);
 	}
 
+	/* flags livec itself needs */
+	extraflags = alloca(320 + strlen(dsofile) + 4 /* ".map" */);
+	extraflags[0] = '\0';
+	if(livec_opts.profile != 0) {
+		/* only the DSO's own functions can be autolinked; inline
+		 * functions from headers would just slow every call down */
+		strcat(extraflags, " -finstrument-functions"
+		       " -finstrument-functions-exclude-file-list="
+		       "/usr/include/,/usr/lib/gcc/,livec.h,atomickit/");
+	}
+	if(livec_opts.hotpatch) {
+		strcat(extraflags, " -fpatchable-function-entry=7,5");
+	}
+	if(livec_opts.hugepages) {
+		/* so that the text can be moved onto huge pages */
+		strcat(extraflags, " -Wl,-z,max-page-size=0x200000"
+		       " -Wl,-z,common-page-size=0x200000");
+	}
+	if(lc->opts->export_map) {
+		/* keep everything else out of the dynamic symbol table */
+		mapfile = alloca(strlen(dsofile) + 4 /* ".map" */ + 1);
+		strcpy(mapfile, dsofile);
+		strcat(mapfile, ".map");
+		if(write_export_map(lc, mapfile) == 0) {
+			strcat(extraflags, " -fno-semantic-interposition"
+			       " -Wl,--version-script=");
+			strcat(extraflags, mapfile);
+		} else {
+			mapfile = NULL;
+		}
+	}
+
+	if(source == NULL) {
+		input = astr_cstr(sfilename);
+	} else {
+		/* read C from stdin, with includes found as if it were the
+		 * file */
+		char *dir;
+		dir = alloca(astr_len(sfilename) + 1);
+		strcpy(dir, astr_cstr(sfilename));
+		dir = dirname(dir);
+		input = alloca(2 /* "-I" */ + strlen(dir)
+		               + 8 /* " -x c -" */ + 1);
+		strcpy(input, "-I");
+		strcat(input, dir);
+		strcat(input, " -x c -");
+	}
+
 	/* create the compile command from the template */
-	compilecmd = alloca(strlen(compiletmpl) - 10 /* 10 is the length of the
+	compilecmd = alloca(strlen(compiletmpl) - 12 /* 12 is the length of the
 							sprintf characters */
 	                    + astr_len(scompiler)
 	                    + strlen(ldflags)
 	                    + strlen(cflags)
+	                    + strlen(extraflags)
 	                    + strlen(dsofile)
-	                    + astr_len(sfilename)
+	                    + strlen(input)
 	                    + 1);
 	sprintf(compilecmd, compiletmpl,
 	        astr_cstr(scompiler),
 	        ldflags,
 	        cflags,
+	        extraflags,
 	        dsofile,
-	        astr_cstr(sfilename));
+	        input);
 	/* print and run the compile command */
 	fprintf(stderr, "%s\n", compilecmd);
-	r = system(compilecmd);
+	start = event_clock();
+	r = run_compiler(lc, compilecmd, source, len);
+	event_log(EVENT_COMPILE, 0,
+	          (r >= 0) && WIFEXITED(r) ? WEXITSTATUS(r) : -1,
+	          event_clock() - start, astr_cstr(sfilename));
+	if((mapfile != NULL) && (unlink(mapfile) != 0)) {
+		fprintf(stderr, ERRORTEXT("Failed to unlink %s") ": %s\n",
+		        mapfile, strerror(errno));
+	}
 	if((r < 0)
 	   || (! WIFEXITED(r))
 	   || (WEXITSTATUS(r) != EXIT_SUCCESS)) {
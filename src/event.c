@@ -0,0 +1,320 @@
+/* event.c Structured log of reload events
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <atomickit/rcp.h>
+#include <atomickit/string.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * Events are posted as fixed-size records to a multi-producer ring, and a
+ * writer thread formats them as JSON lines. Posting never blocks or
+ * allocates, and only uses functions that are safe in a signal handler; if
+ * the ring is full the event is dropped, and the writer reports how many were
+ * dropped.
+ */
+
+/* number of events the ring holds */
+#define EVENT_RING_SIZE 256
+
+/* maximum length of the text of an event */
+#define EVENT_TEXT_MAX 200
+
+struct event {
+	uint64_t time; /**< Wall clock time, in ns. */
+	int type; /**< One of the EVENT_* types. */
+	int status; /**< Exit status, exit code, or signal number. */
+	unsigned long generation; /**< The generation, or 0. */
+	uint64_t hash; /**< Hash of the source. */
+	uint64_t ns[2]; /**< Durations. */
+	char text[EVENT_TEXT_MAX]; /**< File name or error message. */
+};
+
+static const char *event_names[] = {
+	"compile", "reload", "dlopen_error", "dlsym_error", "exit", "signal",
+	"switch"
+};
+
+static struct livec_ring *event_ring = NULL;
+static FILE *event_file = NULL;
+static sem_t event_sem;
+static unsigned long event_dropped = 0;
+
+/**
+ * The current time on the monotonic clock, in ns.
+ */
+uint64_t event_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void event_post(struct event *event) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	event->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	if(livec_ring_push(event_ring, event, 1) != 1) {
+		__atomic_add_fetch(&event_dropped, 1, __ATOMIC_RELAXED);
+	}
+	sem_post(&event_sem);
+}
+
+/**
+ * Log an event. Safe to call from a signal handler.
+ *
+ * @param type the EVENT_* type.
+ * @param generation the generation the event concerns, or 0.
+ * @param status the exit status, exit code, or signal number.
+ * @param ns how long the event took, in ns.
+ * @param text a file name or error message, or NULL.
+ */
+void event_log(int type, unsigned long generation, int status, uint64_t ns,
+               const char *text) {
+	struct event event;
+	if(event_ring == NULL) {
+		return;
+	}
+	memset(&event, 0, sizeof(struct event));
+	event.type = type;
+	event.generation = generation;
+	event.status = status;
+	event.ns[0] = ns;
+	if(text != NULL) {
+		strncpy(event.text, text, EVENT_TEXT_MAX - 1);
+	}
+	event_post(&event);
+}
+
+/**
+ * Log a successful reload.
+ *
+ * @param generation the new generation.
+ * @param hash the hash of the source it was built from.
+ * @param compile_ns how long compiling took.
+ * @param load_ns how long loading and relinking took.
+ */
+void event_reload(unsigned long generation, uint64_t hash,
+                  uint64_t compile_ns, uint64_t load_ns) {
+	struct event event;
+	if(event_ring == NULL) {
+		return;
+	}
+	memset(&event, 0, sizeof(struct event));
+	event.type = EVENT_RELOAD;
+	event.generation = generation;
+	event.hash = hash;
+	event.ns[0] = compile_ns;
+	event.ns[1] = load_ns;
+	event_post(&event);
+}
+
+static uint64_t fnv1a(uint64_t hash, uint8_t *buf, size_t len) {
+	size_t i;
+	for(i = 0; i < len; i++) {
+		hash ^= buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Hash a source (64-bit FNV-1a).
+ *
+ * @param filename the source file.
+ * @param source the source itself, if it isn't to be read from the file, or
+ * NULL.
+ * @param len the length of source.
+ * @returns the hash, or 0 if the event log is disabled or the file can't be
+ * read.
+ */
+uint64_t event_source_hash(char *filename, char *source, size_t len) {
+	int fd;
+	ssize_t r;
+	uint8_t buf[4096];
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	if(event_ring == NULL) {
+		return 0;
+	}
+	if(source != NULL) {
+		return fnv1a(hash, (uint8_t *) source, len);
+	}
+	fd = open(filename, O_RDONLY|O_CLOEXEC);
+	if(fd < 0) {
+		return 0;
+	}
+	while((r = read(fd, buf, sizeof(buf))) > 0) {
+		hash = fnv1a(hash, buf, r);
+	}
+	close(fd);
+	return r < 0 ? 0 : hash;
+}
+
+/* write a JSON string */
+static void event_write_str(const char *s) {
+	fputc('"', event_file);
+	for(; *s != '\0'; s++) {
+		switch(*s) {
+		case '"':
+			fputs("\\\"", event_file);
+			break;
+		case '\\':
+			fputs("\\\\", event_file);
+			break;
+		case '\n':
+			fputs("\\n", event_file);
+			break;
+		case '\t':
+			fputs("\\t", event_file);
+			break;
+		default:
+			if((unsigned char) *s < 0x20) {
+				fprintf(event_file, "\\u%04x", *s);
+			} else {
+				fputc(*s, event_file);
+			}
+		}
+	}
+	fputc('"', event_file);
+}
+
+static void event_write(struct event *event) {
+	fprintf(event_file, "{\"time\":%llu,\"event\":\"%s\"",
+	        (unsigned long long) event->time, event_names[event->type]);
+	if(event->generation != 0) {
+		fprintf(event_file, ",\"generation\":%lu", event->generation);
+	}
+	switch(event->type) {
+	case EVENT_COMPILE:
+		fprintf(event_file, ",\"status\":%d,\"ns\":%llu",
+		        event->status, (unsigned long long) event->ns[0]);
+		break;
+	case EVENT_RELOAD:
+		fprintf(event_file, ",\"source_hash\":\"%016llx\""
+		        ",\"compile_ns\":%llu,\"load_ns\":%llu",
+		        (unsigned long long) event->hash,
+		        (unsigned long long) event->ns[0],
+		        (unsigned long long) event->ns[1]);
+		break;
+	case EVENT_EXIT:
+		fprintf(event_file, ",\"code\":%d", event->status);
+		break;
+	case EVENT_SIGNAL:
+		fprintf(event_file, ",\"signal\":%d", event->status);
+		break;
+	}
+	if(event->text[0] != '\0') {
+		fputs(event->type == EVENT_DLOPEN_ERROR
+		      || event->type == EVENT_DLSYM_ERROR
+		      ? ",\"error\":" : ",\"file\":", event_file);
+		event_write_str(event->text);
+	}
+	fputs("}\n", event_file);
+}
+
+/* the content of the writer thread */
+static void *thread_event(void *arg __attribute__((unused))) {
+	struct event events[16];
+	size_t i, n;
+	unsigned long dropped;
+
+	for(;;) {
+		while(sem_wait(&event_sem) != 0) {
+			/* EINTR */
+		}
+		while((n = livec_ring_pop(event_ring, events, 16)) > 0) {
+			for(i = 0; i < n; i++) {
+				event_write(&events[i]);
+			}
+		}
+		dropped = __atomic_exchange_n(&event_dropped, 0,
+		                              __ATOMIC_RELAXED);
+		if(dropped != 0) {
+			fprintf(event_file, "{\"event\":\"dropped\","
+			        "\"count\":%lu}\n", dropped);
+		}
+		if(fflush(event_file) != 0) {
+			perror(ERRORTEXT("Failed to write event log"));
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Open the event log and start its writer thread, if an event log was
+ * configured. The log is shared by every context.
+ *
+ * @returns 0 on success, -1 on error.
+ */
+int setup_events() {
+	int r;
+	pthread_t thread;
+	struct astr *path;
+
+	path = (struct astr *) arcp_load(&livec_opts.events);
+	if(path == NULL) {
+		return 0;
+	}
+	event_file = fopen(astr_cstr(path), "ae");
+	if(event_file == NULL) {
+		fprintf(stderr, ERRORTEXT("Failed to open event log %s")
+		        ": %s\n", astr_cstr(path), strerror(errno));
+		arcp_release(path);
+		return -1;
+	}
+	arcp_release(path);
+	if(sem_init(&event_sem, 0, 0) != 0) {
+		perror(ERRORTEXT("Failed to initialize event semaphore"));
+		goto error0;
+	}
+	event_ring = ring_create(sizeof(struct event), EVENT_RING_SIZE,
+	                         LIVEC_RING_MPSC);
+	if(event_ring == NULL) {
+		perror(ERRORTEXT("Failed to create event ring"));
+		goto error1;
+	}
+	r = pthread_create(&thread, NULL, thread_event, NULL);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create event log thread")
+		        ": %s\n", strerror(r));
+		goto error2;
+	}
+	pthread_detach(thread);
+	return 0;
+
+error2:
+	livec_ring_close(event_ring);
+	event_ring = NULL;
+error1:
+	sem_destroy(&event_sem);
+error0:
+	fclose(event_file);
+	event_file = NULL;
+	return -1;
+}
@@ -0,0 +1,502 @@
+/* heap.c Per-generation heap accounting
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <link.h>
+#include <dlfcn.h>
+#include <atomickit/rcp.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * With --heap-track, malloc and friends are interposed, and every allocation
+ * called directly from the code of a loaded generation gets a small header
+ * recording which generation made it. The generation is found from the
+ * return address, by looking it up in the address ranges of the loaded
+ * generations' code. When a generation is unloaded, its live and freed
+ * bytes are reported; whatever is still live then has outlived the code
+ * that allocated it, and is most likely leaked.
+ *
+ * The accounting records are never freed, since blocks can be freed long
+ * after the generation that allocated them is gone.
+ *
+ * The interposers themselves are in malloc.c, which is only linked into the
+ * livec program, so that liblivec never replaces its host's allocator. They
+ * are weak, so they are only in effect when nothing else defines malloc
+ * first; in a statically linked livec, glibc's own wins and tracking is
+ * disabled.
+ */
+
+/* maximum number of generations loaded at once that can be tracked */
+#define HEAP_RANGES 256
+
+/* marks a tracked block, xored with the block's address */
+#define HEAP_MAGIC 0x6c69766563686561ULL
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+/* the accounting for one generation */
+struct heap_gen {
+	unsigned long generation; /**< The generation. */
+	unsigned long allocs; /**< Number of blocks allocated. */
+	unsigned long frees; /**< Number of blocks freed. */
+	size_t live_bytes; /**< Bytes allocated and not yet freed. */
+	size_t freed_bytes; /**< Bytes allocated and freed. */
+};
+
+/* the code of a loaded generation */
+struct heap_range {
+	uintptr_t start; /**< Start of the code. */
+	uintptr_t end; /**< End of the code, or 0 if the slot is free. */
+	struct heap_gen *gen; /**< The accounting, or NULL if the slot is
+	                       *   free. */
+	struct dso_entry *entry; /**< The generation; not referenced, and
+	                          *   only ever compared against. */
+	struct livec *lc; /**< The context of the generation. */
+};
+
+/* the header in front of a tracked block; keeps the block 16-byte
+ * aligned, and puts the tag where glibc has its chunk size, which is the
+ * only word before an untracked block that is safe to read */
+struct heap_block {
+	struct heap_gen *gen; /**< The generation that allocated it. */
+	size_t size; /**< The size requested. */
+	uint64_t pad;
+	uint64_t tag; /**< HEAP_MAGIC ^ the address of the block. */
+};
+
+static bool heap_enabled = false;
+
+/* set by malloc.c when its interposers are the ones in effect */
+bool heap_interposed = false;
+
+static struct heap_range heap_ranges[HEAP_RANGES];
+
+/* one past the highest slot ever used */
+static int heap_nranges = 0;
+
+static size_t (*libc_malloc_usable_size)(void *ptr) = NULL;
+
+/* glibc has no __libc_ entry point for malloc_usable_size, so find its own
+ * the first time it is needed, whether or not tracking is on */
+static size_t heap_libc_usable_size(void *ptr) {
+	size_t (*fn)(void *ptr);
+
+	fn = __atomic_load_n(&libc_malloc_usable_size, __ATOMIC_ACQUIRE);
+	if(fn == NULL) {
+		fn = (size_t (*)(void *)) dlsym(RTLD_NEXT,
+		                                "malloc_usable_size");
+		if(fn == NULL) {
+			fprintf(stderr, ERRORTEXT("Fatal: could not find"
+			                          " malloc_usable_size\n"));
+			abort();
+		}
+		__atomic_store_n(&libc_malloc_usable_size, fn,
+		                 __ATOMIC_RELEASE);
+	}
+	return fn(ptr);
+}
+
+/* find the accounting for the generation whose code contains addr */
+static struct heap_gen *heap_lookup(void *addr) {
+	int i, n;
+	uintptr_t a = (uintptr_t) addr;
+	uintptr_t end;
+
+	n = __atomic_load_n(&heap_nranges, __ATOMIC_ACQUIRE);
+	for(i = 0; i < n; i++) {
+		end = __atomic_load_n(&heap_ranges[i].end, __ATOMIC_ACQUIRE);
+		if((end != 0) && (a >= heap_ranges[i].start) && (a < end)) {
+			return __atomic_load_n(&heap_ranges[i].gen,
+			                       __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+/* the header of ptr, if it is a tracked block, otherwise NULL */
+static struct heap_block *heap_block_of(void *ptr) {
+	struct heap_block *block;
+	block = ((struct heap_block *) ptr) - 1;
+	if(block->tag != (HEAP_MAGIC ^ (uintptr_t) ptr)) {
+		return NULL;
+	}
+	return block;
+}
+
+/* set up the header of a newly allocated block and return the block */
+static void *heap_block_init(struct heap_block *block, struct heap_gen *gen,
+                             size_t size) {
+	block->gen = gen;
+	block->size = size;
+	block->tag = HEAP_MAGIC ^ (uintptr_t) (block + 1);
+	__atomic_add_fetch(&gen->allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&gen->live_bytes, size, __ATOMIC_RELAXED);
+	return block + 1;
+}
+
+/* account for a tracked block going away */
+static void heap_block_release(struct heap_block *block) {
+	block->tag = 0;
+	__atomic_add_fetch(&block->gen->frees, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&block->gen->live_bytes, block->size,
+	                   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&block->gen->freed_bytes, block->size,
+	                   __ATOMIC_RELAXED);
+}
+
+/**
+ * malloc(), attributing the block to the generation whose code contains
+ * caller, if any.
+ */
+void *heap_malloc(size_t size, void *caller) {
+	struct heap_gen *gen;
+	struct heap_block *block;
+
+	if(!heap_enabled
+	   || ((gen = heap_lookup(caller)) == NULL)
+	   || (size > SIZE_MAX - sizeof(struct heap_block))) {
+		return __libc_malloc(size);
+	}
+	block = __libc_malloc(sizeof(struct heap_block) + size);
+	if(block == NULL) {
+		return NULL;
+	}
+	return heap_block_init(block, gen, size);
+}
+
+/**
+ * calloc(), attributing the block to the generation whose code contains
+ * caller, if any.
+ */
+void *heap_calloc(size_t nmemb, size_t size, void *caller) {
+	struct heap_gen *gen;
+	struct heap_block *block;
+
+	if(!heap_enabled
+	   || ((gen = heap_lookup(caller)) == NULL)
+	   || ((size != 0) && (nmemb > (SIZE_MAX - sizeof(struct heap_block))
+	                                / size))) {
+		return __libc_calloc(nmemb, size);
+	}
+	block = __libc_calloc(1, sizeof(struct heap_block) + nmemb * size);
+	if(block == NULL) {
+		return NULL;
+	}
+	return heap_block_init(block, gen, nmemb * size);
+}
+
+/**
+ * free(), for tracked blocks and untracked ones alike.
+ */
+void heap_free(void *ptr) {
+	struct heap_block *block;
+
+	if(!heap_enabled || (ptr == NULL)
+	   || ((block = heap_block_of(ptr)) == NULL)) {
+		__libc_free(ptr);
+		return;
+	}
+	heap_block_release(block);
+	__libc_free(block);
+}
+
+/**
+ * realloc(), attributing a new block to the generation whose code contains
+ * caller, if any. A block that was not tracked stays untracked, even if it
+ * is reallocated from a generation's code.
+ */
+void *heap_realloc(void *ptr, size_t size, void *caller) {
+	struct heap_gen *gen;
+	struct heap_block *block;
+	struct heap_block *new_block;
+
+	if(!heap_enabled) {
+		return __libc_realloc(ptr, size);
+	}
+	if(ptr == NULL) {
+		gen = heap_lookup(caller);
+		if((gen == NULL)
+		   || (size > SIZE_MAX - sizeof(struct heap_block))) {
+			return __libc_malloc(size);
+		}
+		block = __libc_malloc(sizeof(struct heap_block) + size);
+		if(block == NULL) {
+			return NULL;
+		}
+		return heap_block_init(block, gen, size);
+	}
+	block = heap_block_of(ptr);
+	if(block == NULL) {
+		return __libc_realloc(ptr, size);
+	}
+	if(size == 0) {
+		heap_block_release(block);
+		__libc_free(block);
+		return NULL;
+	}
+	if(size > SIZE_MAX - sizeof(struct heap_block)) {
+		return NULL;
+	}
+
+	/* the block may move, so count it as freed and allocated again */
+	gen = block->gen;
+	new_block = __libc_realloc(block, sizeof(struct heap_block) + size);
+	if(new_block == NULL) {
+		return NULL;
+	}
+	__atomic_sub_fetch(&gen->live_bytes, new_block->size,
+	                   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&gen->freed_bytes, new_block->size,
+	                   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&gen->frees, 1, __ATOMIC_RELAXED);
+	return heap_block_init(new_block, gen, size);
+}
+
+/**
+ * malloc_usable_size(), for tracked blocks and untracked ones alike.
+ */
+size_t heap_malloc_usable_size(void *ptr) {
+	struct heap_block *block;
+
+	if(ptr == NULL) {
+		return 0;
+	}
+	if(!heap_enabled || ((block = heap_block_of(ptr)) == NULL)) {
+		return heap_libc_usable_size(ptr);
+	}
+	return heap_libc_usable_size(block) - sizeof(struct heap_block);
+}
+
+/**
+ * Turn on heap tracking if it was asked for and the interposed allocator is
+ * the one in effect.
+ */
+void setup_heap() {
+	if(!livec_opts.heap_track) {
+		return;
+	}
+	if(!heap_interposed) {
+		fprintf(stderr, ERRORTEXT("Heap tracking is unavailable: malloc"
+		                          " is not interposed\n"));
+		return;
+	}
+	__atomic_store_n(&heap_enabled, true, __ATOMIC_RELEASE);
+}
+
+struct phdr_search {
+	uintptr_t base; /**< The load address of the DSO looked for. */
+	uintptr_t start; /**< The start of its code, once found. */
+	uintptr_t end; /**< The end of its code, or 0 if not found. */
+};
+
+/* find the extent of the executable segments of the DSO loaded at
+ * search->base */
+static int heap_phdr_callback(struct dl_phdr_info *info,
+                              size_t size __attribute__((unused)),
+                              void *data) {
+	struct phdr_search *search = (struct phdr_search *) data;
+	uintptr_t start, end;
+	int i;
+
+	if(info->dlpi_addr != search->base) {
+		return 0;
+	}
+	for(i = 0; i < info->dlpi_phnum; i++) {
+		if((info->dlpi_phdr[i].p_type != PT_LOAD)
+		   || !(info->dlpi_phdr[i].p_flags & PF_X)) {
+			continue;
+		}
+		start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+		end = start + info->dlpi_phdr[i].p_memsz;
+		if((search->end == 0) || (start < search->start)) {
+			search->start = start;
+		}
+		if(end > search->end) {
+			search->end = end;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Start attributing allocations made by the code of a newly loaded
+ * generation to it.
+ */
+void heap_load(struct dso_entry *entry) {
+	struct link_map *map;
+	struct phdr_search search;
+	struct heap_gen *gen;
+	struct heap_gen *null = NULL;
+	int i, n;
+
+	if(!heap_enabled) {
+		return;
+	}
+	if(dlinfo(entry->dlhandle, RTLD_DI_LINKMAP, &map) != 0) {
+		fprintf(stderr, ERRORTEXT("Could not find where %s is loaded:"
+		                          " %s\n"),
+		        entry->dsofile, dlerror());
+		return;
+	}
+	search.base = map->l_addr;
+	search.start = 0;
+	search.end = 0;
+	dl_iterate_phdr(heap_phdr_callback, &search);
+	if(search.end == 0) {
+		fprintf(stderr, ERRORTEXT("Could not find the code of %s\n"),
+		        entry->dsofile);
+		return;
+	}
+
+	gen = __libc_malloc(sizeof(struct heap_gen));
+	if(gen == NULL) {
+		perror(ERRORTEXT("Failed to allocate memory for heap"
+		                 " accounting"));
+		return;
+	}
+	gen->generation = entry->generation;
+	gen->allocs = 0;
+	gen->frees = 0;
+	gen->live_bytes = 0;
+	gen->freed_bytes = 0;
+
+	/* claim a free slot; the range only becomes visible once end is
+	 * set */
+	for(i = 0; i < HEAP_RANGES; i++) {
+		null = NULL;
+		if(__atomic_compare_exchange_n(&heap_ranges[i].gen, &null, gen,
+		                               false, __ATOMIC_ACQUIRE,
+		                               __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if(i == HEAP_RANGES) {
+		fprintf(stderr, ERRORTEXT("Too many generations loaded to track"
+		                          " the heap of generation %lu\n"),
+		        entry->generation);
+		return;
+	}
+	heap_ranges[i].start = search.start;
+	heap_ranges[i].entry = entry;
+	heap_ranges[i].lc = entry->livec;
+	__atomic_store_n(&heap_ranges[i].end, search.end, __ATOMIC_RELEASE);
+	n = __atomic_load_n(&heap_nranges, __ATOMIC_RELAXED);
+	while((n < i + 1)
+	      && !__atomic_compare_exchange_n(&heap_nranges, &n, i + 1, true,
+	                                      __ATOMIC_RELEASE,
+	                                      __ATOMIC_RELAXED));
+}
+
+/* print the generations of a context that are still loaded, and what is
+ * keeping each of them loaded */
+static void heap_pinned(struct livec *lc) {
+	int i, n, pins;
+	bool history;
+	struct dso_entry *current;
+	struct dso_entry *entry;
+	struct heap_gen *gen;
+	bool any = false;
+
+	current = (struct dso_entry *) arcp_load_phantom(&lc->current_entry);
+	n = __atomic_load_n(&heap_nranges, __ATOMIC_ACQUIRE);
+	for(i = 0; i < n; i++) {
+		if((__atomic_load_n(&heap_ranges[i].end, __ATOMIC_ACQUIRE) == 0)
+		   || (heap_ranges[i].lc != lc)) {
+			continue;
+		}
+		entry = heap_ranges[i].entry;
+		gen = heap_ranges[i].gen;
+		if(!any) {
+			fprintf(stderr, PROCTEXT("Still loaded:\n"));
+			any = true;
+		}
+		fprintf(stderr, "  generation %lu: %zu bytes live;",
+		        gen->generation,
+		        __atomic_load_n(&gen->live_bytes, __ATOMIC_RELAXED));
+		if(entry == current) {
+			fprintf(stderr, " current");
+		}
+		history = history_holds(entry);
+		if(history) {
+			fprintf(stderr, " history");
+		}
+		pins = autolink_pins(lc, entry);
+		if(pins != 0) {
+			fprintf(stderr, " %d autolink%s", pins,
+			        pins == 1 ? "" : "s");
+		}
+		if((entry != current) && !history && (pins == 0)) {
+			fprintf(stderr, " running threads or other"
+			        " references");
+		}
+		fputc('\n', stderr);
+	}
+}
+
+/**
+ * Stop attributing allocations to a generation that is being unloaded, and
+ * report on its heap use and on the generations still loaded.
+ */
+void heap_unload(struct dso_entry *entry) {
+	int i, n;
+	struct heap_gen *gen;
+
+	if(!heap_enabled) {
+		return;
+	}
+	n = __atomic_load_n(&heap_nranges, __ATOMIC_ACQUIRE);
+	for(i = 0; i < n; i++) {
+		if((__atomic_load_n(&heap_ranges[i].end, __ATOMIC_ACQUIRE) != 0)
+		   && (heap_ranges[i].entry == entry)) {
+			break;
+		}
+	}
+	if(i == n) {
+		return;
+	}
+	gen = heap_ranges[i].gen;
+	__atomic_store_n(&heap_ranges[i].end, 0, __ATOMIC_RELEASE);
+	heap_ranges[i].entry = NULL;
+	heap_ranges[i].lc = NULL;
+	__atomic_store_n(&heap_ranges[i].gen, NULL, __ATOMIC_RELEASE);
+
+	fprintf(stderr, PROCTEXT("Generation %lu heap: %zu bytes live, %zu"
+	                         " bytes freed; %lu of %lu blocks freed\n"),
+	        gen->generation,
+	        __atomic_load_n(&gen->live_bytes, __ATOMIC_RELAXED),
+	        __atomic_load_n(&gen->freed_bytes, __ATOMIC_RELAXED),
+	        __atomic_load_n(&gen->frees, __ATOMIC_RELAXED),
+	        __atomic_load_n(&gen->allocs, __ATOMIC_RELAXED));
+	if(__atomic_load_n(&gen->live_bytes, __ATOMIC_RELAXED) != 0) {
+		fprintf(stderr, ERRORTEXT("Generation %lu leaked %zu"
+		                          " bytes\n"),
+		        gen->generation,
+		        __atomic_load_n(&gen->live_bytes, __ATOMIC_RELAXED));
+	}
+	heap_pinned(entry->livec);
+}
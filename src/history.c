@@ -0,0 +1,222 @@
+/* history.c Warm history of loaded generations
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+
+#include "livec.h"
+#include "local.h"
+
+/**
+ * The history of loaded generations of a context, oldest first. Each
+ * generation in it stays loaded until it falls out of the history, so that
+ * switching back to it is just a relink. The history is never modified in
+ * place; it is replaced by a modified copy, with the context's switch_lock
+ * held. The selected generation is whichever of them is current, so the two
+ * can't disagree.
+ */
+struct gen_history {
+	struct arcp_region;
+	size_t len; /**< Number of generations. */
+	struct dso_entry *gens[]; /**< The generations. */
+};
+
+static void gen_history_destroy(struct gen_history *hist) {
+	size_t i;
+	for(i = 0; i < hist->len; i++) {
+		arcp_release(hist->gens[i]);
+	}
+	afree(hist, sizeof(struct gen_history)
+	      + sizeof(struct dso_entry *) * hist->len);
+}
+
+static struct gen_history *gen_history_alloc(size_t len) {
+	struct gen_history *hist;
+	hist = amalloc(sizeof(struct gen_history)
+	               + sizeof(struct dso_entry *) * len);
+	if(hist == NULL) {
+		return NULL;
+	}
+	arcp_region_init(hist,
+	                 (void (*)(struct arcp_region *)) gen_history_destroy);
+	hist->len = len;
+	return hist;
+}
+
+/**
+ * Add a newly loaded generation to the end of its context's history,
+ * dropping the oldest generations as needed to stay within the configured
+ * number of generations and memory budget. The context's switch_lock must be
+ * held.
+ */
+void history_push(struct dso_entry *entry) {
+	size_t i, first, len;
+	size_t mem;
+	struct livec *lc;
+	struct gen_history *hist;
+	struct gen_history *new_hist;
+
+	/* only the standalone context is switched through its history */
+	lc = entry->livec;
+	if((livec_opts.history == 0) || (lc != &livec_main)) {
+		return;
+	}
+	hist = (struct gen_history *) arcp_load(&lc->history);
+	len = hist == NULL ? 0 : hist->len;
+
+	/* work out how many of the old generations we can keep */
+	first = 0;
+	if(len + 1 > (size_t) livec_opts.history) {
+		first = len + 1 - livec_opts.history;
+	}
+	if(livec_opts.history_mem != 0) {
+		mem = entry->dsosize;
+		for(i = len; i > first; i--) {
+			mem += hist->gens[i - 1]->dsosize;
+			if(mem > livec_opts.history_mem * 1024) {
+				first = i;
+				break;
+			}
+		}
+	}
+
+	new_hist = gen_history_alloc(len - first + 1);
+	if(new_hist == NULL) {
+		perror(ERRORTEXT("Failed to allocate memory for generation"
+		                 " history"));
+		arcp_release(hist);
+		return;
+	}
+	for(i = first; i < len; i++) {
+		new_hist->gens[i - first] = (struct dso_entry *)
+			arcp_acquire(hist->gens[i]);
+	}
+	new_hist->gens[len - first] = (struct dso_entry *) arcp_acquire(entry);
+	arcp_store(&lc->history, new_hist);
+	arcp_release(new_hist);
+	arcp_release(hist);
+}
+
+/* the index of the current generation in the history, or -1 if it isn't in
+ * it; switch_lock must be held */
+static ssize_t history_pos(struct livec *lc, struct gen_history *hist) {
+	size_t i;
+	struct dso_entry *current;
+
+	current = (struct dso_entry *) arcp_load_phantom(&lc->current_entry);
+	for(i = 0; i < hist->len; i++) {
+		if(hist->gens[i] == current) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* switch to the generation at index pos in the history; switch_lock must be
+ * held */
+static void history_switch(struct gen_history *hist, size_t pos) {
+	fprintf(stderr, PROCTEXT("Switching to generation %lu (%zu of"
+	                         " %zu)...\n"),
+	        hist->gens[pos]->generation, pos + 1, hist->len);
+	switch_locked(hist->gens[pos]);
+}
+
+/**
+ * Switch to the generation delta steps away from the current one in a
+ * context's history.
+ */
+void history_step(struct livec *lc, int delta) {
+	struct gen_history *hist;
+	ssize_t pos;
+
+	pthread_mutex_lock(&lc->switch_lock);
+	hist = (struct gen_history *) arcp_load(&lc->history);
+	if(hist == NULL) {
+		fprintf(stderr, ERRORTEXT("No generation history\n"));
+		goto out;
+	}
+	pos = history_pos(lc, hist);
+	if(pos < 0) {
+		fprintf(stderr, ERRORTEXT("The current generation is not in"
+		                          " the history\n"));
+		goto out;
+	}
+	pos += delta;
+	if((pos < 0) || ((size_t) pos >= hist->len)) {
+		fprintf(stderr, ERRORTEXT("No %s generation in history\n"),
+		        delta < 0 ? "older" : "newer");
+		goto out;
+	}
+	history_switch(hist, pos);
+out:
+	arcp_release(hist);
+	pthread_mutex_unlock(&lc->switch_lock);
+}
+
+/**
+ * Whether a generation is being kept loaded by its context's history.
+ */
+bool history_holds(struct dso_entry *entry) {
+	struct gen_history *hist;
+	size_t i;
+	bool found = false;
+
+	hist = (struct gen_history *) arcp_load(&entry->livec->history);
+	if(hist != NULL) {
+		for(i = 0; i < hist->len; i++) {
+			if(hist->gens[i] == entry) {
+				found = true;
+				break;
+			}
+		}
+	}
+	arcp_release(hist);
+	return found;
+}
+
+/**
+ * Switch to the generation with the given number, if it is still in a
+ * context's history.
+ */
+void history_select(struct livec *lc, unsigned long generation) {
+	struct gen_history *hist;
+	size_t i;
+
+	pthread_mutex_lock(&lc->switch_lock);
+	hist = (struct gen_history *) arcp_load(&lc->history);
+	if(hist != NULL) {
+		for(i = 0; i < hist->len; i++) {
+			if(hist->gens[i]->generation == generation) {
+				history_switch(hist, i);
+				goto out;
+			}
+		}
+	}
+	fprintf(stderr, ERRORTEXT("Generation %lu is not in the history\n"),
+	        generation);
+out:
+	arcp_release(hist);
+	pthread_mutex_unlock(&lc->switch_lock);
+}
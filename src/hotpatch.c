@@ -0,0 +1,435 @@
+/* hotpatch.c Redirecting old generations' functions with direct jumps
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * With hot patching enabled, DSOs are compiled with
+ * -fpatchable-function-entry=7,5, which puts five bytes of nops before each
+ * function and two at its entry (after any endbr64). When an autolink is
+ * relinked, the old function is patched to jump straight to the new one: a
+ * jmp rel32 goes into the five bytes before the function, every core is
+ * serialized, and then the two nops at the entry are replaced by a short jmp
+ * back to it. Each write is a single atomic store, so a thread running
+ * through the entry sees either the old or the new instruction, never a mix.
+ *
+ * Code that calls functions directly, or through a stale pointer, then ends up
+ * in the newest generation with only a direct jump on the way. Jumps are never
+ * chained: on each relink, every function already patched under that name is
+ * pointed straight at the new version, and the generations they used to jump
+ * to are let go. A thread that had already jumped into one of those is not
+ * counted, so it has to be out of it by the time it is unloaded.
+ */
+
+#define PATCH_AREA 5
+
+/**
+ * A patched function entry.
+ */
+struct hotpatch {
+	struct hotpatch *next;
+	struct astr *fname; /**< The name of the autolink patched. */
+	uint8_t *fn; /**< The patched function. */
+	uint8_t *site; /**< The patched entry nops. */
+	struct dso_entry *from_entry; /**< The generation patched; not
+	                               *   referenced, since the patch goes
+	                               *   with it. */
+	struct dso_entry *target_entry; /**< The generation jumped to. */
+};
+
+/* patching is rare; just keep it to one thread at a time */
+static pthread_mutex_t hotpatch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* every patched function, of every context and generation */
+static struct hotpatch *hotpatches = NULL;
+
+static pthread_once_t hotpatch_once = PTHREAD_ONCE_INIT;
+
+/* 0 once hot patching is ready, -1 if it can't be done */
+static int hotpatch_ready = -1;
+
+static const uint8_t endbr64[4] = { 0xf3, 0x0f, 0x1e, 0xfa };
+static const uint8_t entry_nops[2] = { 0x90, 0x90 };
+
+static int membarrier(int cmd) {
+	return syscall(__NR_membarrier, cmd, 0, 0);
+}
+
+/* make sure every core sees modified code before it next executes it;
+ * returns -1 if that can't be done */
+static int sync_cores(void) {
+	return membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE);
+}
+
+/* whether len bytes at p lie within one aligned 8-byte word */
+static bool text_fits(uint8_t *p, size_t len) {
+	return ((uintptr_t) p & 7) + len <= 8;
+}
+
+/* atomically replace len bytes at p, which must fit in one aligned 8-byte
+ * word */
+static void text_poke(uint8_t *p, const uint8_t *bytes, size_t len) {
+	uint64_t *word;
+	uint64_t old, new;
+	size_t off;
+
+	word = (uint64_t *) ((uintptr_t) p & ~(uintptr_t) 7);
+	off = p - (uint8_t *) word;
+	old = __atomic_load_n(word, __ATOMIC_RELAXED);
+	do {
+		new = old;
+		memcpy((uint8_t *) &new + off, bytes, len);
+	} while(!__atomic_compare_exchange_n(word, &old, new, false,
+	                                     __ATOMIC_SEQ_CST,
+	                                     __ATOMIC_RELAXED));
+}
+
+/* change the protection of the pages around a patch site */
+static int text_protect(uint8_t *site, int prot) {
+	uintptr_t pagesize, start, end;
+	pagesize = sysconf(_SC_PAGESIZE);
+	start = ((uintptr_t) site - PATCH_AREA - 8) & ~(pagesize - 1);
+	end = ((uintptr_t) site + 8 + pagesize - 1) & ~(pagesize - 1);
+	return mprotect((void *) start, end - start, prot);
+}
+
+/* the short jump from a patch site back to the patch area */
+static uint8_t patch_rel8(uint8_t *fn, uint8_t *site) {
+	return (uint8_t) (int8_t) ((fn - PATCH_AREA) - (site + 2));
+}
+
+/* find the patchable entry nops of the function at fn, or NULL */
+static uint8_t *patch_site(uint8_t *fn) {
+	uint8_t *site;
+	int i;
+
+	site = memcmp(fn, endbr64, sizeof(endbr64)) == 0
+		? fn + sizeof(endbr64) : fn;
+	if((memcmp(site, entry_nops, sizeof(entry_nops)) != 0)
+	   && ((site[0] != 0xeb) || (site[1] != patch_rel8(fn, site)))) {
+		return NULL;
+	}
+	if(fn[-PATCH_AREA] == 0xe9) {
+		/* patched before */
+		return site;
+	}
+	for(i = 1; i <= PATCH_AREA; i++) {
+		if(fn[-i] != 0x90) {
+			return NULL;
+		}
+	}
+	return site;
+}
+
+/* the jmp rel32 for the patch area of fn, going to to; returns -1 if to is
+ * out of reach of a direct jump */
+static int patch_jmp(uint8_t *fn, void *to, uint8_t jmp[PATCH_AREA]) {
+	intptr_t rel;
+	int32_t rel32;
+
+	rel = (uint8_t *) to - fn;
+	if((rel < INT32_MIN) || (rel > INT32_MAX)) {
+		return -1;
+	}
+	rel32 = rel;
+	jmp[0] = 0xe9;
+	memcpy(&jmp[1], &rel32, sizeof(int32_t));
+	return 0;
+}
+
+/* put the entry nops of a patched function back; returns -1 if a core may
+ * still take the jump */
+static int patch_undo(struct hotpatch *patch) {
+	if(text_protect(patch->site, PROT_READ|PROT_WRITE|PROT_EXEC) != 0) {
+		perror(ERRORTEXT("Failed to unprotect patched function"));
+		return -1;
+	}
+	text_poke(patch->site, entry_nops, sizeof(entry_nops));
+	if(sync_cores() != 0) {
+		perror(ERRORTEXT("Failed to synchronize cores after"
+		                 " unpatching"));
+		text_protect(patch->site, PROT_READ|PROT_EXEC);
+		return -1;
+	}
+	text_protect(patch->site, PROT_READ|PROT_EXEC);
+	return 0;
+}
+
+/* put a patch on the list to be freed once hotpatch_lock is dropped, since
+ * letting go of the generation it jumps to may unload that, which takes the
+ * lock again; the generation is kept loaded unless release is set, for when
+ * a core may still take the jump */
+static void patch_drop(struct hotpatch *patch, bool release,
+                       struct hotpatch **dead) {
+	if(!release) {
+		patch->target_entry = NULL;
+	}
+	patch->next = *dead;
+	*dead = patch;
+}
+
+/* free the patches dropped with patch_drop */
+static void patch_reap(struct hotpatch *dead) {
+	struct hotpatch *patch;
+	while((patch = dead) != NULL) {
+		dead = patch->next;
+		arcp_release(patch->target_entry);
+		arcp_release(patch->fname);
+		afree(patch, sizeof(struct hotpatch));
+	}
+}
+
+/* point every function already patched for fname in the context of
+ * to_entry at to; the patch area is rewritten in one store, so a core sees
+ * either the old jump or the new one */
+static void hotpatch_retarget(struct astr *fname,
+                              struct dso_entry *to_entry, void *to,
+                              struct hotpatch **dead) {
+	struct hotpatch **pp;
+	struct hotpatch *patch;
+	struct hotpatch *moved;
+	struct hotpatch *done = NULL;
+	uint8_t jmp[PATCH_AREA];
+
+	pp = &hotpatches;
+	while((patch = *pp) != NULL) {
+		if((patch->from_entry->livec != to_entry->livec)
+		   || (patch->target_entry == to_entry)
+		   || (strcmp(astr_cstr(patch->fname), astr_cstr(fname))
+		       != 0)) {
+			pp = &patch->next;
+			continue;
+		}
+		*pp = patch->next;
+		moved = NULL;
+		if((patch_jmp(patch->fn, to, jmp) != 0)
+		   || ((moved = amalloc(sizeof(struct hotpatch))) == NULL)
+		   || (text_protect(patch->site,
+		                    PROT_READ|PROT_WRITE|PROT_EXEC) != 0)) {
+			/* can't go straight there; rather run the old
+			 * code than chain jumps */
+			if(moved != NULL) {
+				afree(moved, sizeof(struct hotpatch));
+			}
+			patch_drop(patch, patch_undo(patch) == 0, dead);
+			continue;
+		}
+		text_poke(patch->fn - PATCH_AREA, jmp, PATCH_AREA);
+		text_protect(patch->site, PROT_READ|PROT_EXEC);
+		/* the old patch keeps the generation jumped to before, to
+		 * be let go once every core sees the new jump */
+		*moved = *patch;
+		moved->fname = (struct astr *) arcp_acquire(patch->fname);
+		moved->target_entry = (struct dso_entry *)
+			arcp_acquire(to_entry);
+		moved->next = done;
+		done = moved;
+		patch->next = *dead;
+		*dead = patch;
+	}
+	if((done != NULL) && (sync_cores() != 0)) {
+		/* a core may still take an old jump, so what it goes to
+		 * stays loaded */
+		perror(ERRORTEXT("Failed to synchronize cores after hot"
+		                 " patching"));
+		for(patch = *dead; patch != NULL; patch = patch->next) {
+			patch->target_entry = NULL;
+		}
+	}
+	while((patch = done) != NULL) {
+		done = patch->next;
+		patch->next = hotpatches;
+		hotpatches = patch;
+	}
+}
+
+/**
+ * Patch the function from, the version of the autolink fname in the
+ * generation from_entry, to jump to the function to, in the generation
+ * to_entry. Functions patched before for fname are pointed straight at to.
+ *
+ * @returns 0 on success, -1 if the function can't be patched.
+ */
+int hotpatch(struct astr *fname, struct dso_entry *from_entry, void *from,
+             struct dso_entry *to_entry, void *to) {
+	uint8_t *fn = from;
+	uint8_t *site;
+	uint8_t jmp[PATCH_AREA];
+	uint8_t shortjmp[2];
+	struct hotpatch *patch;
+	struct hotpatch *dead = NULL;
+	int ret = -1;
+
+	if(hotpatch_setup() != 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&hotpatch_lock);
+	hotpatch_retarget(fname, to_entry, to, &dead);
+	site = patch_site(fn);
+	if((site == NULL)
+	   || !text_fits(fn - PATCH_AREA, PATCH_AREA)
+	   || !text_fits(site, 2)
+	   || (patch_jmp(fn, to, jmp) != 0)) {
+		goto out;
+	}
+	for(patch = hotpatches; patch != NULL; patch = patch->next) {
+		if(patch->fn == fn) {
+			/* already retargeted above */
+			ret = 0;
+			goto out;
+		}
+	}
+	patch = amalloc(sizeof(struct hotpatch));
+	if(patch == NULL) {
+		goto out;
+	}
+
+	shortjmp[0] = 0xeb;
+	shortjmp[1] = patch_rel8(fn, site);
+
+	/* code that not every core is sure to see mustn't be written */
+	if(sync_cores() != 0) {
+		perror(ERRORTEXT("Refusing to hot patch: failed to synchronize"
+		                 " cores"));
+		afree(patch, sizeof(struct hotpatch));
+		goto out;
+	}
+	if(text_protect(site, PROT_READ|PROT_WRITE|PROT_EXEC) != 0) {
+		afree(patch, sizeof(struct hotpatch));
+		goto out;
+	}
+	text_poke(fn - PATCH_AREA, jmp, PATCH_AREA);
+	if(sync_cores() != 0) {
+		/* nothing jumps to the new patch area yet */
+		perror(ERRORTEXT("Refusing to hot patch: failed to synchronize"
+		                 " cores"));
+		text_protect(site, PROT_READ|PROT_EXEC);
+		afree(patch, sizeof(struct hotpatch));
+		goto out;
+	}
+	text_poke(site, shortjmp, sizeof(shortjmp));
+	if(sync_cores() != 0) {
+		/* the jump is written in one go, so a core that doesn't see
+		 * it yet just runs the old code for a while */
+		perror(ERRORTEXT("Failed to synchronize cores after hot"
+		                 " patching"));
+	}
+	text_protect(site, PROT_READ|PROT_EXEC);
+
+	/* the jump keeps the generation it goes to loaded */
+	patch->fname = (struct astr *) arcp_acquire(fname);
+	patch->fn = fn;
+	patch->site = site;
+	patch->from_entry = from_entry;
+	patch->target_entry = (struct dso_entry *) arcp_acquire(to_entry);
+	patch->next = hotpatches;
+	hotpatches = patch;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&hotpatch_lock);
+	patch_reap(dead);
+	return ret;
+}
+
+/**
+ * Undo all the patches in a generation, before it becomes current again.
+ */
+void hotpatch_restore(struct dso_entry *entry) {
+	struct hotpatch **pp;
+	struct hotpatch *patch;
+	struct hotpatch *dead = NULL;
+
+	pthread_mutex_lock(&hotpatch_lock);
+	pp = &hotpatches;
+	while((patch = *pp) != NULL) {
+		if(patch->from_entry != entry) {
+			pp = &patch->next;
+			continue;
+		}
+		*pp = patch->next;
+		/* if a core may still take the jump, what it goes to stays
+		 * loaded */
+		patch_drop(patch, patch_undo(patch) == 0, &dead);
+	}
+	pthread_mutex_unlock(&hotpatch_lock);
+	patch_reap(dead);
+}
+
+/**
+ * Forget the patches in a generation that is being unloaded.
+ */
+void hotpatch_free(struct dso_entry *entry) {
+	struct hotpatch **pp;
+	struct hotpatch *patch;
+	struct hotpatch *dead = NULL;
+
+	pthread_mutex_lock(&hotpatch_lock);
+	pp = &hotpatches;
+	while((patch = *pp) != NULL) {
+		if(patch->from_entry != entry) {
+			pp = &patch->next;
+			continue;
+		}
+		*pp = patch->next;
+		patch_drop(patch, true, &dead);
+	}
+	pthread_mutex_unlock(&hotpatch_lock);
+	patch_reap(dead);
+}
+
+static void hotpatch_register(void) {
+#if defined(__x86_64__)
+	if(membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE)
+	   != 0) {
+		perror(ERRORTEXT("Hot patching unavailable: failed to register"
+		                 " for core-serializing membarrier"));
+		return;
+	}
+	hotpatch_ready = 0;
+#else
+	fprintf(stderr, ERRORTEXT("Hot patching is only supported on"
+	                          " x86-64\n"));
+#endif
+}
+
+/**
+ * Check that hot patching can be done here, and get ready for it. May be
+ * called any number of times; hotpatch() calls it first, so that embedded
+ * contexts, which never run the standalone main, can hot patch too.
+ *
+ * @returns 0 if hot patching can be used, -1 otherwise.
+ */
+int hotpatch_setup() {
+	pthread_once(&hotpatch_once, hotpatch_register);
+	return hotpatch_ready;
+}
@@ -0,0 +1,199 @@
+/* hugepage.c Huge-page backing for generations and their data
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <link.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <atomickit/rcp.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * A DSO's text is mapped from its file with ordinary pages. With
+ * --hugepages, each generation is linked with its segments aligned to huge
+ * pages, and after loading, the huge-page-aligned part of its text is copied
+ * into anonymous memory advised to use transparent huge pages, which is then
+ * moved over the original with mremap(). The move replaces the old mapping
+ * in one step, so if anything fails the text is left where it was. This
+ * happens before any of the generation's code runs apart from its
+ * constructors, so nothing is executing there meanwhile. dlclose() unmaps
+ * the whole extent of the DSO, replacement included.
+ */
+
+#define HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+#define HUGEPAGE_DOWN(x) ((x) & ~(HUGEPAGE_SIZE - 1))
+#define HUGEPAGE_UP(x) HUGEPAGE_DOWN((x) + HUGEPAGE_SIZE - 1)
+
+struct hugepage_search {
+	uintptr_t base; /**< The load address of the DSO looked for. */
+	size_t remapped; /**< Bytes moved onto huge pages. */
+	size_t text; /**< Bytes of text. */
+	int error; /**< Errno of a failure, or 0. */
+};
+
+/* move the huge-page-aligned part of a segment onto huge pages; on error,
+ * the segment is left as it was */
+static int hugepage_remap_range(uintptr_t start, uintptr_t end, int prot) {
+	size_t len = end - start;
+	void *copy;
+	int err;
+
+	/* aligned, so that the copy faults in huge pages */
+	copy = livec_hugepage_alloc(len);
+	if(copy == NULL) {
+		return -1;
+	}
+	memcpy(copy, (void *) start, len);
+	if(mprotect(copy, len, prot) != 0) {
+		goto error;
+	}
+	if(mremap(copy, len, len, MREMAP_MAYMOVE|MREMAP_FIXED,
+	          (void *) start) == MAP_FAILED) {
+		goto error;
+	}
+	__builtin___clear_cache((char *) start, (char *) end);
+	return 0;
+
+error:
+	err = errno;
+	livec_hugepage_free(copy, len);
+	errno = err;
+	return -1;
+}
+
+static int hugepage_phdr_callback(struct dl_phdr_info *info,
+                                  size_t size __attribute__((unused)),
+                                  void *data) {
+	struct hugepage_search *search = (struct hugepage_search *) data;
+	uintptr_t start, end;
+	int i, prot;
+
+	if(info->dlpi_addr != search->base) {
+		return 0;
+	}
+	for(i = 0; i < info->dlpi_phnum; i++) {
+		if((info->dlpi_phdr[i].p_type != PT_LOAD)
+		   || !(info->dlpi_phdr[i].p_flags & PF_X)) {
+			continue;
+		}
+		start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+		end = start + info->dlpi_phdr[i].p_filesz;
+		search->text += end - start;
+		start = HUGEPAGE_UP(start);
+		end = HUGEPAGE_DOWN(end);
+		if(start >= end) {
+			continue;
+		}
+		prot = PROT_EXEC;
+		if(info->dlpi_phdr[i].p_flags & PF_R) {
+			prot |= PROT_READ;
+		}
+		if(hugepage_remap_range(start, end, prot) != 0) {
+			search->error = errno;
+			continue;
+		}
+		search->remapped += end - start;
+	}
+	return 1;
+}
+
+/**
+ * Move the text of a newly loaded generation onto huge pages, as far as its
+ * alignment allows.
+ */
+void hugepage_remap(struct dso_entry *entry) {
+	struct link_map *map;
+	struct hugepage_search search;
+
+	if(dlinfo(entry->dlhandle, RTLD_DI_LINKMAP, &map) != 0) {
+		fprintf(stderr, ERRORTEXT("Could not find where %s is loaded:"
+		                          " %s\n"),
+		        entry->dsofile, dlerror());
+		return;
+	}
+	search.base = map->l_addr;
+	search.remapped = 0;
+	search.text = 0;
+	search.error = 0;
+	dl_iterate_phdr(hugepage_phdr_callback, &search);
+	if(search.error != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to remap the text of %s onto"
+		                          " huge pages") ": %s\n",
+		        entry->dsofile, strerror(search.error));
+	}
+	if(search.remapped == 0) {
+		fprintf(stderr, PROCTEXT("Text of generation %lu (%zu KiB) is"
+		                         " too small for huge pages\n"),
+		        entry->generation, search.text / 1024);
+		return;
+	}
+	fprintf(stderr, PROCTEXT("Moved %zu of %zu KiB of the text of"
+	                         " generation %lu onto huge pages\n"),
+	        search.remapped / 1024, search.text / 1024,
+	        entry->generation);
+}
+
+void *livec_hugepage_alloc(size_t size) {
+	size_t len;
+	uintptr_t p, aligned;
+
+	if(size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	len = HUGEPAGE_UP(size);
+	if(len < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* map enough extra to align the start, and trim it off */
+	p = (uintptr_t) mmap(NULL, len + HUGEPAGE_SIZE,
+	                     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+	                     -1, 0);
+	if((void *) p == MAP_FAILED) {
+		return NULL;
+	}
+	aligned = HUGEPAGE_UP(p);
+	if(aligned != p) {
+		munmap((void *) p, aligned - p);
+	}
+	if(aligned + len != p + len + HUGEPAGE_SIZE) {
+		munmap((void *) (aligned + len),
+		       p + len + HUGEPAGE_SIZE - (aligned + len));
+	}
+	if(madvise((void *) aligned, len, MADV_HUGEPAGE) != 0) {
+		/* still usable, just with ordinary pages */
+		perror(ERRORTEXT("madvise(MADV_HUGEPAGE) failed"));
+	}
+	return (void *) aligned;
+}
+
+void livec_hugepage_free(void *ptr, size_t size) {
+	if(ptr != NULL) {
+		munmap(ptr, HUGEPAGE_UP(size));
+	}
+}
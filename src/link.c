@@ -18,11 +18,18 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
 #include <atomickit/rcp.h>
 #include <atomickit/malloc.h>
 #include <atomickit/dict.h>
@@ -41,6 +48,11 @@ struct dso_afptr {
 	struct afptr;
 	struct dso_entry *entry; /**< The DSO entry in which the pointed to
 	                              function is found. */
+	void *target; /**< The pointed to function. */
+	struct dso_afptr *retired_next; /**< The next function retired from
+	                                     the same slot. */
+	unsigned long epoch; /**< Once retired, the relink epoch it was
+	                          retired in. */
 };
 
 /**
@@ -51,10 +63,17 @@ struct alink_entry {
 	struct arcp_region;
 	arcp_t afptr; /**< The arcp_t in which the function to be dispatched
 	                   to is stored. */
-	void *dispatch_fptr;
+	void *dispatch_fptr; /**< The generic dispatch function, or NULL
+	                          for a typed autolink. */
+	struct autolink_slot *slot; /**< The slot of a typed autolink, or
+	                                 NULL. */
+	struct alink_stats *stats; /**< Call statistics, or NULL if
+	                                profiling is disabled. */
 };
 
-static arcp_t autolink_table = ARCP_VAR_INIT(NULL);
+/* the generation number of the most recently loaded dso_entry, in any
+ * context */
+static unsigned long last_generation = 0;
 
 static void dso_afptr_destroy(struct dso_afptr *afptr) {
 	arcp_release(afptr->entry);
@@ -70,17 +89,233 @@ static struct dso_afptr *dso_afptr_create(struct dso_entry *entry, void *fptr) {
 
 	afptr_init(afptr, fptr, (void (*)(struct afptr *)) dso_afptr_destroy);
 	afptr->entry = (struct dso_entry *) arcp_acquire(entry);
+	afptr->target = fptr;
 	return afptr;
 }
 
+/* take a typed autolink's slot for relinking; returns false if someone else
+ * has it and wait is false */
+static bool autolink_slot_lock(struct autolink_slot *slot, bool wait) {
+	bool unlocked;
+	for(;;) {
+		unlocked = false;
+		if(__atomic_compare_exchange_n(&slot->resolving, &unlocked,
+		                               true, false, __ATOMIC_ACQUIRE,
+		                               __ATOMIC_RELAXED)) {
+			return true;
+		}
+		if(!wait) {
+			return false;
+		}
+		sched_yield();
+	}
+}
+
+static void autolink_slot_unlock(struct autolink_slot *slot) {
+	__atomic_store_n(&slot->resolving, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * A typed slot holds a reference to the function it points to. A call
+ * through it notes, in a record of the calling thread's own, the relink epoch
+ * in which the outermost call under way started, and writes nothing shared.
+ * A function the slot no longer points to is retired in the current epoch,
+ * and the epoch moves on; it stays loaded until no thread has a call under
+ * way that started in that epoch or before, as a call loads the slot's
+ * function only after noting its epoch. The readers only keep that order from
+ * the compiler; a membarrier before the records are read orders it for the
+ * CPU. The slot must be locked for all of this.
+ */
+
+unsigned long autolink_epoch = 1;
+
+__thread struct autolink_reader *autolink_self = NULL;
+
+static struct autolink_reader *autolink_readers = NULL;
+
+static pthread_key_t autolink_reader_key;
+
+/* the membarrier command fencing every thread, or -1 if there is none */
+static int autolink_barrier = -1;
+
+/* give a thread's record back when it exits */
+static void autolink_reader_exit(struct autolink_reader *reader) {
+	reader->depth = 0;
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&reader->in_use, false, __ATOMIC_RELEASE);
+}
+
+struct autolink_reader *autolink_reader_get() {
+	struct autolink_reader *reader;
+	bool unused;
+
+	for(reader = __atomic_load_n(&autolink_readers, __ATOMIC_ACQUIRE);
+	    reader != NULL; reader = reader->next) {
+		unused = false;
+		if(!__atomic_load_n(&reader->in_use, __ATOMIC_RELAXED)
+		   && __atomic_compare_exchange_n(&reader->in_use, &unused,
+		                                  true, false,
+		                                  __ATOMIC_ACQUIRE,
+		                                  __ATOMIC_RELAXED)) {
+			goto out;
+		}
+	}
+
+	reader = amalloc(sizeof(struct autolink_reader));
+	if(reader == NULL) {
+		/* without a record, calls can't be kept track of */
+		fprintf(stderr, ERRORTEXT("Fatal: could not allocate a"
+		                          " typed autolink record\n"));
+		abort();
+	}
+	reader->epoch = 0;
+	reader->depth = 0;
+	reader->in_use = true;
+	reader->next = __atomic_load_n(&autolink_readers, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&autolink_readers, &reader->next,
+	                                   reader, true, __ATOMIC_RELEASE,
+	                                   __ATOMIC_RELAXED));
+out:
+	pthread_setspecific(autolink_reader_key, reader);
+	autolink_self = reader;
+	return reader;
+}
+
+/* the epoch of the oldest call under way through any slot, ULONG_MAX if
+ * there is none, or 0 if that can't be known */
+static unsigned long autolink_oldest(void) {
+	struct autolink_reader *reader;
+	unsigned long epoch;
+	unsigned long oldest = ULONG_MAX;
+
+	if((autolink_barrier < 0)
+	   || (syscall(__NR_membarrier, autolink_barrier, 0, 0) != 0)) {
+		return 0;
+	}
+	for(reader = __atomic_load_n(&autolink_readers, __ATOMIC_ACQUIRE);
+	    reader != NULL; reader = reader->next) {
+		epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+		if((epoch != 0) && (epoch < oldest)) {
+			oldest = epoch;
+		}
+	}
+	return oldest;
+}
+
+/* release the functions retired from a slot that no call can still be in */
+static void autolink_slot_reclaim(struct autolink_slot *slot) {
+	unsigned long oldest;
+	struct dso_afptr *afptr;
+	struct dso_afptr **next;
+
+	if(slot->retired == NULL) {
+		return;
+	}
+	oldest = autolink_oldest();
+	next = (struct dso_afptr **) &slot->retired;
+	while(*next != NULL) {
+		afptr = *next;
+		if(afptr->epoch < oldest) {
+			*next = afptr->retired_next;
+			arcp_release(afptr);
+		} else {
+			next = &afptr->retired_next;
+		}
+	}
+}
+
+/* point a slot at a new function, retiring the one it pointed to */
+static void autolink_slot_retarget(struct autolink_slot *slot,
+                                   struct dso_afptr *afptr) {
+	struct dso_afptr *prev;
+
+	prev = (struct dso_afptr *) slot->target;
+	slot->target = arcp_acquire(afptr);
+	__atomic_store_n(&slot->fptr, afptr->target, __ATOMIC_SEQ_CST);
+	if(prev != NULL) {
+		/* a call noting a later epoch loads the new function */
+		prev->epoch = __atomic_fetch_add(&autolink_epoch, 1,
+		                                 __ATOMIC_SEQ_CST);
+		prev->retired_next = (struct dso_afptr *) slot->retired;
+		slot->retired = prev;
+	}
+	autolink_slot_reclaim(slot);
+}
+
+/**
+ * Get ready to keep track of calls through typed autolinks.
+ *
+ * @returns 0 on success, -1 on error.
+ */
+int setup_autolink() {
+	int r;
+
+	r = pthread_key_create(&autolink_reader_key,
+	                       (void (*)(void *)) autolink_reader_exit);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create typed autolink"
+		                          " thread-specific storage key")
+		        ": %s\n", strerror(r));
+		return -1;
+	}
+	if(syscall(__NR_membarrier,
+	           MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0) {
+		autolink_barrier = MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+		return 0;
+	}
+	r = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+	if((r > 0) && ((r & MEMBARRIER_CMD_GLOBAL) != 0)) {
+		autolink_barrier = MEMBARRIER_CMD_GLOBAL;
+	} else {
+		fprintf(stderr, ERRORTEXT("No membarrier; functions typed"
+		                          " autolinks pointed to before stay"
+		                          " loaded\n"));
+	}
+	return 0;
+}
+
+/* whether a slot keeps a function in entry loaded */
+static bool autolink_slot_points_into(struct autolink_slot *slot,
+                                      struct dso_entry *entry) {
+	struct dso_afptr *afptr;
+	bool ret;
+
+	autolink_slot_lock(slot, true);
+	afptr = (struct dso_afptr *) slot->target;
+	ret = (afptr != NULL) && (afptr->entry == entry);
+	for(afptr = (struct dso_afptr *) slot->retired;
+	    !ret && (afptr != NULL); afptr = afptr->retired_next) {
+		ret = afptr->entry == entry;
+	}
+	autolink_slot_unlock(slot);
+	return ret;
+}
+
+/* point an autolink entry at a new function; a typed autolink's slot must be
+ * locked */
+static void alink_entry_link(struct alink_entry *entry,
+                             struct dso_afptr *afptr) {
+	arcp_store(&entry->afptr, afptr);
+	if(entry->slot != NULL) {
+		autolink_slot_retarget(entry->slot, afptr);
+	}
+}
+
 static void alink_entry_destroy(struct alink_entry *entry) {
+	/* a typed autolink's slot keeps its own reference */
 	arcp_store(&entry->afptr, NULL);
-	afptr_dispatch_free(entry->dispatch_fptr);
+	if(entry->dispatch_fptr != NULL) {
+		afptr_dispatch_free(entry->dispatch_fptr);
+	}
 	afree(entry, sizeof(struct alink_entry));
 }
 
+/* create an autolink entry; with a signature, this is a generic autolink with
+ * a dispatch function, otherwise it is a typed autolink with the given slot */
 static struct alink_entry *alink_entry_create(struct dso_afptr *afptr,
-                                              char *signature) {
+                                              char *signature,
+                                              struct autolink_slot *slot,
+                                              struct alink_stats *stats) {
 	struct alink_entry *entry;
 	entry = amalloc(sizeof(struct alink_entry));
 	if(entry == NULL) {
@@ -88,43 +323,119 @@ static struct alink_entry *alink_entry_create(struct dso_afptr *afptr,
 	}
 	arcp_region_init(entry, (void (*)(struct arcp_region *)) alink_entry_destroy);
 	arcp_init(&entry->afptr, NULL);
-	entry->dispatch_fptr = afptr_dispatch_create(&entry->afptr, signature);
-	if(entry->dispatch_fptr == NULL) {
-		afree(entry, sizeof(struct alink_entry));
-		return NULL;
+	if(signature != NULL) {
+		entry->dispatch_fptr = afptr_dispatch_create(&entry->afptr,
+		                                             signature);
+		if(entry->dispatch_fptr == NULL) {
+			afree(entry, sizeof(struct alink_entry));
+			return NULL;
+		}
+	} else {
+		entry->dispatch_fptr = NULL;
+	}
+	entry->slot = slot;
+	entry->stats = stats;
+	if(slot != NULL) {
+		autolink_slot_lock(slot, true);
+	}
+	alink_entry_link(entry, afptr);
+	if(slot != NULL) {
+		autolink_slot_unlock(slot);
 	}
-	arcp_store(&entry->afptr, afptr);
 
 	return entry;
 }
 
-void *autolink_create(void *fptr, char *fname, char *signature) {
+/* find the autolink entry of the given name in the table, or NULL */
+static struct alink_entry *autolink_find(struct adict *entry_table,
+                                         char *fname) {
+	int i, len;
+	if(entry_table == NULL) {
+		return NULL;
+	}
+	len = adict_len(entry_table);
+	for(i = 0; i < len; i++) {
+		if(strcmp(astr_cstr(entry_table->items[i].key), fname) == 0) {
+			return (struct alink_entry *)
+				entry_table->items[i].value;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Get the context of the calling thread's dso_entry, or the standalone one
+ * for threads that aren't running a generation.
+ */
+struct livec *autolink_context() {
+	struct dso_entry *dso_entry;
+	dso_entry = (struct dso_entry *) pthread_getspecific(entry_key);
+	return dso_entry == NULL ? &livec_main : dso_entry->livec;
+}
+
+/* get the statistics block for a new autolink entry, carrying over the one
+ * from any previous entry of the same name */
+static struct alink_stats *autolink_stats_get(struct livec *lc, char *fname) {
+	struct adict *entry_table;
+	struct alink_entry *entry;
+	struct alink_stats *stats;
+
+	if(livec_opts.profile == 0) {
+		return NULL;
+	}
+	entry_table = (struct adict *) arcp_load(&lc->autolink_table);
+	entry = autolink_find(entry_table, fname);
+	if((entry != NULL) && (entry->stats != NULL)) {
+		stats = entry->stats;
+	} else {
+		stats = alink_stats_create();
+	}
+	arcp_release(entry_table);
+	return stats;
+}
+
+/* create an autolink entry for fptr on behalf of the calling thread's
+ * dso_entry and put it in the autolink table under fname */
+static struct alink_entry *autolink_add(void *fptr, char *fname,
+                                        char *signature,
+                                        struct autolink_slot *slot) {
 	struct alink_entry *entry;
 	struct dso_afptr *afptr;
 	struct dso_entry *dso_entry;
 	struct adict *entry_table;
 	struct adict *new_entry_table;
-	void *ret;
 
 	dso_entry = (struct dso_entry *) pthread_getspecific(entry_key);
 	if(dso_entry == NULL) {
 		errno = EINVAL;
 		return NULL;
 	}
+	if(ab_active()) {
+		/* the A/B comparison function must not change what the
+		 * running generation links to */
+		errno = EPERM;
+		return NULL;
+	}
 
 	afptr = dso_afptr_create(dso_entry, fptr);
 	if(afptr == NULL) {
 		return NULL;
 	}
 
-	entry = alink_entry_create(afptr, signature);
+	entry = alink_entry_create(afptr, signature, slot,
+	                           autolink_stats_get(dso_entry->livec,
+	                                              fname));
 	arcp_release(afptr);
 	if(entry == NULL) {
 		return NULL;
 	}
+	if(entry->stats != NULL) {
+		profile_register(fptr, entry->stats, dso_entry);
+	}
 
 	do {
-		entry_table = (struct adict *) arcp_load(&autolink_table);
+		entry_table = (struct adict *) arcp_load(
+			&dso_entry->livec->autolink_table);
 		if(entry_table == NULL) {
 			new_entry_table = adict_create_cstrput(fname, entry);
 		} else {
@@ -135,21 +446,88 @@ void *autolink_create(void *fptr, char *fname, char *signature) {
 			arcp_release(entry);
 			return NULL;
 		}
-	} while(!arcp_cas_release(&autolink_table,
+	} while(!arcp_cas_release(&dso_entry->livec->autolink_table,
 	                          entry_table, new_entry_table));
 
-	ret = entry->dispatch_fptr;
+	/* the table holds the entry now */
 	arcp_release(entry);
-	return ret;
+	return entry;
+}
+
+void *autolink_create(void *fptr, char *fname, char *signature) {
+	struct alink_entry *entry;
+	entry = autolink_add(fptr, fname, signature, NULL);
+	if(entry == NULL) {
+		return NULL;
+	}
+	return entry->dispatch_fptr;
+}
+
+struct autolink_slot *autolink_slot_create(void *fptr, char *fname) {
+	struct livec *lc;
+	struct adict *entry_table;
+	struct alink_entry *prev;
+	struct alink_entry *entry;
+	struct autolink_slot *slot;
+
+	/* reuse the slot of a previous generation, so that code still
+	 * running in it is relinked as well */
+	lc = autolink_context();
+	entry_table = (struct adict *) arcp_load(&lc->autolink_table);
+	prev = autolink_find(entry_table, fname);
+	if((prev != NULL) && (prev->slot != NULL)) {
+		slot = prev->slot;
+	} else {
+		/* slots are never freed, as code in any generation may have
+		 * a pointer to one, and they keep their context */
+		slot = amalloc(sizeof(struct autolink_slot));
+		if(slot == NULL) {
+			arcp_release(entry_table);
+			return NULL;
+		}
+		slot->fptr = NULL;
+		slot->generation = 0;
+		/* without lazy relinking the slot is relinked along with the
+		 * rest, and the check on each call need not leave the slot */
+		slot->link_generation = livec_opts.lazy_relink
+			? &lc->link_generation : &slot->generation;
+		slot->livec = (struct livec *) arcp_acquire(lc);
+		slot->resolving = false;
+		slot->target = NULL;
+		slot->retired = NULL;
+	}
+	arcp_release(entry_table);
+
+	/* the function the slot pointed to until now is retired like on a
+	 * relink */
+	entry = autolink_add(fptr, fname, NULL, slot);
+	if(entry == NULL) {
+		return NULL;
+	}
+	/* it links to the calling generation now */
+	__atomic_store_n(&slot->generation,
+	                 ((struct dso_entry *)
+	                  pthread_getspecific(entry_key))->generation,
+	                 __ATOMIC_RELEASE);
+	return slot;
+}
+
+struct autolink_slot *autolink_kernel_create(autolink_kernel_fn fptr,
+                                             char *fname) {
+	/* a kernel is a typed autolink like any other; it's relinked in
+	 * autolink_relink() along with the rest */
+	return autolink_slot_create((void *) fptr, fname);
 }
 
 int autolink_destroy(char *fname) {
+	struct livec *lc;
 	struct adict *entry_table;
 	struct adict *new_entry_table;
 
+	lc = autolink_context();
 	/* Remove entry from entry table */
 	do {
-		entry_table = (struct adict *) arcp_load(&autolink_table);
+		entry_table = (struct adict *) arcp_load(&lc->autolink_table);
 		if(entry_table == NULL) {
 			errno = EINVAL;
 			return -1;
@@ -159,59 +537,381 @@ int autolink_destroy(char *fname) {
 			arcp_release(entry_table);
 			return -1;
 		}
-	} while(!arcp_cas_release(&autolink_table, entry_table, new_entry_table));
+	} while(!arcp_cas_release(&lc->autolink_table, entry_table,
+	                          new_entry_table));
 
 	return 0;
 }
 
-/* relink all the autolink functions to the versions in the given dso */
-static int autolink_relink(struct dso_entry *dso_entry) {
-	int ret = 0;
+/**
+ * Write the names of the autolink functions to a linker version script, one
+ * per line, skipping the name given by except.
+ */
+void autolink_export(struct livec *lc, FILE *map, char *except) {
 	int i, len;
-	struct alink_entry *entry;
-	struct astr *fname;
 	struct adict *entry_table;
+	char *fname;
+
+	entry_table = (struct adict *) arcp_load(&lc->autolink_table);
+	if(entry_table == NULL) {
+		return;
+	}
+	len = adict_len(entry_table);
+	for(i = 0; i < len; i++) {
+		fname = astr_cstr(entry_table->items[i].key);
+		if(strcmp(fname, except) != 0) {
+			fprintf(map, "\t\t%s;\n", fname);
+		}
+	}
+	arcp_release(entry_table);
+}
+
+/**
+ * Get a reference to the function an autolink currently links to, which
+ * keeps its generation loaded until it is released.
+ *
+ * @param fname the name of the autolink.
+ * @param fptr where to put the function pointer.
+ * @returns the reference, or NULL if there is no such autolink or it is not
+ * linked to anything.
+ */
+struct arcp_region *autolink_acquire(struct livec *lc, char *fname,
+                                     void **fptr) {
+	struct adict *entry_table;
+	struct alink_entry *entry;
+	struct dso_afptr *afptr = NULL;
+
+	entry_table = (struct adict *) arcp_load(&lc->autolink_table);
+	entry = autolink_find(entry_table, fname);
+	if(entry != NULL) {
+		if((entry->slot != NULL)
+		   && (__atomic_load_n(&entry->slot->generation,
+		                       __ATOMIC_ACQUIRE)
+		       != __atomic_load_n(&lc->link_generation,
+		                          __ATOMIC_ACQUIRE))) {
+			autolink_slot_resolve(entry->slot);
+		}
+		afptr = (struct dso_afptr *) arcp_load(&entry->afptr);
+		if(afptr != NULL) {
+			*fptr = afptr->target;
+		}
+	}
+	arcp_release(entry_table);
+	return (struct arcp_region *) afptr;
+}
+
+void *livec_autolink(struct livec *lc, char *fname, struct arcp_region **ref) {
+	void *fptr = NULL;
+	*ref = autolink_acquire(lc, fname, &fptr);
+	return *ref == NULL ? NULL : fptr;
+}
+
+/**
+ * Get the table of autolink functions of a context, keyed by name. The caller
+ * must release it.
+ */
+struct adict *autolink_names(struct livec *lc) {
+	return (struct adict *) arcp_load(&lc->autolink_table);
+}
+
+/* relink one autolink function to the version in the given dso; a typed
+ * autolink's slot must be locked */
+static int autolink_link(struct dso_entry *dso_entry, struct astr *fname,
+                         struct alink_entry *entry) {
 	void *fptr;
 	struct dso_afptr *afptr;
+	struct dso_afptr *old;
 
-	entry_table = (struct adict *) arcp_load(&autolink_table);
-	if(entry_table == NULL) {
-		return 0;
+	old = (struct dso_afptr *) arcp_load(&entry->afptr);
+	fptr = dlsym(dso_entry->dlhandle, astr_cstr(fname));
+	if(fptr == NULL) {
+		/* keep calling the previous version rather than nothing */
+		arcp_release(old);
+		fprintf(stderr,
+		        ERRORTEXT("Could not find '%s' function in %s;"
+		                  " keeping the previous version\n"),
+		        astr_cstr(fname), dso_entry->dsofile);
+		event_log(EVENT_DLSYM_ERROR, dso_entry->generation, 0,
+		          0, dlerror());
+		goto out;
+	}
+	afptr = dso_afptr_create(dso_entry, fptr);
+	if(afptr == NULL) {
+		fprintf(stderr,
+		        ERRORTEXT("Could not create afptr"
+			          " for function '%s'\n"),
+		        astr_cstr(fname));
+		arcp_release(old);
+		return -1;
+	}
+	alink_entry_link(entry, afptr);
+	arcp_release(afptr);
+	if(livec_opts.hotpatch && (old != NULL)
+	   && (old->entry != dso_entry)
+	   && (hotpatch(fname, old->entry, old->target,
+	                dso_entry, fptr) != 0)) {
+		fprintf(stderr, ERRORTEXT("Could not hot patch '%s'"
+		                          " in %s\n"),
+		        astr_cstr(fname), old->entry->dsofile);
+	}
+	arcp_release(old);
+	if(entry->stats != NULL) {
+		profile_register(fptr, entry->stats, dso_entry);
 	}
+out:
+	if(entry->slot != NULL) {
+		__atomic_store_n(&entry->slot->generation,
+		                 dso_entry->generation, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
 
-	len = adict_len(entry_table);
+/* relink the autolink functions that are relinked eagerly to the versions in
+ * the given dso */
+static int autolink_relink_entries(struct dso_entry *dso_entry) {
+	int ret = 0;
+	int i, len;
+	struct livec *lc;
+	struct alink_entry *entry;
+	struct adict *entry_table;
+
+	if(livec_opts.hotpatch) {
+		/* the generation we link to must not jump elsewhere */
+		hotpatch_restore(dso_entry);
+	}
+
+	lc = dso_entry->livec;
+	entry_table = (struct adict *) arcp_load(&lc->autolink_table);
+	len = entry_table == NULL ? 0 : adict_len(entry_table);
 
 	for(i = 0; i < len; i++) {
-		fname = entry_table->items[i].key;
 		entry = (struct alink_entry *) entry_table->items[i].value;
-		fptr = dlsym(dso_entry->dlhandle, astr_cstr(fname));
-		if(fptr == NULL) {
-			arcp_store(&entry->afptr, NULL);
-			fprintf(stderr,
-			        ERRORTEXT("Could not find '%s'"
-				          " function in %s\n"),
-			        astr_cstr(fname), dso_entry->dsofile);
+		if(entry->slot == NULL) {
+			if(autolink_link(dso_entry, entry_table->items[i].key,
+			                 entry) != 0) {
+				ret = -1;
+			}
 			continue;
 		}
-		afptr = dso_afptr_create(dso_entry, fptr);
-		if(afptr == NULL) {
-			fprintf(stderr,
-			        ERRORTEXT("Could not create afptr"
-				          " for function '%s'\n"),
-			        astr_cstr(fname));
-			ret = -1;
+		if(livec_opts.lazy_relink) {
 			continue;
 		}
-		arcp_store(&entry->afptr, afptr);
-		arcp_release(afptr);
+		autolink_slot_lock(entry->slot, true);
+		if(autolink_link(dso_entry, entry_table->items[i].key,
+		                 entry) != 0) {
+			ret = -1;
+		}
+		autolink_slot_unlock(entry->slot);
+	}
+	arcp_release(entry_table);
+	return ret;
+}
+
+/* relink all the autolink functions to the versions in the given dso; with
+ * lazy relinking, typed autolinks are left to relink themselves on their
+ * next call. On failure, what was relinked is put back. */
+static int autolink_relink(struct dso_entry *dso_entry) {
+	struct livec *lc;
+	struct dso_entry *prev;
+
+	lc = dso_entry->livec;
+	prev = (struct dso_entry *) arcp_load(&lc->link_entry);
+	if(autolink_relink_entries(dso_entry) != 0) {
+		/* lazy relinking still goes to prev, as it isn't published
+		 * yet */
+		if((prev != NULL) && (autolink_relink_entries(prev) != 0)) {
+			fprintf(stderr, ERRORTEXT("Could not relink back to"
+			                          " %s\n"), prev->dsofile);
+		}
+		arcp_release(prev);
+		return -1;
+	}
+	arcp_release(prev);
+
+	/* only now can lazy relinking go to it; anything not relinked above
+	 * relinks on its next call */
+	arcp_store(&lc->link_entry, dso_entry);
+	__atomic_store_n(&lc->link_generation, dso_entry->generation,
+	                 __ATOMIC_RELEASE);
+	return 0;
+}
+
+void *autolink_slot_resolve(struct autolink_slot *slot) {
+	int i, len;
+	struct dso_entry *dso_entry;
+	struct adict *entry_table;
+	struct alink_entry *entry;
+
+	if(!autolink_slot_lock(slot, false)) {
+		/* the function it links to until then is still loaded */
+		return __atomic_load_n(&slot->fptr, __ATOMIC_ACQUIRE);
+	}
+	dso_entry = (struct dso_entry *) arcp_load(&slot->livec->link_entry);
+	if((dso_entry != NULL) && (slot->generation != dso_entry->generation)) {
+		entry_table = (struct adict *) arcp_load(
+			&slot->livec->autolink_table);
+		len = entry_table == NULL ? 0 : adict_len(entry_table);
+		for(i = 0; i < len; i++) {
+			entry = (struct alink_entry *)
+				entry_table->items[i].value;
+			if(entry->slot == slot) {
+				autolink_link(dso_entry,
+				              entry_table->items[i].key, entry);
+				break;
+			}
+		}
+		if(i == len) {
+			/* the autolink was destroyed; stop trying */
+			__atomic_store_n(&slot->generation,
+			                 dso_entry->generation,
+			                 __ATOMIC_RELEASE);
+		}
+		arcp_release(entry_table);
+	}
+	arcp_release(dso_entry);
+	autolink_slot_unlock(slot);
+	return __atomic_load_n(&slot->fptr, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Relink all the autolink functions to the versions in an already loaded
+ * dso_entry.
+ */
+int relink(struct dso_entry *entry) {
+	return autolink_relink(entry);
+}
+
+int autolink_stats(char *fname, struct autolink_stats *stats) {
+	struct adict *entry_table;
+	struct alink_entry *entry;
+	int ret = 0;
+
+	entry_table = (struct adict *) arcp_load(
+		&autolink_context()->autolink_table);
+	entry = autolink_find(entry_table, fname);
+	if(entry == NULL) {
+		errno = EINVAL;
+		ret = -1;
+	} else if(entry->stats == NULL) {
+		memset(stats, 0, sizeof(struct autolink_stats));
+	} else {
+		alink_stats_read(entry->stats, stats);
 	}
+	arcp_release(entry_table);
 	return ret;
 }
 
+/* whether an autolink function pointer points into entry */
+static bool autolink_points_into(arcp_t *afptr, struct dso_entry *entry) {
+	struct dso_afptr *target;
+	bool ret;
+	target = (struct dso_afptr *) arcp_load(afptr);
+	ret = (target != NULL) && (target->entry == entry);
+	arcp_release(target);
+	return ret;
+}
+
+/**
+ * Count the autolink functions of a context that are keeping a generation
+ * loaded.
+ */
+int autolink_pins(struct livec *lc, struct dso_entry *entry) {
+	int i, len;
+	int pins = 0;
+	struct adict *entry_table;
+	struct alink_entry *alink;
+
+	entry_table = (struct adict *) arcp_load(&lc->autolink_table);
+	if(entry_table == NULL) {
+		return 0;
+	}
+	len = adict_len(entry_table);
+	for(i = 0; i < len; i++) {
+		alink = (struct alink_entry *) entry_table->items[i].value;
+		if((alink->slot == NULL)
+		   ? autolink_points_into(&alink->afptr, entry)
+		   : autolink_slot_points_into(alink->slot, entry)) {
+			pins++;
+		}
+	}
+	arcp_release(entry_table);
+	return pins;
+}
+
+/* print the call statistics of the autolink functions of a context */
+static void autolink_stats_dump_table(struct livec *lc) {
+	int i, len;
+	struct adict *entry_table;
+	struct alink_entry *entry;
+	struct autolink_stats stats;
+
+	entry_table = (struct adict *) arcp_load(&lc->autolink_table);
+	if(entry_table == NULL) {
+		return;
+	}
+	fprintf(stderr, "%-24s %12s %10s %10s %10s %10s\n",
+	        "autolink", "calls", "samples", "mean ns", "p50 ns", "p99 ns");
+	len = adict_len(entry_table);
+	for(i = 0; i < len; i++) {
+		entry = (struct alink_entry *) entry_table->items[i].value;
+		if(entry->stats == NULL) {
+			continue;
+		}
+		alink_stats_read(entry->stats, &stats);
+		fprintf(stderr, "%-24s %12llu %10llu %10llu %10llu %10llu\n",
+		        astr_cstr(entry_table->items[i].key),
+		        stats.calls, stats.samples,
+		        stats.samples == 0 ? 0 : stats.sample_ns / stats.samples,
+		        autolink_stats_percentile(&stats, 0.5),
+		        autolink_stats_percentile(&stats, 0.99));
+	}
+	arcp_release(entry_table);
+}
+
+void autolink_stats_dump() {
+	autolink_stats_dump_table(autolink_context());
+}
+
+/* print the statistics gathered during the current generation and start
+ * afresh for the next one */
+static void autolink_stats_rotate(struct livec *lc) {
+	int i, len;
+	struct adict *entry_table;
+	struct alink_entry *entry;
+	struct dso_entry *current;
+
+	current = (struct dso_entry *) arcp_load(&lc->current_entry);
+	if(current == NULL) {
+		return;
+	}
+	fprintf(stderr, PROCTEXT("Autolink statistics for generation %lu:\n"),
+	        current->generation);
+	arcp_release(current);
+	autolink_stats_dump_table(lc);
+
+	entry_table = (struct adict *) arcp_load(&lc->autolink_table);
+	if(entry_table == NULL) {
+		return;
+	}
+	len = adict_len(entry_table);
+	for(i = 0; i < len; i++) {
+		entry = (struct alink_entry *) entry_table->items[i].value;
+		if(entry->stats != NULL) {
+			alink_stats_reset(entry->stats);
+		}
+	}
+	arcp_release(entry_table);
+}
+
 /* destruction function for dso_entry; should unlink the file and dlclose the
  * handle */
 static void dso_entry_destroy(struct dso_entry *entry) {
 	int r;
+	heap_unload(entry);
+	if(livec_opts.profile != 0) {
+		profile_forget(entry);
+	}
+	perf_keep(entry);
 	r = unlink(entry->dsofile);
 	if(r != 0) {
 		fprintf(stderr, ERRORTEXT("Failed to unlink %s") ": %s\n",
@@ -222,6 +922,8 @@ static void dso_entry_destroy(struct dso_entry *entry) {
 		fprintf(stderr, ERRORTEXT("Failed to dlclose %s") ": %s\n",
 		        entry->dsofile, strerror(errno));
 	}
+	hotpatch_free(entry);
+	arcp_release(entry->livec);
 	afree(entry->dsofile, strlen(entry->dsofile) + 1);
 	afree(entry, sizeof(struct dso_entry));
 }
@@ -229,16 +931,18 @@ static void dso_entry_destroy(struct dso_entry *entry) {
 /**
  * Load a dso file and return its dso_entry.
  *
- * @param dsofile the filename for the dso.
+ * @param lc the context to load it into.
+ * @param dsofile the filename for the dso, which is taken over; on error it
+ * is unlinked and freed.
  * @returns the struct dso_entry for the loaded dsofile, or NULL on error.
  */
-struct dso_entry *load(char *dsofile) {
+struct dso_entry *load(struct livec *lc, char *dsofile) {
 	int r;
 	struct astr *entry_f;
 	struct dso_entry *entry;
 
 	/* get the name of the entry function */
-	entry_f = (struct astr *) arcp_load(&livec_opts.entry);
+	entry_f = (struct astr *) arcp_load(&lc->opts->entry);
 	if(entry_f == NULL) {
 		perror(ERRORTEXT("Fatal: No entry name defined"));
 		r = unlink(dsofile);
@@ -262,6 +966,17 @@ struct dso_entry *load(char *dsofile) {
 	                 (void (*)(struct arcp_region *)) dso_entry_destroy);
 
 	entry->dsofile = dsofile;
+	entry->threads = 0;
+	entry->livec = (struct livec *) arcp_acquire(lc);
+	{
+		struct stat st;
+		entry->dsosize = stat(dsofile, &st) == 0 ? st.st_size : 0;
+	}
+	entry->generation = __atomic_add_fetch(&last_generation, 1,
+	                                       __ATOMIC_RELAXED);
+
+	/* have the libraries it links against already loaded */
+	preload_libraries(lc);
 
 	/* clear dlerror */
 	dlerror();
@@ -276,37 +991,73 @@ struct dso_entry *load(char *dsofile) {
 		}
 		fprintf(stderr, ERRORTEXT("Could not dlopen %s") ": %s\n",
 		        dsofile, error);
+		event_log(EVENT_DLOPEN_ERROR, entry->generation, 0, 0, error);
 		goto error1;
 	}
 
+	if(livec_opts.hugepages) {
+		hugepage_remap(entry);
+	}
+	heap_load(entry);
+	perf_load(entry);
+
 	/* look up the entry function */
 	entry->proc = (livec_proc) dlsym(entry->dlhandle, astr_cstr(entry_f));
 	if(entry->proc == NULL) {
 		fprintf(stderr,
 		        ERRORTEXT("Could not find '%s' function in %s\n"),
 		        astr_cstr(entry_f), dsofile);
+		event_log(EVENT_DLSYM_ERROR, entry->generation, 0, 0,
+		          dlerror());
 		goto error2;
 	}
 
-	/* relink all the autolink functions */
+	/* get it ready before anything switches to it */
+	if(livec_opts.warmup && (warmup(entry) != 0)) {
+		goto error2;
+	}
+
+	if(livec_opts.profile != 0) {
+		autolink_stats_rotate(lc);
+	}
+
+	/* relink all the autolink functions; a rollback or a switch through
+	 * the history must not relink in the middle of this */
+	pthread_mutex_lock(&lc->switch_lock);
 	r = autolink_relink(entry);
 	if(r != 0) {
+		pthread_mutex_unlock(&lc->switch_lock);
 		goto error2;
 	}
+	arcp_store(&lc->current_entry, entry);
+	history_push(entry);
+	pthread_mutex_unlock(&lc->switch_lock);
 
+	/* measure it against the previous generation, now that its
+	 * autolinked calls reach its own code */
+	ab_compare(entry);
+	report_reload(entry);
+	livec_pool_report();
 	arcp_release(entry_f);
 
 	return entry;
 
 error2:
-	r = dlclose(entry->dlhandle);
-	if(r != 0) {
-		fprintf(stderr, ERRORTEXT("Failed to dlclose %s") ": %s\n",
-		        dsofile, strerror(errno));
-	}
+	/* unloaded like any generation, once nothing points into it */
+	arcp_release(entry);
+	arcp_release(entry_f);
+	return NULL;
+
 error1:
+	arcp_release(entry->livec);
 	afree(entry, sizeof(struct dso_entry));
 error0:
+	r = unlink(dsofile);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to unlink %s") ": %s\n",
+		        dsofile, strerror(errno));
+	}
+	afree(dsofile, strlen(dsofile) + 1);
 	arcp_release(entry_f);
 	return NULL;
 }
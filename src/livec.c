@@ -16,48 +16,221 @@
  * You should have received a copy of the GNU General Public License
  * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include <sys/inotify.h>
 #include <libgen.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
 #include <atomickit/string.h>
 
 #include "livec.h"
 #include "local.h"
 
-/* compile, link, and load the file */
-static void process_file(struct astr *sfilename) {
+/* initialize options structure to NULL */
+struct livec_opts livec_opts = {
+	ARCP_VAR_INIT(NULL),
+	ARCP_VAR_INIT(NULL),
+	ARCP_VAR_INIT(NULL),
+	ARCP_VAR_INIT(NULL),
+	ARCP_VAR_INIT(NULL),
+	ARCP_VAR_INIT(NULL),
+	ARCP_VAR_INIT(NULL),
+	-1,
+	9,
+	0,
+	0,
+	0,
+	0,
+	false,
+	ARCP_VAR_INIT(NULL),
+	false,
+	0,
+	1000,
+	1000,
+	ARCP_VAR_INIT(NULL),
+	ARCP_VAR_INIT(NULL),
+	0,
+	false,
+	ARCP_VAR_INIT(NULL),
+	ARCP_VAR_INIT(NULL),
+	ARCP_VAR_INIT(NULL),
+	false,
+	false,
+	ARCP_VAR_INIT(NULL),
+	false,
+	false,
+	false,
+	0
+};
+
+/* utility function to collapse whitespace to a minimum; naïvely slow */
+void str_collapse_ws(char *s) {
+	bool lastspace;
+	lastspace = true;
+	while(*s != '\0') {
+		switch(*s) {
+		case ' ':
+		case '\t':
+		case '\v':
+		case '\n':
+		case '\f':
+		case '\r':
+			if(lastspace) {
+				memmove(s, s + 1, strlen(s));
+			} else {
+				lastspace = true;
+				*s++ = ' ';
+			}
+			if(*s == '\0') {
+				*--s = '\0';
+			}
+			break;
+		default:
+			lastspace = false;
+			s += 1;
+		}
+	}
+}
+
+/* the context of the standalone livec */
+struct livec livec_main __attribute__((visibility("hidden")));
+
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+
+/* whether setup() failed */
+static bool setup_failed = false;
+
+static void setup(void) {
+	int r;
+
+	/* create the thread-specific storage key for dso_entry */
+	r = pthread_key_create(&entry_key, (void (*)(void *)) arcp_release);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create"
+		                          " thread-specific storage key for"
+					  " dso_entry") ": %s\n",
+		                          strerror(r));
+		setup_failed = true;
+		return;
+	}
+
+	/* the standalone context is never destroyed */
+	arcp_region_init(&livec_main, NULL);
+	livec_main.opts = &livec_opts;
+	arcp_init(&livec_main.autolink_table, NULL);
+	arcp_init(&livec_main.current_entry, NULL);
+	arcp_init(&livec_main.link_entry, NULL);
+	arcp_init(&livec_main.periodic_table, NULL);
+	arcp_init(&livec_main.history, NULL);
+	pthread_mutex_init(&livec_main.switch_lock, NULL);
+	livec_main.ab_last = NULL;
+	livec_main.link_generation = 0;
+	livec_main.stop_pipe[0] = -1;
+	livec_main.stop_pipe[1] = -1;
+
+	if((setup_log() != 0) || (setup_perf() != 0)
+	   || (setup_autolink() != 0) || (setup_events() != 0)) {
+		setup_failed = true;
+		return;
+	}
+	setup_heap();
+}
+
+/**
+ * Set up what all contexts share. May be called any number of times.
+ *
+ * @returns 0 on success, -1 if setting up failed, now or before.
+ */
+int livec_setup() {
+	pthread_once(&setup_once, setup);
+	return setup_failed ? -1 : 0;
+}
+
+/* a submission being read from the fifo */
+struct submission {
+	char *buf; /**< The source read so far. */
+	size_t len; /**< Length of the source read so far. */
+	size_t cap; /**< Allocated size of buf. */
+};
+
+/* the content of the thread calling the entry of an embedded context */
+static void call_entry(struct dso_entry *entry) {
+	int r;
+	char *argv[] = { NULL };
+	r = entry->proc(0, argv);
+	event_log(EVENT_EXIT, entry->generation, r, 0, NULL);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Entry exited with error code %d\n"),
+		        r);
+	}
+}
+
+/**
+ * Compile, link, and load the file, or the given source in its place, and
+ * run the new generation.
+ *
+ * @returns 0 on success, -1 on error.
+ */
+int process_file(struct livec *lc, struct astr *sfilename, char *source,
+                 size_t len) {
 	char *dsofile;
 	struct dso_entry *entry;
 	int r;
-	fprintf(stderr, PROCTEXT("Compiling %s...\n"), astr_cstr(sfilename));
-	dsofile = compile(sfilename);
+	uint64_t hash, start, compiled;
+	if(source == NULL) {
+		fprintf(stderr, PROCTEXT("Compiling %s...\n"),
+		        astr_cstr(sfilename));
+	} else {
+		fprintf(stderr, PROCTEXT("Compiling %zu bytes submitted for"
+		                         " %s...\n"),
+		        len, astr_cstr(sfilename));
+	}
+	hash = event_source_hash(astr_cstr(sfilename), source, len);
+	start = event_clock();
+	dsofile = compile(lc, sfilename, source, len);
+	compiled = event_clock();
 	if(dsofile == NULL) {
 		fprintf(stderr, ERRORTEXT("Compilation failed.\n"));
-		return;
+		return -1;
 	}
 	fprintf(stderr, SUCCESSTEXT("Compilation succeeded.\n"));
 	fprintf(stderr, PROCTEXT("Loading %s...\n"), dsofile);
-	entry = load(dsofile);
+	entry = load(lc, dsofile);
 	if(entry == NULL) {
 		fprintf(stderr, ERRORTEXT("Load failed.\n"));
-		r = unlink(dsofile);
-		if(r != 0) {
-			fprintf(stderr, ERRORTEXT("Failed to unlink %s")
-			        ": %s\n", dsofile, strerror(errno));
-		}
-		return;
+		return -1;
 	}
 	fprintf(stderr, SUCCESSTEXT("Load succeeded.\n"));
-	run(entry);
+	event_reload(entry->generation, hash, compiled - start,
+	             event_clock() - compiled);
+	if(lc->embedded && !lc->watching) {
+		/* livec_reload() waits for the entry function, so that its
+		 * autolinks are there once it returns */
+		r = run_sync(entry, (void (*)(void *)) call_entry, entry, -1);
+		arcp_release(entry);
+		return r;
+	}
+	/* an entry function that doesn't return mustn't hold up the next
+	 * reload */
+	return run(entry);
 }
 
-/* set up the appropriate watch on the directory indicated by sfilename */
+/* set up the appropriate watch on the directory indicated by sfilename;
+ * returns -1 on error */
 static int setup_inotify_watch(int notify_fd, struct astr *sfilename) {
 	char dirbuf[astr_len(sfilename) + 1];
 	char *dir;
@@ -70,71 +243,219 @@ static int setup_inotify_watch(int notify_fd, struct astr *sfilename) {
 	                           IN_CLOSE_WRITE|IN_MOVED_TO);
 	if(dwatch <= 0) {
 		fprintf(stderr,
-		        ERRORTEXT("Fatal: failed to add inotify watch for %s")
+		        ERRORTEXT("Failed to add inotify watch for %s")
 		        ": %s\n", dir, strerror(errno));
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	return dwatch;
 }
 
+/* open the submission fifo, creating it if need be; returns -1 on error */
+static int open_fifo(struct astr *sfifo) {
+	int fd;
+	struct stat st;
+	if((mkfifo(astr_cstr(sfifo), 0600) != 0) && (errno != EEXIST)) {
+		fprintf(stderr, ERRORTEXT("Failed to create fifo %s")
+		        ": %s\n", astr_cstr(sfifo), strerror(errno));
+		return -1;
+	}
+	/* non-blocking, so that opening doesn't wait for a writer */
+	fd = open(astr_cstr(sfifo), O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+	if(fd < 0) {
+		fprintf(stderr, ERRORTEXT("Failed to open fifo %s")
+		        ": %s\n", astr_cstr(sfifo), strerror(errno));
+		return -1;
+	}
+	if((fstat(fd, &st) != 0) || !S_ISFIFO(st.st_mode)) {
+		fprintf(stderr, ERRORTEXT("%s is not a fifo\n"),
+		        astr_cstr(sfifo));
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	return fd;
+}
+
+/* read what's available of a submission from the fifo; returns 1 once the
+ * writer has closed it, 0 if there is more to come */
+static int read_submission(int fd, struct submission *sub) {
+	ssize_t len;
+	char *buf;
+	for(;;) {
+		if(sub->cap - sub->len < 4096) {
+			buf = realloc(sub->buf, sub->cap * 2 + 4096);
+			if(buf == NULL) {
+				perror(ERRORTEXT("Failed to allocate memory for"
+				                 " submission"));
+				sub->len = 0;
+				return 1;
+			}
+			sub->buf = buf;
+			sub->cap = sub->cap * 2 + 4096;
+		}
+		len = read(fd, sub->buf + sub->len, sub->cap - sub->len);
+		if(len > 0) {
+			sub->len += len;
+		} else if(len == 0) {
+			return 1;
+		} else if(errno == EAGAIN) {
+			return 0;
+		} else if(errno != EINTR) {
+			perror(ERRORTEXT("read() of fifo failed"));
+			sub->len = 0;
+			return 1;
+		}
+	}
+}
+
 /* basename which is guaranteed not to modify filename */
 static char *simple_basename(char *filename) {
 	char *ret = strrchr(filename, '/');
 	return ret == NULL ? filename : ++ret;
 }
 
-void watch_file() {
+/* what a context is watched through */
+struct watch {
+	struct livec *lc; /**< The context watched. */
+	int notify_fd; /**< The inotify instance. */
+	int dwatch; /**< The watch on the file's directory, or -1. */
+	struct astr *sfilename; /**< The file watched. */
+	struct astr *sfifo; /**< The submission fifo, or NULL. */
+	int fifo_fd; /**< The open submission fifo, or -1. */
+};
+
+/* set up the watch on a context's file and fifo; returns -1 on error */
+static int watch_open(struct livec *lc, struct watch *w) {
+	w->lc = lc;
+	w->fifo_fd = -1;
+	w->sfilename = (struct astr *) arcp_load(&lc->opts->filename);
+	if(w->sfilename == NULL) {
+		fprintf(stderr, ERRORTEXT("No filename defined\n"));
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* initialize the inotify system */
+	w->notify_fd = inotify_init();
+	if(w->notify_fd < 0) {
+		perror(ERRORTEXT("Failed to initialize inotify system"));
+		goto error0;
+	}
+	w->dwatch = setup_inotify_watch(w->notify_fd, w->sfilename);
+	if(w->dwatch < 0) {
+		goto error1;
+	}
+
+	/* set up the submission fifo */
+	w->sfifo = (struct astr *) arcp_load(&lc->opts->fifo);
+	if(w->sfifo != NULL) {
+		/* a compiler that exits before reading all of a submission
+		 * shouldn't take us with it */
+		signal(SIGPIPE, SIG_IGN);
+		w->fifo_fd = open_fifo(w->sfifo);
+		if(w->fifo_fd < 0) {
+			goto error2;
+		}
+	}
+	return 0;
+
+error2:
+	arcp_release(w->sfifo);
+error1:
+	close(w->notify_fd);
+error0:
+	arcp_release(w->sfilename);
+	return -1;
+}
+
+static void watch_close(struct watch *w) {
+	if(w->fifo_fd >= 0) {
+		close(w->fifo_fd);
+	}
+	close(w->notify_fd);
+	arcp_release(w->sfifo);
+	arcp_release(w->sfilename);
+}
+
+/* process the file of a watched context, and then again whenever it changes
+ * or source is submitted through the fifo, until the context's stop pipe is
+ * written to */
+static void watch_loop(struct watch *w) {
 	int r;
-	int notify_fd;
-	int dwatch;
+	struct livec *lc = w->lc;
 	struct astr *sfilename;
+	struct pollfd pfds[3];
+	struct submission sub = { NULL, 0, 0 };
 	char *file;
 	uint8_t inotify_buf[sizeof(struct inotify_event) + NAME_MAX + 1];
 	struct inotify_event *event;
 	size_t i;
 	ssize_t len;
 
-	/* initialize the inotify system */
-	notify_fd = inotify_init();
-	if(notify_fd < 0) {
-		perror(ERRORTEXT("Fatal: failed to initialize "
-		                 "inotify system"));
-		exit(EXIT_FAILURE);
-	}
-
-setup_watch:
-	/* set up the inotify watch and associated variables */
-	sfilename = (struct astr *) arcp_load(&livec_opts.filename);
-	if(sfilename == NULL) {
-		fprintf(stderr, ERRORTEXT("Fatal: no filename defined\n"));
-		exit(EXIT_FAILURE);
-	}
-
-	file = simple_basename(astr_cstr(sfilename));
-
-	dwatch = setup_inotify_watch(notify_fd, sfilename);
+	file = simple_basename(astr_cstr(w->sfilename));
 
 	/* process the file */
-	process_file(sfilename);
+	process_file(lc, w->sfilename, NULL, 0);
 
 	/* main watch loop */
 	for(;;) {
-		if(sfilename != (struct astr *)
-		   arcp_load_phantom(&livec_opts.filename)) {
-			/* the filename option has changed; remove the watch
- 			 * and restart */
-			arcp_release(sfilename);
-			r = inotify_rm_watch(notify_fd, dwatch);
-			if(r != 0) {
-				perror(ERRORTEXT("Failed to clean"
-				                 " up old watch"));
+		sfilename = (struct astr *)
+			arcp_load_phantom(&lc->opts->filename);
+		if((sfilename != NULL) && (sfilename != w->sfilename)) {
+			/* the filename option has changed; move the watch
+ 			 * and start over */
+			if(w->dwatch >= 0) {
+				r = inotify_rm_watch(w->notify_fd, w->dwatch);
+				if(r != 0) {
+					perror(ERRORTEXT("Failed to clean"
+					                 " up old watch"));
+				}
 			}
-			goto setup_watch;
+			arcp_release(w->sfilename);
+			w->sfilename = (struct astr *) arcp_load(
+				&lc->opts->filename);
+			file = simple_basename(astr_cstr(w->sfilename));
+			w->dwatch = setup_inotify_watch(w->notify_fd,
+			                                w->sfilename);
+			process_file(lc, w->sfilename, NULL, 0);
+			continue;
 		}
 		/* block until there's at least one event to be notified
- 		 * about */
-		len = read(notify_fd, inotify_buf,
+ 		 * about, or a submission */
+		pfds[0].fd = w->notify_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = w->fifo_fd;
+		pfds[1].events = POLLIN;
+		pfds[2].fd = lc->stop_pipe[0];
+		pfds[2].events = POLLIN;
+		r = poll(pfds, 3, -1);
+		if(r < 0) {
+			if(errno != EINTR) {
+				perror(ERRORTEXT("poll() failed"));
+			}
+			continue;
+		}
+		if(pfds[2].revents != 0) {
+			break;
+		}
+		if(pfds[1].revents != 0) {
+			if(read_submission(w->fifo_fd, &sub)) {
+				if(sub.len != 0) {
+					process_file(lc, w->sfilename, sub.buf,
+					             sub.len);
+				}
+				sub.len = 0;
+				/* reopen, to wait for the next writer; if
+				 * that fails, there are no more submissions */
+				close(w->fifo_fd);
+				w->fifo_fd = open_fifo(w->sfifo);
+			}
+		}
+		if(!(pfds[0].revents & POLLIN)) {
+			continue;
+		}
+		len = read(w->notify_fd, inotify_buf,
 		           sizeof(struct inotify_event) + NAME_MAX + 1);
 		if(len <= 0) {
 			perror(ERRORTEXT("read() of inotify event failed"));
@@ -145,7 +466,7 @@ setup_watch:
 			event = (struct inotify_event *) &inotify_buf[i];
 			i += sizeof(struct inotify_event) + event->len;
 
-			if(event->wd != dwatch) {
+			if(event->wd != w->dwatch) {
 				/* FIXME: why wouldn't this be the same? */
 				continue;
 			}
@@ -155,9 +476,212 @@ setup_watch:
  				 * here? */
 				/* the (directory) event was about the file
  				 * we're interested in */
-				process_file(sfilename);
+				process_file(lc, w->sfilename, NULL, 0);
 				break;
 			}
 		}
 	}
+
+	/* stopped */
+	free(sub.buf);
+}
+
+/**
+ * Process the file of a context, and then again whenever it changes or
+ * source is submitted through the fifo. Returns 0 once the context's stop
+ * pipe is written to, or -1 at once if the watch couldn't be set up.
+ */
+int watch_file(struct livec *lc) {
+	struct watch w;
+	if(watch_open(lc, &w) != 0) {
+		return -1;
+	}
+	watch_loop(&w);
+	watch_close(&w);
+	return 0;
+}
+
+/* the string options, which are the arcp_t members of struct livec_opts */
+static const size_t opts_strings[] = {
+	offsetof(struct livec_opts, filename),
+	offsetof(struct livec_opts, compiler),
+	offsetof(struct livec_opts, ldflags),
+	offsetof(struct livec_opts, cflags),
+	offsetof(struct livec_opts, builddir),
+	offsetof(struct livec_opts, entry),
+	offsetof(struct livec_opts, ab_function),
+	offsetof(struct livec_opts, events),
+	offsetof(struct livec_opts, report_dir),
+	offsetof(struct livec_opts, fifo),
+	offsetof(struct livec_opts, build_cpus),
+	offsetof(struct livec_opts, build_cgroup),
+	offsetof(struct livec_opts, log)
+};
+
+#define OPTS_STRING(opts, i) ((arcp_t *) ((char *) (opts) + opts_strings[i]))
+
+static void livec_free(struct livec *lc) {
+	size_t i;
+	for(i = 0; i < sizeof(opts_strings) / sizeof(size_t); i++) {
+		arcp_store(OPTS_STRING(&lc->own_opts, i), NULL);
+	}
+	arcp_store(&lc->periodic_table, NULL);
+	arcp_store(&lc->history, NULL);
+	pthread_mutex_destroy(&lc->switch_lock);
+	ab_forget(lc);
+	afree(lc, sizeof(struct livec));
+}
+
+/* set a string option */
+static int opts_set(arcp_t *opt, char *value) {
+	struct astr *svalue;
+	svalue = astr_cstrdup(value);
+	if(svalue == NULL) {
+		return -1;
+	}
+	arcp_store(opt, svalue);
+	arcp_release(svalue);
+	return 0;
+}
+
+struct livec *livec_create(char *filename) {
+	struct livec *lc;
+	struct livec_opts *opts;
+	char *tmpdir;
+	size_t i;
+
+	if(livec_setup() != 0) {
+		return NULL;
+	}
+	if((livec_opts.rollback != 0) || (livec_opts.history != 0)) {
+		fprintf(stderr, ERRORTEXT("Rollback and history only apply to"
+		                          " the standalone livec; ignoring"
+		                          " them for %s\n"), filename);
+	}
+
+	lc = amalloc(sizeof(struct livec));
+	if(lc == NULL) {
+		return NULL;
+	}
+	memset(lc, 0, sizeof(struct livec));
+	opts = &lc->own_opts;
+	for(i = 0; i < sizeof(opts_strings) / sizeof(size_t); i++) {
+		arcp_init(OPTS_STRING(opts, i), NULL);
+	}
+	arcp_region_init(lc, (void (*)(struct arcp_region *)) livec_free);
+	lc->opts = opts;
+	arcp_init(&lc->autolink_table, NULL);
+	arcp_init(&lc->current_entry, NULL);
+	arcp_init(&lc->link_entry, NULL);
+	arcp_init(&lc->periodic_table, NULL);
+	arcp_init(&lc->history, NULL);
+	pthread_mutex_init(&lc->switch_lock, NULL);
+	lc->embedded = true;
+	lc->stop_pipe[0] = -1;
+	lc->stop_pipe[1] = -1;
+
+	/* the same defaults as the standalone livec */
+	opts->ab_cpu = -1;
+	opts->ab_runs = 9;
+	opts->stress_reloads = 1000;
+	opts->stress_interval = 1000;
+	tmpdir = getenv("TMPDIR");
+	if((opts_set(&opts->filename, filename) != 0)
+	   || (opts_set(&opts->compiler, "cc") != 0)
+	   || (opts_set(&opts->entry, "main") != 0)
+	   || (opts_set(&opts->builddir,
+	                tmpdir == NULL ? "/tmp" : tmpdir) != 0)) {
+		arcp_release(lc);
+		return NULL;
+	}
+	return lc;
+}
+
+struct livec_opts *livec_options(struct livec *lc) {
+	return lc->opts;
+}
+
+int livec_reload(struct livec *lc) {
+	int r;
+	struct astr *sfilename;
+	sfilename = (struct astr *) arcp_load(&lc->opts->filename);
+	if(sfilename == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	r = process_file(lc, sfilename, NULL, 0);
+	arcp_release(sfilename);
+	return r;
+}
+
+/* the content of a context's watcher thread */
+static void *thread_watch(struct watch *w) {
+	struct livec *lc = w->lc;
+	watch_loop(w);
+	watch_close(w);
+	afree(w, sizeof(struct watch));
+	arcp_release(lc);
+	return NULL;
+}
+
+int livec_watch(struct livec *lc) {
+	int r;
+	struct watch *w;
+	if(lc->watching) {
+		errno = EBUSY;
+		return -1;
+	}
+	w = amalloc(sizeof(struct watch));
+	if(w == NULL) {
+		return -1;
+	}
+	/* set up the watch here, so that failing to is returned */
+	if(watch_open(lc, w) != 0) {
+		goto error0;
+	}
+	if(pipe2(lc->stop_pipe, O_CLOEXEC) != 0) {
+		goto error1;
+	}
+	w->lc = (struct livec *) arcp_acquire(lc);
+	/* before the first load, which runs the entry differently once
+	 * watching */
+	lc->watching = true;
+	r = pthread_create(&lc->watcher, NULL,
+	                   (void *(*)(void *)) thread_watch, w);
+	if(r != 0) {
+		lc->watching = false;
+		arcp_release(lc);
+		close(lc->stop_pipe[0]);
+		close(lc->stop_pipe[1]);
+		lc->stop_pipe[0] = -1;
+		lc->stop_pipe[1] = -1;
+		errno = r;
+		goto error1;
+	}
+	return 0;
+
+error1:
+	watch_close(w);
+error0:
+	afree(w, sizeof(struct watch));
+	return -1;
+}
+
+void livec_destroy(struct livec *lc) {
+	if(lc->watching) {
+		if(write(lc->stop_pipe[1], "", 1) != 1) {
+			perror(ERRORTEXT("Failed to stop watcher thread"));
+		} else {
+			pthread_join(lc->watcher, NULL);
+		}
+		close(lc->stop_pipe[0]);
+		close(lc->stop_pipe[1]);
+		lc->watching = false;
+	}
+	/* the autolinks and the current generation refer back to the
+	 * context; dropping them lets it go once nothing of it is running */
+	arcp_store(&lc->autolink_table, NULL);
+	arcp_store(&lc->current_entry, NULL);
+	arcp_store(&lc->link_entry, NULL);
+	arcp_release(lc);
 }
@@ -26,11 +26,133 @@
 
 /* share these functions between files, but don't clutter stuff */
 void str_collapse_ws(char *s) __attribute__((visibility("hidden")));
-char *compile(struct astr *sfilename) __attribute__((visibility("hidden")));
-struct dso_entry *load(char *dsofile) __attribute__((visibility("hidden")));
-void watch_file(void) __attribute__((visibility("hidden")));
-void run(struct dso_entry *entry) __attribute__((visibility("hidden")));
+char *compile(struct livec *lc, struct astr *sfilename, char *source,
+              size_t len) __attribute__((visibility("hidden")));
+struct dso_entry *load(struct livec *lc, char *dsofile)
+	__attribute__((visibility("hidden")));
+int process_file(struct livec *lc, struct astr *sfilename, char *source,
+                 size_t len) __attribute__((visibility("hidden")));
+int watch_file(struct livec *lc) __attribute__((visibility("hidden")));
+void stress(void) __attribute__((visibility("hidden")));
+int run(struct dso_entry *entry) __attribute__((visibility("hidden")));
 void setup_signal_handling(void) __attribute__((visibility("hidden")));
+void setup_control(void) __attribute__((visibility("hidden")));
+void switch_locked(struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+int hotpatch(struct astr *fname, struct dso_entry *from_entry, void *from,
+             struct dso_entry *to_entry, void *to)
+	__attribute__((visibility("hidden")));
+void hotpatch_restore(struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+void hotpatch_free(struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+int hotpatch_setup(void) __attribute__((visibility("hidden")));
+int setup_autolink(void) __attribute__((visibility("hidden")));
+void history_push(struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+void history_step(struct livec *lc, int delta)
+	__attribute__((visibility("hidden")));
+void history_select(struct livec *lc, unsigned long generation)
+	__attribute__((visibility("hidden")));
+bool history_holds(struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+int relink(struct dso_entry *entry) __attribute__((visibility("hidden")));
+void autolink_export(struct livec *lc, FILE *map, char *except)
+	__attribute__((visibility("hidden")));
+struct adict *autolink_names(struct livec *lc)
+	__attribute__((visibility("hidden")));
+struct livec *autolink_context(void) __attribute__((visibility("hidden")));
+struct arcp_region *autolink_acquire(struct livec *lc, char *fname,
+                                     void **fptr)
+	__attribute__((visibility("hidden")));
+int autolink_pins(struct livec *lc, struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+void report_reload(struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+int run_sync(struct dso_entry *entry, void (*fn)(void *), void *arg, int cpu)
+	__attribute__((visibility("hidden")));
+void ab_compare(struct dso_entry *entry) __attribute__((visibility("hidden")));
+bool ab_active(void) __attribute__((visibility("hidden")));
+void ab_forget(struct livec *lc) __attribute__((visibility("hidden")));
+
+struct alink_stats;
+struct alink_stats *alink_stats_create(void)
+	__attribute__((visibility("hidden")));
+void alink_stats_read(struct alink_stats *stats, struct autolink_stats *out)
+	__attribute__((visibility("hidden")));
+void alink_stats_reset(struct alink_stats *stats)
+	__attribute__((visibility("hidden")));
+void profile_register(void *fn, struct alink_stats *stats,
+                      struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+void profile_forget(struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+
+void preload_libraries(struct livec *lc)
+	__attribute__((visibility("hidden")));
+
+struct livec_ring *ring_create(size_t elemsize, size_t nelem, int type)
+	__attribute__((visibility("hidden")));
+
+/* event log types */
+#define EVENT_COMPILE 0
+#define EVENT_RELOAD 1
+#define EVENT_DLOPEN_ERROR 2
+#define EVENT_DLSYM_ERROR 3
+#define EVENT_EXIT 4
+#define EVENT_SIGNAL 5
+#define EVENT_SWITCH 6
+
+int setup_events(void) __attribute__((visibility("hidden")));
+uint64_t event_clock(void) __attribute__((visibility("hidden")));
+void event_log(int type, unsigned long generation, int status, uint64_t ns,
+               const char *text) __attribute__((visibility("hidden")));
+void event_reload(unsigned long generation, uint64_t hash,
+                  uint64_t compile_ns, uint64_t load_ns)
+	__attribute__((visibility("hidden")));
+uint64_t event_source_hash(char *filename, char *source, size_t len)
+	__attribute__((visibility("hidden")));
+
+int setup_log(void) __attribute__((visibility("hidden")));
+
+extern bool heap_interposed __attribute__((visibility("hidden")));
+void setup_heap(void) __attribute__((visibility("hidden")));
+void *heap_malloc(size_t size, void *caller)
+	__attribute__((visibility("hidden")));
+void *heap_calloc(size_t nmemb, size_t size, void *caller)
+	__attribute__((visibility("hidden")));
+void *heap_realloc(void *ptr, size_t size, void *caller)
+	__attribute__((visibility("hidden")));
+void heap_free(void *ptr) __attribute__((visibility("hidden")));
+size_t heap_malloc_usable_size(void *ptr)
+	__attribute__((visibility("hidden")));
+void heap_load(struct dso_entry *entry) __attribute__((visibility("hidden")));
+void heap_unload(struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+
+void hugepage_remap(struct dso_entry *entry)
+	__attribute__((visibility("hidden")));
+int warmup(struct dso_entry *entry) __attribute__((visibility("hidden")));
+
+bool pool_crashed(void) __attribute__((visibility("hidden")));
+
+int setup_perf(void) __attribute__((visibility("hidden")));
+void perf_load(struct dso_entry *entry) __attribute__((visibility("hidden")));
+void perf_keep(struct dso_entry *entry) __attribute__((visibility("hidden")));
+
+/* commands for the control thread */
+#define CONTROL_CRASH 'c'
+#define CONTROL_BACK 'b'
+#define CONTROL_FORWARD 'f'
+#define CONTROL_SELECT 's'
+
+struct control_cmd {
+	char cmd;
+	unsigned long arg;
+};
+
+void control_send(char cmd, unsigned long arg)
+	__attribute__((visibility("hidden")));
 
 struct argstruct {
 	int argc;
@@ -40,3 +162,44 @@ struct argstruct {
 extern pthread_t main_thread __attribute__((visibility("hidden")));
 
 extern struct argstruct args __attribute__((visibility("hidden")));
+
+/**
+ * A livecoding context: one watched file, with its options, generations, and
+ * autolinks. The standalone livec has a single one, livec_main; a host
+ * embedding livec can have any number.
+ */
+struct ab_result;
+
+struct livec {
+	struct arcp_region;
+	struct livec_opts *opts; /**< The options for this context. */
+	arcp_t autolink_table; /**< The autolink functions, by name. */
+	arcp_t current_entry; /**< The most recently loaded dso_entry. */
+	arcp_t link_entry; /**< The dso_entry the autolinks link to. */
+	arcp_t periodic_table; /**< The periodic callbacks, by name. */
+	arcp_t history; /**< The generations that can be switched back to,
+	                 *   oldest first. */
+	struct ab_result *ab_last; /**< The A/B measurements of the generation
+	                            *   measured last, or NULL. */
+	pthread_mutex_t switch_lock; /**< Held while relinking the autolinks
+	                              *   and making a generation current,
+	                              *   whether on a reload, a rollback,
+	                              *   or a switch through the history. */
+	unsigned long link_generation; /**< The generation of link_entry,
+	                                *   published once the autolinks
+	                                *   that are relinked eagerly have
+	                                *   been. */
+	bool embedded; /**< Whether the entry function is called
+	                *   synchronously on each load, for a host, rather
+	                *   than run in its own thread. */
+	int stop_pipe[2]; /**< Written to to stop the watcher thread. */
+	pthread_t watcher; /**< The watcher thread, if watching. */
+	bool watching; /**< Whether there is a watcher thread. */
+	struct livec_opts own_opts; /**< The options of a context made with
+	                             *   livec_create(). */
+};
+
+/* the context of the standalone livec, whose options are livec_opts */
+extern struct livec livec_main __attribute__((visibility("hidden")));
+
+int livec_setup(void) __attribute__((visibility("hidden")));
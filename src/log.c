@@ -0,0 +1,235 @@
+/* log.c Wait-free logging for livecoded threads
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+#include <atomickit/string.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * Each thread that logs gets its own single-producer ring of fixed-size
+ * records, so logging is just formatting into a ring slot: no locks, no
+ * system calls, and, after the first call in a thread, no allocation. A
+ * drainer thread polls all the rings and writes the records out. If a
+ * thread's ring is full, the message is dropped and counted, and the drainer
+ * reports the count.
+ *
+ * The rings are kept on a list that only ever grows. When a thread exits its
+ * ring is marked unused, and the next new thread that logs takes it over.
+ */
+
+/* number of records in each thread's ring */
+#define LOG_RING_SIZE 256
+
+/* maximum length of a message */
+#define LOG_TEXT_MAX 240
+
+/* how often the drainer looks at the rings, in ms */
+#define LOG_DRAIN_INTERVAL 10
+
+struct log_record {
+	uint64_t time; /**< Monotonic time, in ns. */
+	unsigned long generation; /**< Generation of the logging thread, or
+	                           *   0. */
+	char text[LOG_TEXT_MAX]; /**< The message. */
+};
+
+struct log_buffer {
+	struct log_buffer *next; /**< The next buffer on the list. */
+	struct livec_ring *ring; /**< The records. */
+	bool in_use; /**< Whether a thread owns this buffer. */
+	unsigned long dropped; /**< Messages dropped since last reported. */
+};
+
+static struct log_buffer *log_buffers = NULL;
+
+static pthread_key_t log_key;
+
+static __thread struct log_buffer *thread_log = NULL;
+
+static FILE *log_file = NULL;
+
+/* give a thread's buffer back when it exits */
+static void log_thread_exit(struct log_buffer *buf) {
+	__atomic_store_n(&buf->in_use, false, __ATOMIC_RELEASE);
+}
+
+/* get a buffer for the calling thread, reusing one if possible */
+static struct log_buffer *log_buffer_get(void) {
+	struct log_buffer *buf;
+	bool unused;
+
+	for(buf = __atomic_load_n(&log_buffers, __ATOMIC_ACQUIRE);
+	    buf != NULL; buf = buf->next) {
+		unused = false;
+		if(!__atomic_load_n(&buf->in_use, __ATOMIC_RELAXED)
+		   && __atomic_compare_exchange_n(&buf->in_use, &unused, true,
+		                                  false, __ATOMIC_ACQUIRE,
+		                                  __ATOMIC_RELAXED)) {
+			goto out;
+		}
+	}
+
+	buf = amalloc(sizeof(struct log_buffer));
+	if(buf == NULL) {
+		return NULL;
+	}
+	buf->ring = ring_create(sizeof(struct log_record), LOG_RING_SIZE,
+	                        LIVEC_RING_SPSC);
+	if(buf->ring == NULL) {
+		afree(buf, sizeof(struct log_buffer));
+		return NULL;
+	}
+	buf->in_use = true;
+	buf->dropped = 0;
+	buf->next = __atomic_load_n(&log_buffers, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&log_buffers, &buf->next, buf,
+	                                   true, __ATOMIC_RELEASE,
+	                                   __ATOMIC_RELAXED));
+out:
+	pthread_setspecific(log_key, buf);
+	return buf;
+}
+
+int livec_log(const char *fmt, ...) {
+	struct log_record record;
+	struct dso_entry *entry;
+	va_list ap;
+
+	if(thread_log == NULL) {
+		thread_log = log_buffer_get();
+		if(thread_log == NULL) {
+			return -1;
+		}
+	}
+	record.time = event_clock();
+	entry = (struct dso_entry *) pthread_getspecific(entry_key);
+	record.generation = entry == NULL ? 0 : entry->generation;
+	va_start(ap, fmt);
+	vsnprintf(record.text, LOG_TEXT_MAX, fmt, ap);
+	va_end(ap);
+	if(livec_ring_push(thread_log->ring, &record, 1) != 1) {
+		__atomic_add_fetch(&thread_log->dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
+}
+
+static void log_write(struct log_record *record) {
+	size_t len;
+	fprintf(log_file, "[%llu.%06llu] ",
+	        (unsigned long long) (record->time / 1000000000ULL),
+	        (unsigned long long) (record->time % 1000000000ULL / 1000));
+	if(record->generation != 0) {
+		fprintf(log_file, "gen %lu: ", record->generation);
+	}
+	fputs(record->text, log_file);
+	len = strlen(record->text);
+	if((len == 0) || (record->text[len - 1] != '\n')) {
+		fputc('\n', log_file);
+	}
+}
+
+/* the content of the drainer thread */
+static void *thread_log_drain(void *arg __attribute__((unused))) {
+	struct log_buffer *buf;
+	struct log_record records[16];
+	struct timespec interval;
+	size_t i, n;
+	unsigned long dropped;
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = LOG_DRAIN_INTERVAL * 1000000L;
+	for(;;) {
+		nanosleep(&interval, NULL);
+		for(buf = __atomic_load_n(&log_buffers, __ATOMIC_ACQUIRE);
+		    buf != NULL; buf = buf->next) {
+			while((n = livec_ring_pop(buf->ring, records, 16))
+			      > 0) {
+				for(i = 0; i < n; i++) {
+					log_write(&records[i]);
+				}
+			}
+			dropped = __atomic_exchange_n(&buf->dropped, 0,
+			                              __ATOMIC_RELAXED);
+			if(dropped != 0) {
+				fprintf(log_file, ERRORTEXT("[%lu log messages"
+				                            " dropped]\n"),
+				        dropped);
+			}
+		}
+		fflush(log_file);
+	}
+	return NULL;
+}
+
+/**
+ * Start the log drainer, writing to the configured log file or stderr.
+ *
+ * @returns 0 on success, -1 on error.
+ */
+int setup_log() {
+	int r;
+	pthread_t thread;
+	struct astr *path;
+
+	r = pthread_key_create(&log_key,
+	                       (void (*)(void *)) log_thread_exit);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create log"
+		                          " thread-specific storage key")
+		        ": %s\n", strerror(r));
+		return -1;
+	}
+
+	path = (struct astr *) arcp_load(&livec_opts.log);
+	if(path == NULL) {
+		log_file = stderr;
+	} else {
+		log_file = fopen(astr_cstr(path), "ae");
+		if(log_file == NULL) {
+			fprintf(stderr, ERRORTEXT("Failed to open log"
+			                          " file %s") ": %s\n",
+			        astr_cstr(path), strerror(errno));
+			arcp_release(path);
+			return -1;
+		}
+		arcp_release(path);
+	}
+
+	r = pthread_create(&thread, NULL, thread_log_drain, NULL);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create log"
+		                          " thread") ": %s\n",
+		        strerror(r));
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
@@ -19,7 +19,10 @@
 #include <argp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -37,10 +40,118 @@ const char *argp_program_version =
 const char *argp_program_bug_address =
 	"<bugs@FIXME.com>";
 
+/* keys for options without a short version */
+enum {
+	OPT_AB_CPU = 256,
+	OPT_AB_RUNS,
+	OPT_HISTORY_MEM,
+	OPT_LOG_EVENTS,
+	OPT_EXPORT_MAP,
+	OPT_STRESS_RELOADS,
+	OPT_STRESS_INTERVAL,
+	OPT_REPORT,
+	OPT_FIFO,
+	OPT_BUILD_NICE,
+	OPT_BUILD_IDLE,
+	OPT_BUILD_CPUS,
+	OPT_BUILD_CGROUP,
+	OPT_LOG,
+	OPT_HEAP_TRACK,
+	OPT_PERF_MAP,
+	OPT_PERF_KEEP,
+	OPT_LAZY_RELINK,
+	OPT_HUGEPAGES,
+	OPT_WARMUP,
+	OPT_POOL_THREADS
+};
+
 /* command-line options */
 static struct argp_option options[] = {
 	{"entry", 'e', "function", 0, "Name of entry function", 0},
 	{"compiler", 'c', "compiler", 0, "Specify compiler to use", 0},
+	{"ab", 'a', "function", 0,
+	 "Compare each new generation against the previous one by timing"
+	 " function in each while it is current; function takes the entry's"
+	 " arguments, and must return and have no side effects", 0},
+	{"ab-cpu", OPT_AB_CPU, "cpu", 0,
+	 "Pin the A/B comparison runs to cpu", 0},
+	{"ab-runs", OPT_AB_RUNS, "n", 0,
+	 "Number of A/B comparison runs per generation (default: 9)", 0},
+	{"build-nice", OPT_BUILD_NICE, "n", 0,
+	 "Run the compiler with nice value n", 0},
+	{"build-idle", OPT_BUILD_IDLE, NULL, 0,
+	 "Run the compiler with idle cpu (SCHED_IDLE) and io priority", 0},
+	{"build-cpus", OPT_BUILD_CPUS, "list", 0,
+	 "Run the compiler only on the cpus in list, such as 0-3,6; leave out"
+	 " the cpus the livecoded threads run on", 0},
+	{"build-cgroup", OPT_BUILD_CGROUP, "dir", 0,
+	 "Run the compiler in the cgroup at dir", 0},
+	{"rollback", 'r', "ms", OPTION_ARG_OPTIONAL,
+	 "When the running generation crashes, restart the last one that"
+	 " ran for at least ms milliseconds (default: 500)", 0},
+	{"heap-track", OPT_HEAP_TRACK, NULL, 0,
+	 "Account for heap allocations by the generation whose code made"
+	 " them, and report what each generation leaves allocated when it is"
+	 " unloaded", 0},
+	{"history", 'H', "n", 0,
+	 "Keep the last n generations loaded; SIGUSR1 and SIGUSR2 step back"
+	 " and forward through them, and either one sent with a value"
+	 " switches to that generation", 0},
+	{"history-mem", OPT_HISTORY_MEM, "KiB", 0,
+	 "Limit the total size of the generations in the history", 0},
+	{"export-map", OPT_EXPORT_MAP, NULL, 0,
+	 "Export only the entry and autolinked functions from each DSO,"
+	 " which makes it faster to load", 0},
+	{"fifo", OPT_FIFO, "path", 0,
+	 "Also compile whatever is written to the fifo at path, up to the"
+	 " writer closing it, in place of the file; for submitting editor"
+	 " buffers or regions without saving them", 0},
+	{"hotpatch", 'P', NULL, 0,
+	 "Patch the functions of old generations to jump directly to their"
+	 " new versions (x86-64 only)", 0},
+	{"hugepages", OPT_HUGEPAGES, NULL, 0,
+	 "Move the text of each generation onto transparent huge pages, to"
+	 " cut down on iTLB misses; only the whole 2 MiB-aligned windows of"
+	 " it are moved", 0},
+	{"lazy-relink", OPT_LAZY_RELINK, NULL, 0,
+	 "On a reload, relink each typed autolink only when it is next"
+	 " called, so that reloading costs the same however many autolinks"
+	 " there are", 0},
+	{"log", OPT_LOG, "file", 0,
+	 "Write messages from livec_log() to file instead of stderr", 0},
+	{"log-events", OPT_LOG_EVENTS, "file", 0,
+	 "Append a JSON lines log of compiles, loads, and thread exits to"
+	 " file (use /dev/fd/n for an open file descriptor)", 0},
+	{"report", OPT_REPORT, "dir", 0,
+	 "Write a report on the size, instructions, and vectorization of the"
+	 " entry and autolinked functions of each generation to dir, with a"
+	 " disassembly diff against the previous generation", 0},
+	{"perf-map", OPT_PERF_MAP, NULL, 0,
+	 "Write the functions of each generation, tagged with the generation,"
+	 " to /tmp/perf-<pid>.map for perf and other profilers; perf only uses"
+	 " it for text that --hugepages has moved into anonymous memory", 0},
+	{"perf-keep", OPT_PERF_KEEP, "dir", 0,
+	 "Keep a copy of each generation's DSO in dir when it is unloaded,"
+	 " for adding to perf's build-id cache", 0},
+	{"pool-threads", OPT_POOL_THREADS, "n", 0,
+	 "Number of worker threads for livec_pool_spawn() and"
+	 " livec_pool_parallel_for() (default: one per online CPU)", 0},
+	{"profile", 'p', "n", OPTION_ARG_OPTIONAL,
+	 "Count calls to autolink functions and time every nth one"
+	 " (default: 64)", 0},
+	{"warmup", OPT_WARMUP, NULL, 0,
+	 "Before switching to a new generation, fault in its code and data and"
+	 " run its livec_warmup() function, if it has one, on a thread with"
+	 " ordinary scheduling", 0},
+	{"stress", 's', "threads", 0,
+	 "Instead of watching the file, compile it once and reload it over and"
+	 " over while threads call its livec_stress() function, and its"
+	 " livec_stress_generic() function if it has one, then report call and"
+	 " reload latencies", 0},
+	{"stress-reloads", OPT_STRESS_RELOADS, "n", 0,
+	 "Number of reloads when stressing (default: 1000)", 0},
+	{"stress-interval", OPT_STRESS_INTERVAL, "us", 0,
+	 "Microseconds between reloads when stressing (default: 1000)", 0},
 	{NULL, 'W', "option", OPTION_HIDDEN, NULL, 0},
 	{"-Wc,option", 0, NULL, OPTION_DOC,
 	 "Pass option directly to the compiler", 0},
@@ -65,43 +176,17 @@ static struct astr default_entry = {
 /* this will be set from the TMPDIR variable if it is available */
 static char *default_builddir = "/tmp";
 
-/* initialize options structure to NULL */
-struct livec_opts livec_opts = {
-	ARCP_VAR_INIT(NULL),
-	ARCP_VAR_INIT(NULL),
-	ARCP_VAR_INIT(NULL),
-	ARCP_VAR_INIT(NULL),
-	ARCP_VAR_INIT(NULL),
-	ARCP_VAR_INIT(NULL)
-};
-
-/* utility function to collapse whitespace to a minimum; naïvely slow */
-void str_collapse_ws(char *s) {
-	bool lastspace;
-	lastspace = true;
-	while(*s != '\0') {
-		switch(*s) {
-		case ' ':
-		case '\t':
-		case '\v':
-		case '\n':
-		case '\f':
-		case '\r':
-			if(lastspace) {
-				memmove(s, s + 1, strlen(s));
-			} else {
-				lastspace = true;
-				*s++ = ' ';
-			}
-			if(*s == '\0') {
-				*--s = '\0';
-			}
-			break;
-		default:
-			lastspace = false;
-			s += 1;
-		}
+/* parse a non-negative integer option argument or die */
+static int parse_uint_opt(char *arg, struct argp_state *pstate) {
+	char *end;
+	long l;
+	errno = 0;
+	l = strtol(arg, &end, 10);
+	if((errno != 0) || (*end != '\0') || (end == arg)
+	   || (l < 0) || (l > INT_MAX)) {
+		argp_error(pstate, "invalid number '%s'", arg);
 	}
+	return (int) l;
 }
 
 /* This parses the options. It is called in order for each option string. */
@@ -137,6 +222,161 @@ static error_t argp_parse_opt(int key, char *arg, struct argp_state *pstate) {
 		arcp_release(compiler);
 		break;
 	}
+	case 'a': { /* ab */
+		struct astr *fname;
+		fname = astr_cstrdup(arg);
+		if(fname == NULL) {
+			perror(ERRORTEXT("Fatal: failed to strdup A/B function"));
+			exit(EXIT_FAILURE);
+		}
+		arcp_store(&livec_opts.ab_function, fname);
+		arcp_release(fname);
+		break;
+	}
+	case OPT_AB_CPU:
+		livec_opts.ab_cpu = parse_uint_opt(arg, pstate);
+		break;
+	case OPT_AB_RUNS:
+		livec_opts.ab_runs = parse_uint_opt(arg, pstate);
+		if(livec_opts.ab_runs == 0) {
+			argp_error(pstate, "need at least one A/B run");
+		}
+		break;
+	case 'p': /* profile */
+		livec_opts.profile = arg == NULL ? 64
+			: parse_uint_opt(arg, pstate);
+		if(livec_opts.profile == 0) {
+			argp_error(pstate, "profile interval must be positive");
+		}
+		break;
+	case 'r': /* rollback */
+		livec_opts.rollback = arg == NULL ? 500
+			: parse_uint_opt(arg, pstate);
+		if(livec_opts.rollback == 0) {
+			argp_error(pstate, "rollback grace period must be"
+			           " positive");
+		}
+		break;
+	case 'H': /* history */
+		livec_opts.history = parse_uint_opt(arg, pstate);
+		break;
+	case OPT_HISTORY_MEM:
+		livec_opts.history_mem = parse_uint_opt(arg, pstate);
+		break;
+	case OPT_HEAP_TRACK:
+		livec_opts.heap_track = true;
+		break;
+	case 'P': /* hotpatch */
+		livec_opts.hotpatch = true;
+		break;
+	case 's': /* stress */
+		livec_opts.stress = parse_uint_opt(arg, pstate);
+		break;
+	case OPT_STRESS_RELOADS:
+		livec_opts.stress_reloads = parse_uint_opt(arg, pstate);
+		break;
+	case OPT_STRESS_INTERVAL:
+		livec_opts.stress_interval = parse_uint_opt(arg, pstate);
+		break;
+	case OPT_EXPORT_MAP:
+		livec_opts.export_map = true;
+		break;
+	case OPT_BUILD_NICE:
+		livec_opts.build_nice = parse_uint_opt(arg, pstate);
+		if(livec_opts.build_nice > 19) {
+			argp_error(pstate, "nice value must be at most 19");
+		}
+		break;
+	case OPT_BUILD_IDLE:
+		livec_opts.build_idle = true;
+		break;
+	case OPT_BUILD_CPUS:
+	case OPT_BUILD_CGROUP: {
+		struct astr *value;
+		value = astr_cstrdup(arg);
+		if(value == NULL) {
+			perror(ERRORTEXT("Fatal: failed to strdup build"
+			                 " option"));
+			exit(EXIT_FAILURE);
+		}
+		arcp_store(key == OPT_BUILD_CPUS ? &livec_opts.build_cpus
+		           : &livec_opts.build_cgroup, value);
+		arcp_release(value);
+		break;
+	}
+	case OPT_FIFO: {
+		struct astr *fifo;
+		fifo = astr_cstrdup(arg);
+		if(fifo == NULL) {
+			perror(ERRORTEXT("Fatal: failed to strdup fifo path"));
+			exit(EXIT_FAILURE);
+		}
+		arcp_store(&livec_opts.fifo, fifo);
+		arcp_release(fifo);
+		break;
+	}
+	case OPT_REPORT: {
+		struct astr *dir;
+		dir = astr_cstrdup(arg);
+		if(dir == NULL) {
+			perror(ERRORTEXT("Fatal: failed to strdup report"
+			                 " directory"));
+			exit(EXIT_FAILURE);
+		}
+		arcp_store(&livec_opts.report_dir, dir);
+		arcp_release(dir);
+		break;
+	}
+	case OPT_LOG: {
+		struct astr *path;
+		path = astr_cstrdup(arg);
+		if(path == NULL) {
+			perror(ERRORTEXT("Fatal: failed to strdup log file name"));
+			exit(EXIT_FAILURE);
+		}
+		arcp_store(&livec_opts.log, path);
+		arcp_release(path);
+		break;
+	}
+	case OPT_WARMUP:
+		livec_opts.warmup = true;
+		break;
+	case OPT_POOL_THREADS:
+		livec_opts.pool_threads = parse_uint_opt(arg, pstate);
+		break;
+	case OPT_HUGEPAGES:
+		livec_opts.hugepages = true;
+		break;
+	case OPT_LAZY_RELINK:
+		livec_opts.lazy_relink = true;
+		break;
+	case OPT_PERF_MAP:
+		livec_opts.perf_map = true;
+		break;
+	case OPT_PERF_KEEP: {
+		struct astr *path;
+		path = astr_cstrdup(arg);
+		if(path == NULL) {
+			perror(ERRORTEXT("Fatal: failed to strdup perf keep"
+			                 " directory name"));
+			exit(EXIT_FAILURE);
+		}
+		arcp_store(&livec_opts.perf_keep, path);
+		arcp_release(path);
+		break;
+	}
+	case OPT_LOG_EVENTS: {
+		struct astr *path;
+		path = astr_cstrdup(arg);
+		if(path == NULL) {
+			perror(ERRORTEXT("Fatal: failed to strdup event log"
+			                 " file name"));
+			exit(EXIT_FAILURE);
+		}
+		arcp_store(&livec_opts.events, path);
+		arcp_release(path);
+		break;
+	}
 	case 'W': { /* fake W option */
 		char wtype;
 		switch(wtype = *arg++) {
@@ -308,25 +548,27 @@ static void parse_opts(int argc, char **argv) {
 	if(arcp_load_phantom(&livec_opts.entry) == NULL) {
 		arcp_store(&livec_opts.entry, &default_entry);
 	}
-}
 
-pthread_t main_thread __attribute__((visibility("hidden")));
+	if((arcp_load_phantom(&livec_opts.ab_function) != NULL)
+	   && (strcmp(astr_cstr((struct astr *) arcp_load_phantom(
+	                  &livec_opts.ab_function)),
+	              astr_cstr((struct astr *) arcp_load_phantom(
+	                  &livec_opts.entry))) == 0)) {
+		/* the entry usually loops, and it has side effects */
+		fprintf(stderr, ERRORTEXT("Fatal: the A/B comparison function"
+		                          " can't be the entry function\n"));
+		exit(EXIT_FAILURE);
+	}
+}
 
 /* don't clutter the space */
 int main(int argc, char **argv) __attribute__((visibility("hidden")));
 
 int main(int argc, char **argv) {
-	int r;
-
 	parse_opts(argc, argv);
 
-	/* create the thread-specific storage key for dso_entry */
-	r = pthread_key_create(&entry_key, (void (*)(void *)) arcp_release);
-	if(r != 0) {
-		fprintf(stderr, ERRORTEXT("Fatal: Failed to create"
-		                          " thread-specific storage key for"
-					  " dso_entry") ": %s\n",
-		                          strerror(r));
+	/* the entry key, the log, and the event log */
+	if(livec_setup() != 0) {
 		exit(EXIT_FAILURE);
 	}
 
@@ -336,8 +578,17 @@ int main(int argc, char **argv) {
 
 	/* set up signal catching */
 	setup_signal_handling();
+	setup_control();
+	if(livec_opts.hotpatch && (hotpatch_setup() != 0)) {
+		livec_opts.hotpatch = false;
+	}
 
-	watch_file();
+	if(livec_opts.stress != 0) {
+		stress();
+	}
+	if(watch_file(&livec_main) != 0) {
+		exit(EXIT_FAILURE);
+	}
 
 	return 0;
 }
@@ -0,0 +1,65 @@
+/* malloc.c Allocator interposers for heap tracking
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <malloc.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * This file is only linked into the livec program, never into liblivec, so
+ * that embedding livec leaves the host's allocator alone. The interposers
+ * pass their caller on to heap.c, which does the rest.
+ */
+
+static void *interpose_malloc(size_t size) {
+	return heap_malloc(size, __builtin_return_address(0));
+}
+
+static void *interpose_calloc(size_t nmemb, size_t size) {
+	return heap_calloc(nmemb, size, __builtin_return_address(0));
+}
+
+static void *interpose_realloc(void *ptr, size_t size) {
+	return heap_realloc(ptr, size, __builtin_return_address(0));
+}
+
+static void interpose_free(void *ptr) {
+	heap_free(ptr);
+}
+
+static size_t interpose_malloc_usable_size(void *ptr) {
+	return heap_malloc_usable_size(ptr);
+}
+
+__typeof(malloc) malloc __attribute__((weak, alias("interpose_malloc")));
+__typeof(calloc) calloc __attribute__((weak, alias("interpose_calloc")));
+__typeof(realloc) realloc __attribute__((weak, alias("interpose_realloc")));
+__typeof(free) free __attribute__((weak, alias("interpose_free")));
+__typeof(malloc_usable_size) malloc_usable_size
+	__attribute__((weak, alias("interpose_malloc_usable_size")));
+
+/* in a static link, glibc's malloc wins over the weak one here */
+static void __attribute__((constructor)) malloc_check(void) {
+	heap_interposed = (void *) malloc == (void *) interpose_malloc;
+}
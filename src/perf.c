@@ -0,0 +1,246 @@
+/* perf.c Let profilers symbolize generations
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <link.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomickit/rcp.h>
+#include <atomickit/string.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * Each generation's DSO is unlinked when the generation is unloaded, so a
+ * profile spanning reloads can't find the code it sampled. With --perf-map,
+ * the function symbols of every generation are written, as they are loaded,
+ * to /tmp/perf-<pid>.map, named with their generation. perf only consults
+ * the map for samples in anonymous memory, which a generation's text is only
+ * where --hugepages has moved it. With --perf-keep, a copy of each DSO is
+ * kept in a directory before it is unlinked, so that it can be added to
+ * perf's build-id cache afterwards; that covers file-backed text.
+ */
+
+static FILE *perf_map = NULL;
+
+/**
+ * Open the perf map, if it was asked for.
+ *
+ * @returns 0 on success, -1 on error.
+ */
+int setup_perf() {
+	char path[PATH_MAX];
+
+	if(!livec_opts.perf_map) {
+		return 0;
+	}
+	snprintf(path, PATH_MAX, "/tmp/perf-%d.map", (int) getpid());
+	perf_map = fopen(path, "we");
+	if(perf_map == NULL) {
+		fprintf(stderr, ERRORTEXT("Failed to open perf map %s")
+		        ": %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* write the functions in a symbol table to the perf map */
+static void perf_map_symbols(ElfW(Addr) base, ElfW(Sym) *syms, size_t nsyms,
+                             char *strtab, size_t strsize,
+                             unsigned long generation) {
+	size_t i;
+
+	for(i = 0; i < nsyms; i++) {
+		if((ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC)
+		   || (syms[i].st_shndx == SHN_UNDEF)
+		   || (syms[i].st_size == 0)
+		   || (syms[i].st_name >= strsize)) {
+			continue;
+		}
+		fprintf(perf_map, "%lx %lx %s [gen %lu]\n",
+		        (unsigned long) (base + syms[i].st_value),
+		        (unsigned long) syms[i].st_size,
+		        strtab + syms[i].st_name, generation);
+	}
+}
+
+/**
+ * Write the functions of a newly loaded generation to the perf map.
+ */
+void perf_load(struct dso_entry *entry) {
+	int fd;
+	struct stat st;
+	struct link_map *map;
+	char *file;
+	ElfW(Ehdr) *ehdr;
+	ElfW(Shdr) *shdrs;
+	ElfW(Shdr) *symtab = NULL;
+	int i;
+
+	if(perf_map == NULL) {
+		return;
+	}
+	if(dlinfo(entry->dlhandle, RTLD_DI_LINKMAP, &map) != 0) {
+		fprintf(stderr, ERRORTEXT("Could not find where %s is loaded:"
+		                          " %s\n"),
+		        entry->dsofile, dlerror());
+		return;
+	}
+
+	fd = open(entry->dsofile, O_RDONLY|O_CLOEXEC);
+	if(fd == -1) {
+		fprintf(stderr, ERRORTEXT("Failed to open %s") ": %s\n",
+		        entry->dsofile, strerror(errno));
+		return;
+	}
+	if(fstat(fd, &st) != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to stat %s") ": %s\n",
+		        entry->dsofile, strerror(errno));
+		goto error0;
+	}
+	if((size_t) st.st_size < sizeof(ElfW(Ehdr))) {
+		goto bad;
+	}
+	file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(file == MAP_FAILED) {
+		fprintf(stderr, ERRORTEXT("Failed to map %s") ": %s\n",
+		        entry->dsofile, strerror(errno));
+		goto error0;
+	}
+
+	/* prefer the full symbol table, for the static functions too */
+	ehdr = (ElfW(Ehdr) *) file;
+	if((memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0)
+	   || (ehdr->e_shoff == 0)
+	   || (ehdr->e_shentsize != sizeof(ElfW(Shdr)))
+	   || (ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr))
+	       > (size_t) st.st_size)) {
+		goto error1;
+	}
+	shdrs = (ElfW(Shdr) *) (file + ehdr->e_shoff);
+	for(i = 0; i < ehdr->e_shnum; i++) {
+		if((shdrs[i].sh_type == SHT_SYMTAB)
+		   || ((shdrs[i].sh_type == SHT_DYNSYM) && (symtab == NULL))) {
+			symtab = &shdrs[i];
+		}
+	}
+	if((symtab == NULL) || (symtab->sh_link >= ehdr->e_shnum)
+	   || (symtab->sh_offset + symtab->sh_size > (size_t) st.st_size)
+	   || (shdrs[symtab->sh_link].sh_offset
+	       + shdrs[symtab->sh_link].sh_size > (size_t) st.st_size)) {
+		goto error1;
+	}
+	perf_map_symbols(map->l_addr, (ElfW(Sym) *) (file + symtab->sh_offset),
+	                 symtab->sh_size / sizeof(ElfW(Sym)),
+	                 file + shdrs[symtab->sh_link].sh_offset,
+	                 shdrs[symtab->sh_link].sh_size, entry->generation);
+	if(fflush(perf_map) != 0) {
+		perror(ERRORTEXT("Failed to write perf map"));
+	}
+
+	munmap(file, st.st_size);
+	close(fd);
+	return;
+
+error1:
+	munmap(file, st.st_size);
+bad:
+	fprintf(stderr, ERRORTEXT("Could not read the symbols of %s\n"),
+	        entry->dsofile);
+error0:
+	close(fd);
+}
+
+/* copy a file, for when it can't be linked */
+static int perf_copy(char *from, char *to) {
+	int infd, outfd;
+	char buf[4096];
+	ssize_t n, w, off;
+	int ret = -1;
+
+	infd = open(from, O_RDONLY|O_CLOEXEC);
+	if(infd == -1) {
+		return -1;
+	}
+	outfd = open(to, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if(outfd == -1) {
+		goto out0;
+	}
+	while((n = read(infd, buf, sizeof(buf))) != 0) {
+		if(n == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			goto out1;
+		}
+		for(off = 0; off < n; off += w) {
+			w = write(outfd, buf + off, n - off);
+			if(w == -1) {
+				if(errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				goto out1;
+			}
+		}
+	}
+	ret = 0;
+out1:
+	if((close(outfd) != 0) || (ret != 0)) {
+		ret = -1;
+		unlink(to);
+	}
+out0:
+	close(infd);
+	return ret;
+}
+
+/**
+ * Keep a copy of the DSO of a generation that is about to be unloaded, if a
+ * directory to keep them in was given.
+ */
+void perf_keep(struct dso_entry *entry) {
+	struct astr *sdir;
+	char path[PATH_MAX];
+	char *base;
+
+	sdir = (struct astr *) arcp_load(&livec_opts.perf_keep);
+	if(sdir == NULL) {
+		return;
+	}
+	base = strrchr(entry->dsofile, '/');
+	base = base == NULL ? entry->dsofile : base + 1;
+	snprintf(path, PATH_MAX, "%s/%s", astr_cstr(sdir), base);
+	if((link(entry->dsofile, path) != 0)
+	   && (perf_copy(entry->dsofile, path) != 0)) {
+		fprintf(stderr, ERRORTEXT("Failed to keep a copy of %s in %s")
+		        ": %s\n", entry->dsofile, astr_cstr(sdir),
+		        strerror(errno));
+	}
+	arcp_release(sdir);
+}
@@ -0,0 +1,352 @@
+/* periodic.c Deadline-driven periodic callbacks
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+#include <atomickit/dict.h>
+#include <atomickit/string.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * Each periodic callback gets its own thread, which sleeps until an absolute
+ * deadline, calls whatever version of the callback's autolink is current, and
+ * moves the deadline on by one period. A tick holds a reference to the
+ * generation it calls into, so a reload can never unload code from under it;
+ * the new version is picked up on the next tick. When a tick overruns one or
+ * more deadlines, those ticks are counted as missed and skipped, rather than
+ * run late in a burst. Callbacks are kept by name in the table of the context
+ * that created them, so that contexts can use the same names. A thread sets
+ * its own real-time priority, since the thread of a callback that is being
+ * taken over may be exiting at any time.
+ */
+
+struct periodic {
+	struct arcp_region;
+	char *fname; /**< The name of the callback's autolink. */
+	struct livec *livec; /**< The context the autolink is in. */
+	uint64_t period; /**< The period, in ns. */
+	void *arg; /**< The argument to the callback. */
+	int priority; /**< The real-time priority wanted, or 0. */
+	bool stop; /**< Set to stop the thread. */
+	pthread_t thread; /**< The thread running the callback. */
+	struct livec_periodic_stats stats; /**< Statistics. */
+};
+
+static void periodic_destroy(struct periodic *p) {
+	arcp_release(p->livec);
+	afree(p->fname, strlen(p->fname) + 1);
+	afree(p, sizeof(struct periodic));
+}
+
+/* find the periodic callback of the given name in the table, or NULL */
+static struct periodic *periodic_find(struct adict *table, char *fname) {
+	int i, len;
+	if(table == NULL) {
+		return NULL;
+	}
+	len = adict_len(table);
+	for(i = 0; i < len; i++) {
+		if(strcmp(astr_cstr(table->items[i].key), fname) == 0) {
+			return (struct periodic *) table->items[i].value;
+		}
+	}
+	return NULL;
+}
+
+static inline void timespec_add_ns(struct timespec *ts, uint64_t ns) {
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static inline int64_t timespec_diff_ns(struct timespec *a,
+                                       struct timespec *b) {
+	return (a->tv_sec - b->tv_sec) * 1000000000LL
+		+ a->tv_nsec - b->tv_nsec;
+}
+
+static void periodic_record_jitter(struct periodic *p, uint64_t ns) {
+	int bucket;
+	struct autolink_stats *jitter = &p->stats.jitter;
+	bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+	if(bucket >= AUTOLINK_STATS_BUCKETS) {
+		bucket = AUTOLINK_STATS_BUCKETS - 1;
+	}
+	__atomic_add_fetch(&jitter->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&jitter->samples, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&jitter->sample_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&jitter->histogram[bucket], 1, __ATOMIC_RELAXED);
+	if(ns > p->stats.max_jitter_ns) {
+		__atomic_store_n(&p->stats.max_jitter_ns, ns,
+		                 __ATOMIC_RELAXED);
+	}
+}
+
+/* give the calling thread a real-time priority, or take it away if priority
+ * is 0, or say why not */
+static void periodic_set_priority(struct periodic *p, int priority) {
+	int r;
+	struct sched_param param;
+	param.sched_priority = priority;
+	r = pthread_setschedparam(pthread_self(),
+	                          priority > 0 ? SCHED_FIFO : SCHED_OTHER,
+	                          &param);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to set real-time priority %d"
+		                          " for '%s'") ": %s\n",
+		        priority, p->fname, strerror(r));
+	}
+}
+
+/* the content of a periodic thread */
+static void *thread_periodic(struct periodic *p) {
+	struct timespec deadline, now;
+	struct arcp_region *ref;
+	void (*fn)(void *);
+	uint64_t period, missed;
+	int64_t late;
+	int priority, applied;
+
+	/* created with the priority it has */
+	applied = __atomic_load_n(&p->priority, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	while(!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+		priority = __atomic_load_n(&p->priority, __ATOMIC_RELAXED);
+		if(priority != applied) {
+			periodic_set_priority(p, priority);
+			applied = priority;
+		}
+		period = __atomic_load_n(&p->period, __ATOMIC_RELAXED);
+		timespec_add_ns(&deadline, period);
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		                      &deadline, NULL) == EINTR) {
+			/* keep sleeping */
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		late = timespec_diff_ns(&now, &deadline);
+		periodic_record_jitter(p, late < 0 ? 0 : late);
+
+		ref = autolink_acquire(p->livec, p->fname, (void **) &fn);
+		if(ref != NULL) {
+			fn(__atomic_load_n(&p->arg, __ATOMIC_RELAXED));
+			arcp_release(ref);
+		}
+		__atomic_add_fetch(&p->stats.ticks, 1, __ATOMIC_RELAXED);
+
+		/* skip any deadlines that have gone by */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		late = timespec_diff_ns(&now, &deadline);
+		if(late > (int64_t) period) {
+			missed = late / period;
+			__atomic_add_fetch(&p->stats.misses, missed,
+			                   __ATOMIC_RELAXED);
+			timespec_add_ns(&deadline, missed * period);
+		}
+	}
+	arcp_release(p);
+	return NULL;
+}
+
+/* start the thread of a callback, with real-time priority if it wants it */
+static int periodic_start(struct periodic *p) {
+	int r;
+	pthread_attr_t attr;
+	struct sched_param param;
+
+	r = pthread_attr_init(&attr);
+	if(r != 0) {
+		return r;
+	}
+	if(p->priority > 0) {
+		param.sched_priority = p->priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	/* the thread holds a reference as well */
+	r = pthread_create(&p->thread, &attr,
+	                   (void *(*)(void *)) thread_periodic,
+	                   arcp_acquire(p));
+	if((r == EPERM) && (p->priority > 0)) {
+		fprintf(stderr, ERRORTEXT("Failed to set real-time priority %d"
+		                          " for '%s'") ": %s\n",
+		        p->priority, p->fname, strerror(r));
+		p->priority = 0;
+		r = pthread_create(&p->thread, NULL,
+		                   (void *(*)(void *)) thread_periodic, p);
+	}
+	if(r != 0) {
+		arcp_release(p);
+	}
+	pthread_attr_destroy(&attr);
+	return r;
+}
+
+int livec_periodic_create(void (*fptr)(void *), char *fname,
+                          unsigned long long period_ns, int priority,
+                          void *arg) {
+	int r;
+	struct livec *lc;
+	struct adict *table;
+	struct adict *new_table;
+	struct periodic *p;
+
+	if(period_ns == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* the callback is called through an autolink, so that it's relinked
+	 * along with everything else */
+	if(autolink_slot_create((void *) fptr, fname) == NULL) {
+		return -1;
+	}
+
+	/* the autolink was created in the calling thread's context */
+	lc = autolink_context();
+	table = (struct adict *) arcp_load(&lc->periodic_table);
+	p = periodic_find(table, fname);
+	if(p != NULL) {
+		/* a new generation is taking over the callback; its thread
+		 * picks up the priority on the next tick */
+		__atomic_store_n(&p->period, period_ns, __ATOMIC_RELAXED);
+		__atomic_store_n(&p->arg, arg, __ATOMIC_RELAXED);
+		__atomic_store_n(&p->priority, priority < 0 ? 0 : priority,
+		                 __ATOMIC_RELAXED);
+		arcp_release(table);
+		return 0;
+	}
+	arcp_release(table);
+
+	p = amalloc(sizeof(struct periodic));
+	if(p == NULL) {
+		return -1;
+	}
+	memset(p, 0, sizeof(struct periodic));
+	p->fname = amalloc(strlen(fname) + 1);
+	if(p->fname == NULL) {
+		afree(p, sizeof(struct periodic));
+		return -1;
+	}
+	strcpy(p->fname, fname);
+	p->livec = (struct livec *) arcp_acquire(lc);
+	arcp_region_init(p, (void (*)(struct arcp_region *)) periodic_destroy);
+	p->period = period_ns;
+	p->arg = arg;
+	p->priority = priority < 0 ? 0 : priority;
+
+	do {
+		table = (struct adict *) arcp_load(&lc->periodic_table);
+		if(periodic_find(table, fname) != NULL) {
+			/* created by someone else in the meantime */
+			arcp_release(table);
+			arcp_release(p);
+			errno = EEXIST;
+			return -1;
+		}
+		if(table == NULL) {
+			new_table = adict_create_cstrput(fname, p);
+		} else {
+			new_table = adict_dup_cstrput(table, fname, p);
+		}
+		if(new_table == NULL) {
+			arcp_release(table);
+			arcp_release(p);
+			return -1;
+		}
+	} while(!arcp_cas_release(&lc->periodic_table, table, new_table));
+
+	r = periodic_start(p);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create periodic thread"
+		                          " for '%s'") ": %s\n",
+		        fname, strerror(r));
+		livec_periodic_destroy(fname);
+		arcp_release(p);
+		errno = r;
+		return -1;
+	}
+	pthread_detach(p->thread);
+	arcp_release(p);
+	return 0;
+}
+
+int livec_periodic_destroy(char *fname) {
+	struct livec *lc;
+	struct adict *table;
+	struct adict *new_table;
+	struct periodic *p;
+
+	lc = autolink_context();
+	do {
+		table = (struct adict *) arcp_load(&lc->periodic_table);
+		p = periodic_find(table, fname);
+		if(p == NULL) {
+			arcp_release(table);
+			errno = EINVAL;
+			return -1;
+		}
+		__atomic_store_n(&p->stop, true, __ATOMIC_RELEASE);
+		new_table = adict_dup_cstrdel(table, fname);
+		if(new_table == NULL) {
+			arcp_release(table);
+			return -1;
+		}
+	} while(!arcp_cas_release(&lc->periodic_table, table, new_table));
+	return 0;
+}
+
+int livec_periodic_stats(char *fname, struct livec_periodic_stats *stats) {
+	struct adict *table;
+	struct periodic *p;
+	int i;
+
+	table = (struct adict *) arcp_load(&autolink_context()->periodic_table);
+	p = periodic_find(table, fname);
+	if(p == NULL) {
+		arcp_release(table);
+		errno = EINVAL;
+		return -1;
+	}
+	stats->ticks = __atomic_load_n(&p->stats.ticks, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&p->stats.misses, __ATOMIC_RELAXED);
+	stats->max_jitter_ns = __atomic_load_n(&p->stats.max_jitter_ns,
+	                                       __ATOMIC_RELAXED);
+	stats->jitter.calls = __atomic_load_n(&p->stats.jitter.calls,
+	                                      __ATOMIC_RELAXED);
+	stats->jitter.samples = __atomic_load_n(&p->stats.jitter.samples,
+	                                        __ATOMIC_RELAXED);
+	stats->jitter.sample_ns = __atomic_load_n(&p->stats.jitter.sample_ns,
+	                                          __ATOMIC_RELAXED);
+	for(i = 0; i < AUTOLINK_STATS_BUCKETS; i++) {
+		stats->jitter.histogram[i] = __atomic_load_n(
+			&p->stats.jitter.histogram[i], __ATOMIC_RELAXED);
+	}
+	arcp_release(table);
+	return 0;
+}
@@ -0,0 +1,581 @@
+/* pool.c Work-stealing task pool for livecoded code
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * The pool is a fixed set of worker threads, started on first use. Each
+ * worker has a Chase-Lev deque: it pushes and pops the tasks it spawns at
+ * the bottom, and idle workers steal from the top. Tasks spawned from
+ * threads outside the pool go on a shared ring that the workers take turns
+ * draining. A thread waiting on a group runs tasks itself until the group is
+ * done, so nested spawning doesn't deadlock.
+ *
+ * Each task holds a reference to the generation that spawned it, and runs
+ * with that generation as its thread's dso_entry, so an old generation stays
+ * loaded until its last task finishes, and autolinked calls from a task go
+ * through the context of the generation that spawned it.
+ *
+ * A fatal signal in a task is handled like one in a run thread: the crash is
+ * reported for rollback, and the thread exits. Before it does, the tasks it
+ * was running are counted as failed in their groups, so nothing waits on
+ * them forever. A worker that exits this way is replaced the next time
+ * anything is spawned, and the tasks left in its deque are stolen by the
+ * others meanwhile. This is best-effort: whatever locks the task held stay
+ * held, so anything else that takes them, in a task or not, deadlocks.
+ */
+
+/* capacity of each worker's deque; a power of two */
+#define POOL_DEQUE_SIZE 4096
+
+/* capacity of the ring for tasks from outside the pool */
+#define POOL_INJECT_SIZE 1024
+
+/* times an idle worker looks for work before it sleeps */
+#define POOL_SPIN 64
+
+#define POOL_CACHE_LINE 64
+
+struct pool_task {
+	void (*fn)(void *); /**< The task. */
+	void *arg; /**< The argument to fn. */
+	struct livec_pool_group *group; /**< The group, or NULL. */
+	struct dso_entry *entry; /**< The generation that spawned it, or
+	                          *   NULL. */
+	struct arcp_region *ref; /**< Released once the task is done, or
+	                          *   NULL. */
+};
+
+/* a task being run by the calling thread; these are chained from the
+ * innermost out, since a thread waiting on a group runs tasks too */
+struct pool_frame {
+	struct pool_task *task; /**< The task. */
+	void *prev_entry; /**< The thread's dso_entry before the task. */
+	struct pool_frame *outer; /**< The task this one runs inside of, or
+	                           *   NULL. */
+};
+
+/* each end of the deque is on its own cache line, since thieves write the
+ * top and the owner the bottom */
+struct pool_worker {
+	int64_t top __attribute__((aligned(POOL_CACHE_LINE)));
+	int64_t bottom __attribute__((aligned(POOL_CACHE_LINE)));
+	struct pool_task *tasks[POOL_DEQUE_SIZE]; /**< The deque. */
+	int index; /**< The worker's number. */
+	pthread_t thread; /**< The worker's thread. */
+	bool dead; /**< Whether the thread exited on a fatal signal. */
+	uint64_t busy_ns; /**< Time spent running tasks. */
+	unsigned long ntasks; /**< Tasks run. */
+	unsigned long steals; /**< Tasks stolen from other workers. */
+};
+
+static struct pool_worker *pool_workers = NULL;
+
+/* number of workers whose thread exited on a fatal signal */
+static int pool_dead = 0;
+
+/* serializes replacing those threads */
+static pthread_mutex_t pool_revive_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int pool_nworkers = 0;
+
+static struct livec_ring *pool_inject = NULL;
+
+/* whoever holds this pops from pool_inject */
+static pthread_mutex_t pool_inject_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static sem_t pool_sem;
+
+/* number of workers asleep, or about to be */
+static int pool_sleepers = 0;
+
+/* when the utilization counters were last reset */
+static uint64_t pool_since = 0;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* the calling thread's worker, if it is one */
+static __thread struct pool_worker *pool_self = NULL;
+
+/* the innermost task the calling thread is running, or NULL */
+static __thread struct pool_frame *pool_frames = NULL;
+
+/* push a task onto the bottom of the calling worker's deque */
+static int pool_push(struct pool_worker *w, struct pool_task *task) {
+	int64_t b, t;
+
+	b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	if(b - t >= POOL_DEQUE_SIZE) {
+		return -1;
+	}
+	__atomic_store_n(&w->tasks[b & (POOL_DEQUE_SIZE - 1)], task,
+	                 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* pop a task off of the bottom of the calling worker's deque */
+static struct pool_task *pool_pop(struct pool_worker *w) {
+	int64_t b, t;
+	struct pool_task *task = NULL;
+
+	b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	if(t <= b) {
+		task = __atomic_load_n(&w->tasks[b & (POOL_DEQUE_SIZE - 1)],
+		                       __ATOMIC_RELAXED);
+		if(t == b) {
+			/* the last one; race the thieves for it */
+			if(!__atomic_compare_exchange_n(&w->top, &t, t + 1,
+			                                false, __ATOMIC_SEQ_CST,
+			                                __ATOMIC_RELAXED)) {
+				task = NULL;
+			}
+			__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+/* steal a task off of the top of another worker's deque */
+static struct pool_task *pool_steal(struct pool_worker *w) {
+	int64_t b, t;
+	struct pool_task *task;
+
+	t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if(t >= b) {
+		return NULL;
+	}
+	task = __atomic_load_n(&w->tasks[t & (POOL_DEQUE_SIZE - 1)],
+	                       __ATOMIC_RELAXED);
+	if(!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+	                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	return task;
+}
+
+/* find a task for the calling thread to run: its own, then one from
+ * outside the pool, then one stolen from another worker */
+static struct pool_task *pool_find(void) {
+	struct pool_task *task = NULL;
+	int i, start;
+
+	if(pool_self != NULL) {
+		task = pool_pop(pool_self);
+		if(task != NULL) {
+			return task;
+		}
+	}
+	if(pthread_mutex_trylock(&pool_inject_lock) == 0) {
+		if(livec_ring_pop(pool_inject, &task, 1) != 1) {
+			task = NULL;
+		}
+		pthread_mutex_unlock(&pool_inject_lock);
+		if(task != NULL) {
+			return task;
+		}
+	}
+	start = pool_self == NULL ? 0 : pool_self->index + 1;
+	for(i = 0; i < pool_nworkers; i++) {
+		struct pool_worker *victim;
+		victim = &pool_workers[(start + i) % pool_nworkers];
+		if(victim == pool_self) {
+			continue;
+		}
+		task = pool_steal(victim);
+		if(task != NULL) {
+			if(pool_self != NULL) {
+				pool_self->steals++;
+			}
+			return task;
+		}
+	}
+	return NULL;
+}
+
+/* count a task as done in its group, and free it */
+static void pool_task_done(struct pool_task *task, bool failed) {
+	struct livec_pool_group *group = task->group;
+	struct arcp_region *ref = task->ref;
+
+	arcp_release(task->entry);
+	afree(task, sizeof(struct pool_task));
+	if(group != NULL) {
+		if(failed) {
+			__atomic_add_fetch(&group->failed, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_sub_fetch(&group->pending, 1, __ATOMIC_RELEASE);
+	}
+	/* last, since the group may be part of what ref keeps */
+	arcp_release(ref);
+}
+
+/* run a task on behalf of the generation that spawned it, and free it */
+static void pool_run(struct pool_task *task) {
+	struct pool_frame frame;
+
+	frame.task = task;
+	frame.prev_entry = pthread_getspecific(entry_key);
+	frame.outer = pool_frames;
+	pthread_setspecific(entry_key, task->entry);
+	pool_frames = &frame;
+	task->fn(task->arg);
+	pool_frames = frame.outer;
+	pthread_setspecific(entry_key, frame.prev_entry);
+	pool_task_done(task, false);
+}
+
+/**
+ * Account for a fatal signal in the calling thread, which is about to exit:
+ * count every task it is running as failed, and mark it dead if it is a
+ * worker. Called from the fatal signal handler.
+ *
+ * @returns whether the thread was running a task.
+ */
+bool pool_crashed() {
+	struct pool_frame *frame;
+	void *entry = NULL;
+
+	if(pool_frames == NULL) {
+		return false;
+	}
+	for(frame = pool_frames; frame != NULL; frame = frame->outer) {
+		entry = frame->prev_entry;
+		pool_task_done(frame->task, true);
+	}
+	pool_frames = NULL;
+	/* the thread's own dso_entry, whose reference is released as the
+	 * thread exits */
+	pthread_setspecific(entry_key, entry);
+	if(pool_self != NULL) {
+		__atomic_store_n(&pool_self->dead, true, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&pool_dead, 1, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+/* the content of a worker thread */
+static void *thread_pool_worker(struct pool_worker *w) {
+	struct pool_task *task;
+	uint64_t start;
+	int idle = 0;
+
+	pool_self = w;
+	for(;;) {
+		task = pool_find();
+		if((task == NULL) && (++idle < POOL_SPIN)) {
+			sched_yield();
+			continue;
+		}
+		if(task == NULL) {
+			/* sleep until there's work; a task pushed before we
+			 * count as sleeping is found by looking once more,
+			 * and whoever pushes one after sees us and posts */
+			__atomic_add_fetch(&pool_sleepers, 1,
+			                   __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			task = pool_find();
+			if(task == NULL) {
+				while((sem_wait(&pool_sem) != 0)
+				      && (errno == EINTR));
+			}
+			__atomic_sub_fetch(&pool_sleepers, 1,
+			                   __ATOMIC_SEQ_CST);
+			if(task == NULL) {
+				continue;
+			}
+		}
+		start = event_clock();
+		pool_run(task);
+		__atomic_add_fetch(&w->busy_ns, event_clock() - start,
+		                   __ATOMIC_RELAXED);
+		__atomic_add_fetch(&w->ntasks, 1, __ATOMIC_RELAXED);
+		idle = 0;
+	}
+	return NULL;
+}
+
+/* start a worker's thread */
+static int pool_worker_start(struct pool_worker *w) {
+	int r;
+	r = pthread_create(&w->thread, NULL,
+	                   (void *(*)(void *)) thread_pool_worker, w);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create task pool worker")
+		        ": %s\n", strerror(r));
+		return -1;
+	}
+	pthread_detach(w->thread);
+	return 0;
+}
+
+/* replace the threads of workers that exited on a fatal signal */
+static void pool_revive(void) {
+	int i;
+
+	if(__atomic_load_n(&pool_dead, __ATOMIC_ACQUIRE) == 0) {
+		return;
+	}
+	pthread_mutex_lock(&pool_revive_lock);
+	for(i = 0; i < pool_nworkers; i++) {
+		if(!__atomic_load_n(&pool_workers[i].dead, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		if(pool_worker_start(&pool_workers[i]) != 0) {
+			break;
+		}
+		fprintf(stderr, PROCTEXT("Restarted task pool worker %d\n"), i);
+		__atomic_store_n(&pool_workers[i].dead, false,
+		                 __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&pool_dead, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pool_revive_lock);
+}
+
+/* start the workers; if they can't be started, tasks run in the thread that
+ * spawns them */
+static void pool_start(void) {
+	int i, n;
+	void *base;
+
+	n = livec_opts.pool_threads;
+	if(n <= 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if(n <= 0) {
+			n = 1;
+		}
+	}
+	pool_inject = ring_create(sizeof(struct pool_task *),
+	                          POOL_INJECT_SIZE, LIVEC_RING_MPSC);
+	if(pool_inject == NULL) {
+		perror(ERRORTEXT("Failed to create task pool ring"));
+		return;
+	}
+	if(sem_init(&pool_sem, 0, 0) != 0) {
+		perror(ERRORTEXT("Failed to initialize task pool semaphore"));
+		return;
+	}
+	/* the workers live as long as the process; allocate enough to align
+	 * them to a cache line */
+	base = amalloc(sizeof(struct pool_worker) * n + POOL_CACHE_LINE - 1);
+	if(base == NULL) {
+		perror(ERRORTEXT("Failed to allocate memory for task pool"));
+		return;
+	}
+	pool_workers = (struct pool_worker *)
+		(((uintptr_t) base + POOL_CACHE_LINE - 1)
+		 & ~(uintptr_t) (POOL_CACHE_LINE - 1));
+	memset(pool_workers, 0, sizeof(struct pool_worker) * n);
+	pool_since = event_clock();
+	for(i = 0; i < n; i++) {
+		pool_workers[i].index = i;
+		if(pool_worker_start(&pool_workers[i]) != 0) {
+			break;
+		}
+	}
+	__atomic_store_n(&pool_nworkers, i, __ATOMIC_RELEASE);
+}
+
+/* spawn a task, with a reference to release once it is done */
+static int pool_spawn(struct livec_pool_group *group, void (*fn)(void *),
+                      void *arg, struct arcp_region *ref) {
+	struct pool_task *task;
+	struct dso_entry *entry;
+
+	pthread_once(&pool_once, pool_start);
+	pool_revive();
+
+	task = amalloc(sizeof(struct pool_task));
+	if(task == NULL) {
+		return -1;
+	}
+	task->fn = fn;
+	task->arg = arg;
+	task->group = group;
+	task->ref = ref;
+	entry = (struct dso_entry *) pthread_getspecific(entry_key);
+	task->entry = entry == NULL ? NULL
+		: (struct dso_entry *) arcp_acquire(entry);
+	if(group != NULL) {
+		__atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+	}
+
+	if(pool_nworkers == 0) {
+		pool_run(task);
+		return 0;
+	}
+	if(pool_self != NULL) {
+		if(pool_push(pool_self, task) != 0) {
+			/* deque full; just run it */
+			pool_run(task);
+			return 0;
+		}
+	} else if(livec_ring_push(pool_inject, &task, 1) != 1) {
+		pool_run(task);
+		return 0;
+	}
+	/* the push must be seen before the sleepers are counted; see
+	 * thread_pool_worker() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&pool_sleepers, __ATOMIC_SEQ_CST) > 0) {
+		sem_post(&pool_sem);
+	}
+	return 0;
+}
+
+int livec_pool_spawn(struct livec_pool_group *group, void (*fn)(void *),
+                     void *arg) {
+	return pool_spawn(group, fn, arg, NULL);
+}
+
+int livec_pool_wait(struct livec_pool_group *group) {
+	struct pool_task *task;
+
+	while(__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) != 0) {
+		task = pool_nworkers == 0 ? NULL : pool_find();
+		if(task != NULL) {
+			pool_run(task);
+		} else {
+			sched_yield();
+		}
+	}
+	return __atomic_exchange_n(&group->failed, 0, __ATOMIC_RELAXED) == 0
+		? 0 : -1;
+}
+
+/* a parallel for loop; everyone running it takes the next grain of
+ * iterations until there are none left. The helpers each hold a reference,
+ * so that it outlasts the thread that started it, should that one die */
+struct pool_for {
+	struct arcp_region;
+	struct livec_pool_group group; /**< The helpers. */
+	size_t next; /**< The next iteration not yet taken. */
+	size_t end; /**< One past the last iteration. */
+	size_t grain; /**< Iterations taken at a time. */
+	void (*fn)(size_t, size_t, void *); /**< The body. */
+	void *arg; /**< The argument to fn. */
+};
+
+static void pool_for_run(struct pool_for *pf) {
+	size_t i;
+	while((i = __atomic_fetch_add(&pf->next, pf->grain, __ATOMIC_RELAXED))
+	      < pf->end) {
+		pf->fn(i, pf->end - i < pf->grain ? pf->end : i + pf->grain,
+		       pf->arg);
+	}
+}
+
+static void pool_for_destroy(struct pool_for *pf) {
+	afree(pf, sizeof(struct pool_for));
+}
+
+int livec_pool_parallel_for(size_t begin, size_t end, size_t grain,
+                            void (*fn)(size_t begin, size_t end, void *arg),
+                            void *arg) {
+	struct pool_for *pf;
+	size_t i, chunks;
+	int r = 0;
+
+	if(begin >= end) {
+		return 0;
+	}
+	pthread_once(&pool_once, pool_start);
+
+	pf = amalloc(sizeof(struct pool_for));
+	if(pf == NULL) {
+		return -1;
+	}
+	arcp_region_init(pf, (void (*)(struct arcp_region *)) pool_for_destroy);
+	pf->group.pending = 0;
+	pf->group.failed = 0;
+	pf->next = begin;
+	pf->end = end;
+	pf->grain = grain == 0 ? 1 : grain;
+	pf->fn = fn;
+	pf->arg = arg;
+
+	/* one helper per worker, or fewer if there isn't enough work */
+	chunks = (end - begin - 1) / pf->grain + 1;
+	for(i = 1; (i < chunks) && (i <= (size_t) pool_nworkers); i++) {
+		if(pool_spawn(&pf->group, (void (*)(void *)) pool_for_run, pf,
+		              arcp_acquire(pf)) != 0) {
+			arcp_release(pf);
+			r = -1;
+			break;
+		}
+	}
+	pool_for_run(pf);
+	if(livec_pool_wait(&pf->group) != 0) {
+		r = -1;
+	}
+	arcp_release(pf);
+	return r;
+}
+
+void livec_pool_report() {
+	int i, n;
+	uint64_t now, elapsed, busy;
+	unsigned long ntasks, steals;
+
+	n = __atomic_load_n(&pool_nworkers, __ATOMIC_ACQUIRE);
+	if(n == 0) {
+		return;
+	}
+	now = event_clock();
+	elapsed = now - pool_since;
+	pool_since = now;
+	fprintf(stderr, PROCTEXT("Task pool utilization over %llu ms:\n"),
+	        (unsigned long long) elapsed / 1000000);
+	for(i = 0; i < n; i++) {
+		busy = __atomic_exchange_n(&pool_workers[i].busy_ns, 0,
+		                           __ATOMIC_RELAXED);
+		ntasks = __atomic_exchange_n(&pool_workers[i].ntasks, 0,
+		                             __ATOMIC_RELAXED);
+		steals = __atomic_exchange_n(&pool_workers[i].steals, 0,
+		                             __ATOMIC_RELAXED);
+		fprintf(stderr, "  worker %-3d %5.1f%% busy, %lu tasks,"
+		        " %lu stolen\n", i,
+		        elapsed == 0 ? 0.0 : busy * 100.0 / elapsed, ntasks,
+		        steals);
+	}
+}
@@ -0,0 +1,215 @@
+/* preload.c Keep the libraries user code links against loaded
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <alloca.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+#include <atomickit/dict.h>
+#include <atomickit/string.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * Each generation is a fresh DSO, so without help its library dependencies
+ * would have their relocations processed again on every load, and would be
+ * unloaded along with the last generation using them, constructors and all.
+ * Instead, the libraries named by -l flags are opened once, the first time
+ * they show up, and never closed; loading a generation then finds them
+ * already resident.
+ */
+
+/* maximum number of -L or -l flags in one set of flags */
+#define PRELOAD_MAX 32
+
+/* a library we've tried to preload */
+struct preload {
+	struct arcp_region;
+	void *handle; /**< The library, or NULL if it couldn't be opened,
+	               *   as for a static-only library. */
+};
+
+/* preloaded libraries, by -l name; never shrinks */
+static arcp_t preload_table = ARCP_VAR_INIT(NULL);
+
+/* the library itself is never closed */
+static void preload_destroy(struct preload *p) {
+	afree(p, sizeof(struct preload));
+}
+
+static bool preload_known(char *name) {
+	int i, len;
+	bool found = false;
+	struct adict *table;
+
+	table = (struct adict *) arcp_load(&preload_table);
+	if(table == NULL) {
+		return false;
+	}
+	len = adict_len(table);
+	for(i = 0; i < len; i++) {
+		if(strcmp(astr_cstr(table->items[i].key), name) == 0) {
+			found = true;
+			break;
+		}
+	}
+	arcp_release(table);
+	return found;
+}
+
+/* open a library the way the linker would find it */
+static void *preload_open(char *name, char **dirs, int ndirs) {
+	int i;
+	char path[PATH_MAX];
+	void *handle;
+
+	for(i = 0; i < ndirs; i++) {
+		if(name[0] == ':') {
+			/* -l:filename */
+			snprintf(path, PATH_MAX, "%s/%s", dirs[i], name + 1);
+		} else {
+			snprintf(path, PATH_MAX, "%s/lib%s.so", dirs[i], name);
+		}
+		if(access(path, R_OK) == 0) {
+			handle = dlopen(path, RTLD_NOW|RTLD_NODELETE);
+			if(handle != NULL) {
+				fprintf(stderr, PROCTEXT("Preloaded %s\n"),
+				        path);
+				return handle;
+			}
+		}
+	}
+	if(name[0] == ':') {
+		snprintf(path, PATH_MAX, "%s", name + 1);
+	} else {
+		snprintf(path, PATH_MAX, "lib%s.so", name);
+	}
+	handle = dlopen(path, RTLD_NOW|RTLD_NODELETE);
+	if(handle != NULL) {
+		fprintf(stderr, PROCTEXT("Preloaded %s\n"), path);
+	}
+	return handle;
+}
+
+static void preload_add(char *name, char **dirs, int ndirs) {
+	struct preload *p;
+	struct adict *table;
+	struct adict *new_table;
+
+	if(preload_known(name)) {
+		return;
+	}
+	p = amalloc(sizeof(struct preload));
+	if(p == NULL) {
+		return;
+	}
+	arcp_region_init(p, (void (*)(struct arcp_region *)) preload_destroy);
+	p->handle = preload_open(name, dirs, ndirs);
+
+	do {
+		table = (struct adict *) arcp_load(&preload_table);
+		if(table == NULL) {
+			new_table = adict_create_cstrput(name, p);
+		} else {
+			new_table = adict_dup_cstrput(table, name, p);
+		}
+		if(new_table == NULL) {
+			/* we'll try again next time */
+			arcp_release(table);
+			arcp_release(p);
+			return;
+		}
+	} while(!arcp_cas_release(&preload_table, table, new_table));
+
+	/* the table holds it now */
+	arcp_release(p);
+}
+
+/* preload the libraries named in a set of flags */
+static void preload_flags(struct astr *sflags) {
+	char *flags;
+	char *token;
+	char *save;
+	char *dirs[PRELOAD_MAX];
+	char *names[PRELOAD_MAX];
+	int i, ndirs = 0, nnames = 0;
+	char **next = NULL;
+
+	/* -L directories apply to all the -l flags, wherever they are */
+	flags = alloca(astr_len(sflags) + 1);
+	strcpy(flags, astr_cstr(sflags));
+	for(token = strtok_r(flags, " \t\n", &save); token != NULL;
+	    token = strtok_r(NULL, " \t\n", &save)) {
+		if(next != NULL) {
+			/* "-L dir" or "-l name" */
+			if(next == dirs) {
+				dirs[ndirs++] = token;
+			} else {
+				names[nnames++] = token;
+			}
+			next = NULL;
+		} else if((strncmp(token, "-L", 2) == 0)
+		          && (ndirs < PRELOAD_MAX)) {
+			if(token[2] == '\0') {
+				next = dirs;
+			} else {
+				dirs[ndirs++] = token + 2;
+			}
+		} else if((strncmp(token, "-l", 2) == 0)
+		          && (nnames < PRELOAD_MAX)) {
+			if(token[2] == '\0') {
+				next = names;
+			} else {
+				names[nnames++] = token + 2;
+			}
+		}
+	}
+	for(i = 0; i < nnames; i++) {
+		preload_add(names[i], dirs, ndirs);
+	}
+}
+
+/**
+ * Open and keep open the libraries named by -l flags in the ldflags and
+ * cflags of a context, along with their dependencies, so that generations
+ * loaded afterwards share them.
+ */
+void preload_libraries(struct livec *lc) {
+	struct astr *sldflags;
+	struct astr *scflags;
+
+	sldflags = (struct astr *) arcp_load(&lc->opts->ldflags);
+	if(sldflags != NULL) {
+		preload_flags(sldflags);
+		arcp_release(sldflags);
+	}
+	scflags = (struct astr *) arcp_load(&lc->opts->cflags);
+	if(scflags != NULL) {
+		preload_flags(scflags);
+		arcp_release(scflags);
+	}
+}
@@ -0,0 +1,383 @@
+/* profile.c Per-autolink call counters and latency sampling
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * When profiling is enabled the DSOs are compiled with -finstrument-functions
+ * and every function entry and exit in them calls the hooks below. The hooks
+ * look the function up in a table of autolinked function addresses and, if
+ * found, count the call in a per-thread shard of that autolink's statistics.
+ * Every nth call in each thread is timed as well. Each thread keeps a stack
+ * of the counted calls it is in, so that an exit is matched to its entry
+ * without looking the function up again. The hooks take no lock; the shards
+ * are only ever added to, and summed up when read. A generation's addresses
+ * are dropped from the table before it is unloaded, so that they can't be
+ * mistaken for functions loaded at the same place later, and the table is
+ * rebuilt without them, so that a lookup of a function that isn't there
+ * still stops at the first empty slot. Calls that start while the table is
+ * being rebuilt go uncounted.
+ */
+
+/* number of shards per autolink; threads are spread over them */
+#define STATS_SHARDS 16
+
+/* number of slots in the address table; must be a power of two */
+#define PROFILE_TABLE_SIZE 4096
+
+/* depth of the per-thread stack of counted calls; calls nested deeper are
+ * counted but not timed */
+#define PROFILE_STACK_DEPTH 64
+
+#define CACHE_LINE 64
+
+struct stats_shard {
+	unsigned long long calls;
+	unsigned long long samples;
+	unsigned long long sample_ns;
+	unsigned long long histogram[AUTOLINK_STATS_BUCKETS];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct alink_stats {
+	struct stats_shard shards[STATS_SHARDS];
+};
+
+struct profile_slot {
+	void *fn;
+	struct alink_stats *stats;
+	unsigned long generation;
+};
+
+struct profile_sample {
+	struct alink_stats *stats;
+	unsigned int depth;
+	uint64_t start;
+};
+
+static struct profile_slot profile_table[PROFILE_TABLE_SIZE];
+
+/* the live slots, while the table is rebuilt */
+static struct profile_slot profile_scratch[PROFILE_TABLE_SIZE];
+
+/* odd while the table is being rebuilt; lookups that see it change miss */
+static unsigned long profile_seq = 0;
+
+/* keeps changes to the table to one thread at a time */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int next_shard = 0;
+
+static __thread int thread_shard = -1;
+static __thread unsigned int thread_calls = 0;
+static __thread unsigned int thread_depth = 0;
+static __thread void *thread_stack[PROFILE_STACK_DEPTH];
+static __thread unsigned int thread_nsamples = 0;
+static __thread struct profile_sample thread_samples[PROFILE_STACK_DEPTH];
+
+void __cyg_profile_func_enter(void *fn, void *site)
+	__attribute__((no_instrument_function));
+void __cyg_profile_func_exit(void *fn, void *site)
+	__attribute__((no_instrument_function));
+
+static inline size_t profile_hash(void *fn) {
+	uintptr_t h = (uintptr_t) fn;
+	h ^= h >> 17;
+	h *= 0xed5ad4bbU;
+	h ^= h >> 11;
+	return h & (PROFILE_TABLE_SIZE - 1);
+}
+
+static inline struct alink_stats *profile_lookup(void *fn) {
+	size_t i, n;
+	void *key;
+	unsigned long seq;
+	struct alink_stats *stats = NULL;
+
+	seq = __atomic_load_n(&profile_seq, __ATOMIC_ACQUIRE);
+	if(seq & 1) {
+		return NULL;
+	}
+	for(i = profile_hash(fn), n = 0; n < PROFILE_TABLE_SIZE;
+	    i = (i + 1) & (PROFILE_TABLE_SIZE - 1), n++) {
+		key = __atomic_load_n(&profile_table[i].fn, __ATOMIC_ACQUIRE);
+		if(key == fn) {
+			stats = __atomic_load_n(&profile_table[i].stats,
+			                        __ATOMIC_RELAXED);
+			break;
+		}
+		if(key == NULL) {
+			break;
+		}
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&profile_seq, __ATOMIC_RELAXED) != seq) {
+		return NULL;
+	}
+	return stats;
+}
+
+static inline uint64_t profile_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline struct stats_shard *profile_shard(struct alink_stats *stats) {
+	if(thread_shard < 0) {
+		thread_shard = __atomic_fetch_add(&next_shard, 1,
+		                                  __ATOMIC_RELAXED)
+			% STATS_SHARDS;
+	}
+	return &stats->shards[thread_shard];
+}
+
+void __cyg_profile_func_enter(void *fn,
+                              void *site __attribute__((unused))) {
+	struct alink_stats *stats;
+	struct stats_shard *shard;
+	stats = profile_lookup(fn);
+	if(stats == NULL) {
+		return;
+	}
+	shard = profile_shard(stats);
+	__atomic_add_fetch(&shard->calls, 1, __ATOMIC_RELAXED);
+	if(thread_depth == PROFILE_STACK_DEPTH) {
+		return;
+	}
+	thread_stack[thread_depth++] = fn;
+	if((++thread_calls % livec_opts.profile == 0)
+	   && (thread_nsamples < PROFILE_STACK_DEPTH)) {
+		struct profile_sample *sample;
+		sample = &thread_samples[thread_nsamples++];
+		sample->stats = stats;
+		sample->depth = thread_depth;
+		sample->start = profile_now();
+	}
+}
+
+void __cyg_profile_func_exit(void *fn, void *site __attribute__((unused))) {
+	struct profile_sample *sample;
+	struct stats_shard *shard;
+	uint64_t ns;
+	int bucket;
+	/* only calls counted on entry are on the stack, even if their
+	 * function has been forgotten since */
+	if((thread_depth == 0) || (thread_stack[thread_depth - 1] != fn)) {
+		return;
+	}
+	if(thread_nsamples > 0) {
+		sample = &thread_samples[thread_nsamples - 1];
+		if(sample->depth == thread_depth) {
+			ns = profile_now() - sample->start;
+			bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+			if(bucket >= AUTOLINK_STATS_BUCKETS) {
+				bucket = AUTOLINK_STATS_BUCKETS - 1;
+			}
+			shard = profile_shard(sample->stats);
+			__atomic_add_fetch(&shard->samples, 1,
+			                   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&shard->sample_ns, ns,
+			                   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&shard->histogram[bucket], 1,
+			                   __ATOMIC_RELAXED);
+			thread_nsamples--;
+		}
+	}
+	thread_depth--;
+}
+
+/**
+ * Allocate a zeroed statistics block. Statistics blocks are never freed, since
+ * an instrumented function may still be running in some thread long after its
+ * autolink is gone.
+ */
+struct alink_stats *alink_stats_create(void) {
+	void *base;
+	struct alink_stats *stats;
+	base = amalloc(sizeof(struct alink_stats) + CACHE_LINE - 1);
+	if(base == NULL) {
+		return NULL;
+	}
+	stats = (struct alink_stats *) (((uintptr_t) base + CACHE_LINE - 1)
+	                                & ~(uintptr_t) (CACHE_LINE - 1));
+	memset(stats, 0, sizeof(struct alink_stats));
+	return stats;
+}
+
+/* put fn in the first empty slot of its run; profile_lock must be held */
+static int profile_insert(void *fn, struct alink_stats *stats,
+                          unsigned long generation) {
+	size_t i, n;
+	for(i = profile_hash(fn), n = 0; n < PROFILE_TABLE_SIZE;
+	    i = (i + 1) & (PROFILE_TABLE_SIZE - 1), n++) {
+		if(profile_table[i].fn != NULL) {
+			continue;
+		}
+		/* fill in the slot before lookups can find fn in it */
+		__atomic_store_n(&profile_table[i].stats, stats,
+		                 __ATOMIC_RELAXED);
+		profile_table[i].generation = generation;
+		__atomic_store_n(&profile_table[i].fn, fn, __ATOMIC_RELEASE);
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * Attribute calls to the function at fn, in the given generation, to the
+ * given statistics block.
+ */
+void profile_register(void *fn, struct alink_stats *stats,
+                      struct dso_entry *entry) {
+	size_t i, n;
+	void *key;
+
+	pthread_mutex_lock(&profile_lock);
+	for(i = profile_hash(fn), n = 0; n < PROFILE_TABLE_SIZE;
+	    i = (i + 1) & (PROFILE_TABLE_SIZE - 1), n++) {
+		key = profile_table[i].fn;
+		if(key == fn) {
+			/* relinked to the same generation */
+			__atomic_store_n(&profile_table[i].stats, stats,
+			                 __ATOMIC_RELAXED);
+			goto out;
+		}
+		if(key == NULL) {
+			break;
+		}
+	}
+	if(profile_insert(fn, stats, entry->generation) != 0) {
+		fprintf(stderr, ERRORTEXT("Profile table full; not counting"
+		                          " calls to %p\n"), fn);
+	}
+out:
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/**
+ * Stop attributing calls to the functions of a generation that is about to
+ * be unloaded.
+ */
+void profile_forget(struct dso_entry *entry) {
+	size_t i, n;
+	bool found = false;
+
+	pthread_mutex_lock(&profile_lock);
+	n = 0;
+	for(i = 0; i < PROFILE_TABLE_SIZE; i++) {
+		if(profile_table[i].fn == NULL) {
+			continue;
+		}
+		if(profile_table[i].generation == entry->generation) {
+			found = true;
+		} else {
+			profile_scratch[n++] = profile_table[i];
+		}
+	}
+	if(!found) {
+		goto out;
+	}
+
+	/* rebuild the table from what is left, rather than leave holes that
+	 * lookups would have to go on past */
+	__atomic_store_n(&profile_seq, profile_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for(i = 0; i < PROFILE_TABLE_SIZE; i++) {
+		__atomic_store_n(&profile_table[i].fn, NULL, __ATOMIC_RELAXED);
+	}
+	for(i = 0; i < n; i++) {
+		profile_insert(profile_scratch[i].fn, profile_scratch[i].stats,
+		               profile_scratch[i].generation);
+	}
+	__atomic_store_n(&profile_seq, profile_seq + 1, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/**
+ * Sum up the shards of a statistics block.
+ */
+void alink_stats_read(struct alink_stats *stats, struct autolink_stats *out) {
+	int i, j;
+	struct stats_shard *shard;
+	memset(out, 0, sizeof(struct autolink_stats));
+	for(i = 0; i < STATS_SHARDS; i++) {
+		shard = &stats->shards[i];
+		out->calls += __atomic_load_n(&shard->calls, __ATOMIC_RELAXED);
+		out->samples += __atomic_load_n(&shard->samples,
+		                                __ATOMIC_RELAXED);
+		out->sample_ns += __atomic_load_n(&shard->sample_ns,
+		                                  __ATOMIC_RELAXED);
+		for(j = 0; j < AUTOLINK_STATS_BUCKETS; j++) {
+			out->histogram[j] += __atomic_load_n(
+				&shard->histogram[j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+ * Zero a statistics block. Calls made while resetting may or may not be
+ * counted.
+ */
+void alink_stats_reset(struct alink_stats *stats) {
+	int i, j;
+	struct stats_shard *shard;
+	for(i = 0; i < STATS_SHARDS; i++) {
+		shard = &stats->shards[i];
+		__atomic_store_n(&shard->calls, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&shard->samples, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&shard->sample_ns, 0, __ATOMIC_RELAXED);
+		for(j = 0; j < AUTOLINK_STATS_BUCKETS; j++) {
+			__atomic_store_n(&shard->histogram[j], 0,
+			                 __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+ * Estimate a percentile, in ns, from the histogram of a statistics summary.
+ * Returns the upper bound of the bucket the percentile falls in.
+ */
+unsigned long long autolink_stats_percentile(struct autolink_stats *stats,
+                                             double p) {
+	int i;
+	unsigned long long seen, want;
+	if(stats->samples == 0) {
+		return 0;
+	}
+	want = (unsigned long long) (stats->samples * p);
+	seen = 0;
+	for(i = 0; i < AUTOLINK_STATS_BUCKETS - 1; i++) {
+		seen += stats->histogram[i];
+		if(seen > want) {
+			break;
+		}
+	}
+	return 2ULL << i;
+}
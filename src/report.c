@@ -0,0 +1,327 @@
+/* report.c Per-reload code size and disassembly reports
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+#include <atomickit/dict.h>
+#include <atomickit/string.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * For each new generation, a background thread disassembles the entry and
+ * the autolinked functions with objdump, writes the disassembly of each,
+ * without addresses, to <dir>/gen<n>.<function>.s, and writes a report to
+ * <dir>/gen<n>.txt comparing them against the previous generation: the size,
+ * number of instructions, and number of vector instructions of each function,
+ * followed by a side-by-side diff of the disassembly. The thread holds a
+ * reference to both generations, so their DSO files stay around until it is
+ * done.
+ */
+
+struct report_job {
+	struct dso_entry *prev; /**< The previous generation, or NULL. */
+	struct dso_entry *entry; /**< The new generation. */
+	struct astr *dir; /**< The report directory. */
+};
+
+/* what we find out about a function in one generation */
+struct fn_info {
+	bool found; /**< Whether the function exists. */
+	size_t size; /**< Size in bytes. */
+	unsigned int insns; /**< Number of instructions. */
+	unsigned int vector; /**< Number of vector instructions. */
+};
+
+/* whether an instruction, as printed by objdump, works on vectors */
+static bool insn_is_vector(char *insn) {
+	size_t len;
+	char *mnemonic_end;
+	if((strstr(insn, "%ymm") != NULL) || (strstr(insn, "%zmm") != NULL)) {
+		return true;
+	}
+	if(strstr(insn, "%xmm") == NULL) {
+		return false;
+	}
+	/* xmm registers are used for scalar floating point too; only
+	 * count packed operations */
+	mnemonic_end = strpbrk(insn, " \t");
+	len = mnemonic_end == NULL ? strlen(insn) : (size_t) (mnemonic_end
+	                                                      - insn);
+	if((len > 2) && ((strncmp(insn + len - 2, "ps", 2) == 0)
+	                 || (strncmp(insn + len - 2, "pd", 2) == 0))) {
+		return true;
+	}
+	return (insn[0] == 'p') || ((insn[0] == 'v') && (insn[1] == 'p'));
+}
+
+/* the file a function's disassembly goes in */
+static char *report_asm_file(struct astr *dir, unsigned long generation,
+                             char *fname) {
+	char *path;
+	if(asprintf(&path, "%s/gen%lu.%s.s", astr_cstr(dir), generation,
+	            fname) < 0) {
+		return NULL;
+	}
+	return path;
+}
+
+/* disassemble a function of a generation into its report file, and find out
+ * what we want to know about it */
+static void report_function(struct report_job *job, struct dso_entry *entry,
+                            char *fname, struct fn_info *info) {
+	char *cmd;
+	char *path;
+	FILE *objdump;
+	FILE *out;
+	char *line = NULL;
+	size_t linecap = 0;
+	char *insn;
+	void *fptr;
+	Dl_info dlinfo;
+	ElfW(Sym) *sym;
+
+	memset(info, 0, sizeof(struct fn_info));
+	fptr = dlsym(entry->dlhandle, fname);
+	if(fptr == NULL) {
+		return;
+	}
+	info->found = true;
+	if((dladdr1(fptr, &dlinfo, (void **) &sym, RTLD_DL_SYMENT) != 0)
+	   && (sym != NULL)) {
+		info->size = sym->st_size;
+	}
+
+	path = report_asm_file(job->dir, entry->generation, fname);
+	if(path == NULL) {
+		return;
+	}
+	if(strchr(entry->dsofile, '\'') != NULL) {
+		/* won't quote that for the shell */
+		goto out0;
+	}
+	if(asprintf(&cmd, "objdump -d --no-show-raw-insn --disassemble=%s"
+	            " '%s'", fname, entry->dsofile) < 0) {
+		goto out0;
+	}
+	objdump = popen(cmd, "re");
+	free(cmd);
+	if(objdump == NULL) {
+		goto out0;
+	}
+	out = fopen(path, "we");
+	if(out == NULL) {
+		fprintf(stderr, ERRORTEXT("Failed to create %s") ": %s\n",
+		        path, strerror(errno));
+		pclose(objdump);
+		goto out0;
+	}
+	/* instruction lines look like "    1139:\tmov    %edi,%eax" */
+	while(getline(&line, &linecap, objdump) > 0) {
+		insn = strstr(line, ":\t");
+		if((insn == NULL) || (line[0] != ' ')) {
+			continue;
+		}
+		insn += 2;
+		info->insns++;
+		if(insn_is_vector(insn)) {
+			info->vector++;
+		}
+		fputs(insn, out);
+	}
+	free(line);
+	fclose(out);
+	if(pclose(objdump) != 0) {
+		fprintf(stderr, ERRORTEXT("objdump of '%s' in %s failed\n"),
+		        fname, entry->dsofile);
+	}
+out0:
+	free(path);
+}
+
+/* append a side-by-side diff of a function's disassembly in the two
+ * generations to the report */
+static void report_diff(struct report_job *job, char *fname, FILE *report) {
+	char *oldpath, *newpath;
+	char *cmd;
+	FILE *diff;
+	char buf[4096];
+	size_t len;
+
+	oldpath = report_asm_file(job->dir, job->prev->generation, fname);
+	newpath = report_asm_file(job->dir, job->entry->generation, fname);
+	if((oldpath == NULL) || (newpath == NULL)
+	   || (strchr(astr_cstr(job->dir), '\'') != NULL)) {
+		goto out;
+	}
+	if(asprintf(&cmd, "diff -y -W 160 '%s' '%s'", oldpath, newpath) < 0) {
+		goto out;
+	}
+	diff = popen(cmd, "re");
+	free(cmd);
+	if(diff == NULL) {
+		goto out;
+	}
+	fprintf(report, "\n--- %s ---\n", fname);
+	while((len = fread(buf, 1, sizeof(buf), diff)) > 0) {
+		fwrite(buf, 1, len, report);
+	}
+	pclose(diff);
+out:
+	free(oldpath);
+	free(newpath);
+}
+
+/* report on one function; the first call for a report is for the entry */
+static void report_line(struct report_job *job, char *fname, FILE *report) {
+	struct fn_info old, new;
+
+	memset(&old, 0, sizeof(struct fn_info));
+	if(job->prev != NULL) {
+		report_function(job, job->prev, fname, &old);
+	}
+	report_function(job, job->entry, fname, &new);
+	if(!new.found) {
+		fprintf(report, "%-24s (missing)\n", fname);
+		return;
+	}
+	fprintf(report, "%-24s %8zu %+8ld %8u %8u%s\n", fname, new.size,
+	        old.found ? (long) new.size - (long) old.size : 0L,
+	        new.insns, new.vector,
+	        old.found && (old.vector != 0) && (new.vector == 0)
+	        ? "  (no longer vectorized)" : "");
+}
+
+/* the content of a report thread */
+static void *thread_report(struct report_job *job) {
+	char *path;
+	FILE *report;
+	struct adict *names;
+	struct astr *entry_f;
+	int i, len;
+
+	if(asprintf(&path, "%s/gen%lu.txt", astr_cstr(job->dir),
+	            job->entry->generation) < 0) {
+		goto out0;
+	}
+	report = fopen(path, "we");
+	if(report == NULL) {
+		fprintf(stderr, ERRORTEXT("Failed to create report %s")
+		        ": %s\n", path, strerror(errno));
+		goto out1;
+	}
+
+	entry_f = (struct astr *) arcp_load(&job->entry->livec->opts->entry);
+	names = autolink_names(job->entry->livec);
+	len = names == NULL ? 0 : adict_len(names);
+
+	if(job->prev != NULL) {
+		fprintf(report, "generation %lu, compared to generation %lu\n\n",
+		        job->entry->generation, job->prev->generation);
+	} else {
+		fprintf(report, "generation %lu\n\n", job->entry->generation);
+	}
+	fprintf(report, "%-24s %8s %8s %8s %8s\n",
+	        "function", "bytes", "delta", "insns", "vector");
+	report_line(job, astr_cstr(entry_f), report);
+	for(i = 0; i < len; i++) {
+		report_line(job, astr_cstr(names->items[i].key), report);
+	}
+	if(job->prev != NULL) {
+		report_diff(job, astr_cstr(entry_f), report);
+		for(i = 0; i < len; i++) {
+			report_diff(job, astr_cstr(names->items[i].key),
+			            report);
+		}
+	}
+
+	if(fclose(report) != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to write report %s")
+		        ": %s\n", path, strerror(errno));
+	} else {
+		fprintf(stderr, PROCTEXT("Code report for generation %lu"
+		                         " written to %s\n"),
+		        job->entry->generation, path);
+	}
+	arcp_release(names);
+	arcp_release(entry_f);
+out1:
+	free(path);
+out0:
+	arcp_release(job->prev);
+	arcp_release(job->entry);
+	arcp_release(job->dir);
+	afree(job, sizeof(struct report_job));
+	return NULL;
+}
+
+/**
+ * Start writing a code report for a newly loaded generation, compared to the
+ * current one, if a report directory was configured. Does not wait for the
+ * report to be written.
+ */
+void report_reload(struct dso_entry *entry) {
+	int r;
+	pthread_t thread;
+	pthread_attr_t attr;
+	struct report_job *job;
+	struct astr *dir;
+
+	dir = (struct astr *) arcp_load(&entry->livec->opts->report_dir);
+	if(dir == NULL) {
+		return;
+	}
+	job = amalloc(sizeof(struct report_job));
+	if(job == NULL) {
+		perror(ERRORTEXT("Failed to allocate memory for code report"));
+		arcp_release(dir);
+		return;
+	}
+	job->dir = dir;
+	job->prev = (struct dso_entry *) arcp_load(
+		&entry->livec->current_entry);
+	job->entry = (struct dso_entry *) arcp_acquire(entry);
+
+	r = pthread_attr_init(&attr);
+	if(r == 0) {
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		r = pthread_create(&thread, &attr,
+		                   (void *(*)(void *)) thread_report, job);
+		pthread_attr_destroy(&attr);
+	}
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create report thread")
+		        ": %s\n", strerror(r));
+		arcp_release(job->prev);
+		arcp_release(job->entry);
+		arcp_release(job->dir);
+		afree(job, sizeof(struct report_job));
+	}
+}
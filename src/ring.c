@@ -0,0 +1,333 @@
+/* ring.c Lock-free ring buffers shared between generations
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+#include <atomickit/dict.h>
+#include <atomickit/string.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * Both kinds of ring have a power of two number of slots, and free-running
+ * head and tail counters, each on its own cache line. The consumer owns head.
+ * In an SPSC ring the producer owns tail and publishes elements by advancing
+ * it. In an MPSC ring producers claim slots by advancing tail with a CAS, and
+ * publish each element by setting the slot's sequence number to its position
+ * plus one; the consumer only takes elements in order as their sequence
+ * numbers show up.
+ */
+
+#define CACHE_LINE 64
+
+struct livec_ring {
+	struct arcp_region;
+	int type; /**< LIVEC_RING_SPSC or LIVEC_RING_MPSC. */
+	size_t elemsize; /**< Size of each element. */
+	size_t mask; /**< Number of slots minus one. */
+	size_t *seq; /**< Slot sequence numbers, for an MPSC ring. */
+	uint8_t *data; /**< The slots. */
+	void *base; /**< The allocation the ring lies in. */
+	void *data_base; /**< The allocation the slots lie in. */
+	size_t head __attribute__((aligned(CACHE_LINE)));
+	size_t tail __attribute__((aligned(CACHE_LINE)));
+	char pad[CACHE_LINE - sizeof(size_t)];
+};
+
+static arcp_t ring_table = ARCP_VAR_INIT(NULL);
+
+/* allocate size bytes aligned to a cache line; base gets the allocation to
+ * free with ring_free() */
+static void *ring_alloc(size_t size, void **base) {
+	*base = amalloc(size + CACHE_LINE - 1);
+	if(*base == NULL) {
+		return NULL;
+	}
+	return (void *) (((uintptr_t) *base + CACHE_LINE - 1)
+	                 & ~(uintptr_t) (CACHE_LINE - 1));
+}
+
+static void ring_free(void *base, size_t size) {
+	afree(base, size + CACHE_LINE - 1);
+}
+
+static void ring_destroy(struct livec_ring *ring) {
+	size_t nslots = ring->mask + 1;
+	if(ring->seq != NULL) {
+		afree(ring->seq, sizeof(size_t) * nslots);
+	}
+	ring_free(ring->data_base, ring->elemsize * nslots);
+	ring_free(ring->base, sizeof(struct livec_ring));
+}
+
+/**
+ * Create a ring that isn't registered under any name.
+ *
+ * @param elemsize the size of each element.
+ * @param nelem the minimum number of elements; rounded up to a power of two.
+ * @param type LIVEC_RING_SPSC or LIVEC_RING_MPSC.
+ * @returns the new ring, or NULL on error.
+ */
+struct livec_ring *ring_create(size_t elemsize, size_t nelem, int type) {
+	struct livec_ring *ring;
+	size_t nslots;
+	void *base;
+
+	if((elemsize == 0) || (nelem == 0)
+	   || ((type != LIVEC_RING_SPSC) && (type != LIVEC_RING_MPSC))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	for(nslots = 1; nslots < nelem; nslots <<= 1);
+
+	/* head and tail each need a cache line of their own */
+	ring = ring_alloc(sizeof(struct livec_ring), &base);
+	if(ring == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(ring, 0, sizeof(struct livec_ring));
+	ring->base = base;
+	ring->data = ring_alloc(elemsize * nslots, &ring->data_base);
+	if(ring->data == NULL) {
+		ring_free(base, sizeof(struct livec_ring));
+		errno = ENOMEM;
+		return NULL;
+	}
+	if(type == LIVEC_RING_MPSC) {
+		ring->seq = amalloc(sizeof(size_t) * nslots);
+		if(ring->seq == NULL) {
+			ring_free(ring->data_base, elemsize * nslots);
+			ring_free(base, sizeof(struct livec_ring));
+			errno = ENOMEM;
+			return NULL;
+		}
+		memset(ring->seq, 0, sizeof(size_t) * nslots);
+	}
+	arcp_region_init(ring, (void (*)(struct arcp_region *)) ring_destroy);
+	ring->type = type;
+	ring->elemsize = elemsize;
+	ring->mask = nslots - 1;
+	return ring;
+}
+
+/* find the ring of the given name in the table, or NULL */
+static struct livec_ring *ring_find(struct adict *table, char *name) {
+	int i, len;
+	if(table == NULL) {
+		return NULL;
+	}
+	len = adict_len(table);
+	for(i = 0; i < len; i++) {
+		if(strcmp(astr_cstr(table->items[i].key), name) == 0) {
+			return (struct livec_ring *) table->items[i].value;
+		}
+	}
+	return NULL;
+}
+
+struct livec_ring *livec_ring_open(char *name, size_t elemsize, size_t nelem,
+                                   int type) {
+	struct adict *table;
+	struct adict *new_table;
+	struct livec_ring *ring;
+	struct livec_ring *new_ring = NULL;
+
+	for(;;) {
+		table = (struct adict *) arcp_load(&ring_table);
+		ring = ring_find(table, name);
+		if(ring != NULL) {
+			/* reattach to the existing ring */
+			arcp_release(new_ring);
+			if((ring->type != type) || (ring->elemsize != elemsize)
+			   || (ring->mask + 1 < nelem)) {
+				arcp_release(table);
+				errno = EINVAL;
+				return NULL;
+			}
+			ring = (struct livec_ring *) arcp_acquire(ring);
+			arcp_release(table);
+			return ring;
+		}
+		if(new_ring == NULL) {
+			new_ring = ring_create(elemsize, nelem, type);
+			if(new_ring == NULL) {
+				arcp_release(table);
+				return NULL;
+			}
+		}
+		if(table == NULL) {
+			new_table = adict_create_cstrput(name, new_ring);
+		} else {
+			new_table = adict_dup_cstrput(table, name, new_ring);
+		}
+		if(new_table == NULL) {
+			arcp_release(table);
+			arcp_release(new_ring);
+			return NULL;
+		}
+		if(arcp_cas_release(&ring_table, table, new_table)) {
+			/* the table holds one reference, the caller the
+			 * other */
+			return new_ring;
+		}
+	}
+}
+
+void livec_ring_close(struct livec_ring *ring) {
+	arcp_release(ring);
+}
+
+int livec_ring_unlink(char *name) {
+	struct adict *table;
+	struct adict *new_table;
+
+	do {
+		table = (struct adict *) arcp_load(&ring_table);
+		if(ring_find(table, name) == NULL) {
+			arcp_release(table);
+			errno = EINVAL;
+			return -1;
+		}
+		new_table = adict_dup_cstrdel(table, name);
+		if(new_table == NULL) {
+			arcp_release(table);
+			return -1;
+		}
+	} while(!arcp_cas_release(&ring_table, table, new_table));
+	return 0;
+}
+
+/* copy n elements into the ring starting at position pos */
+static void ring_copy_in(struct livec_ring *ring, size_t pos,
+                         const uint8_t *elems, size_t n) {
+	size_t i, first;
+	i = pos & ring->mask;
+	first = ring->mask + 1 - i;
+	if(first > n) {
+		first = n;
+	}
+	memcpy(ring->data + i * ring->elemsize, elems,
+	       first * ring->elemsize);
+	memcpy(ring->data, elems + first * ring->elemsize,
+	       (n - first) * ring->elemsize);
+}
+
+/* copy n elements out of the ring starting at position pos */
+static void ring_copy_out(struct livec_ring *ring, size_t pos,
+                          uint8_t *elems, size_t n) {
+	size_t i, first;
+	i = pos & ring->mask;
+	first = ring->mask + 1 - i;
+	if(first > n) {
+		first = n;
+	}
+	memcpy(elems, ring->data + i * ring->elemsize,
+	       first * ring->elemsize);
+	memcpy(elems + first * ring->elemsize, ring->data,
+	       (n - first) * ring->elemsize);
+}
+
+static size_t spsc_push(struct livec_ring *ring, const uint8_t *elems,
+                        size_t n) {
+	size_t head, tail, space;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	space = ring->mask + 1 - (tail - head);
+	if(n > space) {
+		n = space;
+	}
+	ring_copy_in(ring, tail, elems, n);
+	__atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+static size_t spsc_pop(struct livec_ring *ring, uint8_t *elems, size_t n) {
+	size_t head, tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if(n > tail - head) {
+		n = tail - head;
+	}
+	ring_copy_out(ring, head, elems, n);
+	__atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+static size_t mpsc_push(struct livec_ring *ring, const uint8_t *elems,
+                        size_t n) {
+	size_t head, tail, space, i;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	do {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		space = ring->mask + 1 - (tail - head);
+		if(space == 0) {
+			return 0;
+		}
+		if(n > space) {
+			n = space;
+		}
+	} while(!__atomic_compare_exchange_n(&ring->tail, &tail, tail + n,
+	                                     true, __ATOMIC_RELAXED,
+	                                     __ATOMIC_RELAXED));
+	/* the slots from tail to tail + n are ours */
+	ring_copy_in(ring, tail, elems, n);
+	for(i = 0; i < n; i++) {
+		__atomic_store_n(&ring->seq[(tail + i) & ring->mask],
+		                 tail + i + 1, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+static size_t mpsc_pop(struct livec_ring *ring, uint8_t *elems, size_t n) {
+	size_t head, i;
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	for(i = 0; i < n; i++) {
+		if(__atomic_load_n(&ring->seq[(head + i) & ring->mask],
+		                   __ATOMIC_ACQUIRE) != head + i + 1) {
+			/* not (yet) published */
+			break;
+		}
+	}
+	ring_copy_out(ring, head, elems, i);
+	__atomic_store_n(&ring->head, head + i, __ATOMIC_RELEASE);
+	return i;
+}
+
+size_t livec_ring_push(struct livec_ring *ring, const void *elems, size_t n) {
+	if(ring->type == LIVEC_RING_SPSC) {
+		return spsc_push(ring, elems, n);
+	} else {
+		return mpsc_push(ring, elems, n);
+	}
+}
+
+size_t livec_ring_pop(struct livec_ring *ring, void *elems, size_t n) {
+	if(ring->type == LIVEC_RING_SPSC) {
+		return spsc_pop(ring, elems, n);
+	} else {
+		return mpsc_pop(ring, elems, n);
+	}
+}
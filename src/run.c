@@ -16,11 +16,20 @@
  * You should have received a copy of the GNU General Public License
  * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
 #include <atomickit/rcp.h>
 
 #include "livec.h"
@@ -32,14 +41,46 @@ pthread_key_t entry_key;
 /* generic state structure */
 arcp_t state = ARCP_VAR_INIT(NULL);
 
+/* the thread main() runs in */
+pthread_t main_thread __attribute__((visibility("hidden")));
+
 /* the args from the commandline to be passed into the function */
-struct argstruct args __attribute__((visibility("hidden"))) = { 0, NULL };
+static char *no_argv[] = { NULL };
+
+/* the arguments to the entry function; an embedded context's get none */
+struct argstruct args __attribute__((visibility("hidden"))) = { 0, no_argv };
+
+/* the last-known-good dso_entry, which we roll back to on a crash */
+static arcp_t good_entry = ARCP_VAR_INIT(NULL);
+
+/* the known-good dso_entry before good_entry, which we fall back to if
+ * good_entry itself crashes */
+static arcp_t prev_good_entry = ARCP_VAR_INIT(NULL);
+
+/* the dso_entry of the run thread that most recently crashed; only ever
+ * compared against, never dereferenced */
+static struct dso_entry *crashed_entry = NULL;
+
+/* the pipe on which the control thread receives its commands */
+static int control_pipe[2] = { -1, -1 };
+
+/* whether this thread was started by run() */
+static __thread bool run_thread = false;
+
+/* count a run thread as finished, however it ends */
+static void run_exit(struct dso_entry *entry) {
+	__atomic_sub_fetch(&entry->threads, 1, __ATOMIC_RELEASE);
+}
 
 /* this function is the content of the thread */
 static void *thread_run(struct dso_entry *entry) {
 	int r;
+	run_thread = true;
 	pthread_setspecific(entry_key, entry);
+	pthread_cleanup_push((void (*)(void *)) run_exit, entry);
 	r = entry->proc(args.argc, args.argv);
+	pthread_cleanup_pop(1);
+	event_log(EVENT_EXIT, entry->generation, r, 0, NULL);
 	if(r != 0) {
 		fprintf(stderr, ERRORTEXT("Thread exited with error code %d\n"), r);
 	} else {
@@ -48,37 +89,38 @@ static void *thread_run(struct dso_entry *entry) {
 	return NULL;
 }
 
-/* run the given dso_entry in a separate thread */
-void run(struct dso_entry *entry) {
+/* run the given dso_entry in a separate thread, which takes over the
+ * reference; returns -1 if the thread could not be started */
+int run(struct dso_entry *entry) {
 	int r;
 	pthread_attr_t attr;
 	pthread_t thread;
 
 	r = pthread_attr_init(&attr);
 	if(r != 0) {
-		fprintf(stderr, ERRORTEXT("Fatal: Failed to initialize new"
+		fprintf(stderr, ERRORTEXT("Failed to initialize new"
 		                          " thread attributes") ": %s\n",
 		        strerror(r));
 		arcp_release(entry);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 	r = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 	if(r != 0) {
-		fprintf(stderr, ERRORTEXT("Fatal: Failed to set detached"
+		fprintf(stderr, ERRORTEXT("Failed to set detached"
 		                          " thread attribute") ": %s\n",
 		        strerror(r));
-		arcp_release(entry);
-		exit(EXIT_FAILURE);
+		goto error;
 	}
 
+	__atomic_add_fetch(&entry->threads, 1, __ATOMIC_ACQUIRE);
 	r = pthread_create(&thread, &attr,
 	                   (void *(*)(void *)) thread_run, entry);
 	if(r != 0) {
-		fprintf(stderr, ERRORTEXT("Fatal: Failed to create new"
+		fprintf(stderr, ERRORTEXT("Failed to create new"
 		                          " thread") ": %s\n",
 		        strerror(r));
-		arcp_release(entry);
-		exit(EXIT_FAILURE);
+		run_exit(entry);
+		goto error;
 	}
 
 	r = pthread_attr_destroy(&attr);
@@ -87,6 +129,100 @@ void run(struct dso_entry *entry) {
 		                          " attributes") ": %s\n",
 		        strerror(r));
 	}
+	return 0;
+
+error:
+	pthread_attr_destroy(&attr);
+	arcp_release(entry);
+	return -1;
+}
+
+struct sync_call {
+	struct dso_entry *entry;
+	void (*fn)(void *);
+	void *arg;
+};
+
+/* the content of a thread started by run_sync */
+static void *thread_run_sync(struct sync_call *call) {
+	pthread_setspecific(entry_key, arcp_acquire(call->entry));
+	call->fn(call->arg);
+	pthread_setspecific(entry_key, NULL);
+	arcp_release(call->entry);
+	/* anything but NULL, which is what a thread killed by a fatal signal
+	 * returns */
+	return call;
+}
+
+/**
+ * Run fn(arg) to completion in a separate thread on behalf of the given
+ * dso_entry, optionally pinned to a single cpu.
+ *
+ * @returns 0 if fn returned, -1 if the thread could not be started or died
+ * from a fatal signal.
+ */
+int run_sync(struct dso_entry *entry, void (*fn)(void *), void *arg, int cpu) {
+	int r;
+	pthread_attr_t attr;
+	pthread_t thread;
+	struct sync_call call = { entry, fn, arg };
+	void *ret;
+
+	r = pthread_attr_init(&attr);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to initialize new thread"
+		                          " attributes") ": %s\n",
+		        strerror(r));
+		return -1;
+	}
+	if(cpu >= 0) {
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		r = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+		                                &cpuset);
+		if(r != 0) {
+			fprintf(stderr, ERRORTEXT("Failed to set affinity to"
+			                          " cpu %d") ": %s\n",
+			        cpu, strerror(r));
+		}
+	}
+
+	r = pthread_create(&thread, &attr,
+	                   (void *(*)(void *)) thread_run_sync, &call);
+	pthread_attr_destroy(&attr);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to create new thread")
+		        ": %s\n", strerror(r));
+		return -1;
+	}
+	r = pthread_join(thread, &ret);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to join thread") ": %s\n",
+		        strerror(r));
+		return -1;
+	}
+	return ret == NULL ? -1 : 0;
+}
+
+/**
+ * Queue a command for the control thread. Safe to call from a signal
+ * handler.
+ */
+void control_send(char cmd, unsigned long arg) {
+	struct control_cmd command;
+	int saved_errno;
+	if(control_pipe[1] < 0) {
+		return;
+	}
+	saved_errno = errno;
+	command.cmd = cmd;
+	command.arg = arg;
+	if(write(control_pipe[1], &command, sizeof(struct control_cmd))
+	   != sizeof(struct control_cmd)) {
+		/* nothing to be done about it here */
+	}
+	errno = saved_errno;
 }
 
 /* sync signal handler */
@@ -97,12 +233,224 @@ static void handle_fatal_signal(int signum, siginfo_t *info,
 		signal(signum, SIG_DFL);
 		raise(signum);
 	} else {
+		struct dso_entry *entry;
 		/* terminate the receiving thread */
 		psiginfo(info, ERRORTEXT("Thread received fatal signal"));
+		entry = pthread_getspecific(entry_key);
+		event_log(EVENT_SIGNAL, entry == NULL ? 0 : entry->generation,
+		          signum, 0, NULL);
+		/* a crash in a pool task counts against the generation that
+		 * spawned it, like one in a run thread */
+		if((pool_crashed() || run_thread)
+		   && (livec_opts.rollback != 0)) {
+			/* have the control thread restart things */
+			__atomic_store_n(&crashed_entry, entry,
+			                 __ATOMIC_RELEASE);
+			control_send(CONTROL_CRASH, 0);
+		}
 		pthread_exit(NULL);
 	}
 }
 
+/* history signal handler; SIGUSR1 steps back, SIGUSR2 forward, and either
+ * one sent with sigqueue() selects the generation given as its value */
+static void handle_history_signal(int signum, siginfo_t *info,
+                                  void *context __attribute__((unused))) {
+	if(info->si_code == SI_QUEUE) {
+		control_send(CONTROL_SELECT, info->si_value.sival_int);
+	} else if(signum == SIGUSR1) {
+		control_send(CONTROL_BACK, 0);
+	} else {
+		control_send(CONTROL_FORWARD, 0);
+	}
+}
+
+/**
+ * Make an already loaded generation the current one: relink the autolink
+ * functions to it and start its entry in a new thread, unless its entry is
+ * still running. Its context's switch_lock must be held.
+ */
+void switch_locked(struct dso_entry *entry) {
+	if(relink(entry) != 0) {
+		fprintf(stderr, ERRORTEXT("Relink to generation %lu"
+		                          " incomplete\n"), entry->generation);
+	}
+	arcp_store(&entry->livec->current_entry, entry);
+	event_log(EVENT_SWITCH, entry->generation, 0, 0, NULL);
+	if(__atomic_load_n(&entry->threads, __ATOMIC_ACQUIRE) != 0) {
+		/* its entry is still running, and its autolinked calls reach
+		 * its own code again; a second copy would run alongside */
+		return;
+	}
+	run((struct dso_entry *) arcp_acquire(entry));
+}
+
+/* switch back to the last-known-good generation after the current one
+ * crashed; if that is the one that crashed, it is demoted, and the one
+ * before it is used instead */
+static void rollback(void) {
+	struct dso_entry *crashed;
+	struct dso_entry *good;
+
+	crashed = __atomic_exchange_n(&crashed_entry, NULL, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&livec_main.switch_lock);
+	if(crashed != (struct dso_entry *)
+	   arcp_load_phantom(&livec_main.current_entry)) {
+		/* a thread from an older generation crashed; what's current
+		 * is still fine */
+		goto out;
+	}
+	good = (struct dso_entry *) arcp_load(&good_entry);
+	if(good == crashed) {
+		fprintf(stderr, ERRORTEXT("Known-good generation %lu crashed;"
+		                          " demoting it\n"),
+		        good->generation);
+		arcp_release(good);
+		good = (struct dso_entry *) arcp_load(&prev_good_entry);
+		arcp_store(&good_entry, good);
+		arcp_store(&prev_good_entry, NULL);
+	}
+	if((good == NULL) || (good == crashed)) {
+		fprintf(stderr, ERRORTEXT("No known-good generation to roll"
+		                          " back to\n"));
+		arcp_release(good);
+		goto out;
+	}
+	fprintf(stderr, PROCTEXT("Rolling back to generation %lu...\n"),
+	        good->generation);
+	switch_locked(good);
+	arcp_release(good);
+out:
+	pthread_mutex_unlock(&livec_main.switch_lock);
+}
+
+static uint64_t monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* the content of the control thread; carries out queued commands, and
+ * promotes generations that have been running for long enough to
+ * known-good */
+static void *thread_control(void *arg __attribute__((unused))) {
+	int r;
+	struct control_cmd command;
+	struct pollfd pfd;
+	struct dso_entry *candidate = NULL;
+	struct dso_entry *current;
+	uint64_t since = 0;
+
+	pfd.fd = control_pipe[0];
+	pfd.events = POLLIN;
+	for(;;) {
+		r = poll(&pfd, 1, livec_opts.rollback == 0 ? -1
+		                  : livec_opts.rollback / 4 + 1);
+		if(r < 0) {
+			if(errno != EINTR) {
+				perror(ERRORTEXT("poll() of control pipe"
+				                 " failed"));
+			}
+			continue;
+		}
+		while(read(control_pipe[0], &command,
+		           sizeof(struct control_cmd))
+		      == sizeof(struct control_cmd)) {
+			switch(command.cmd) {
+			case CONTROL_CRASH:
+				rollback();
+				break;
+			case CONTROL_BACK:
+				history_step(&livec_main, -1);
+				break;
+			case CONTROL_FORWARD:
+				history_step(&livec_main, 1);
+				break;
+			case CONTROL_SELECT:
+				history_select(&livec_main,
+				               command.arg);
+				break;
+			}
+		}
+
+		if(livec_opts.rollback == 0) {
+			continue;
+		}
+		/* promote the current generation once it has survived the
+		 * grace period */
+		current = (struct dso_entry *) arcp_load(
+			&livec_main.current_entry);
+		if(current != candidate) {
+			arcp_release(candidate);
+			candidate = current;
+			since = monotonic_ms();
+			continue;
+		}
+		arcp_release(current);
+		if((candidate != NULL)
+		   && (monotonic_ms() - since >= (uint64_t) livec_opts.rollback)
+		   && (candidate != (struct dso_entry *)
+		       arcp_load_phantom(&good_entry))) {
+			/* keep the one it replaces to fall back to */
+			current = (struct dso_entry *) arcp_load(&good_entry);
+			arcp_store(&prev_good_entry, current);
+			arcp_release(current);
+			arcp_store(&good_entry, candidate);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Start the control thread, which rolls back to the last-known-good
+ * generation when a run thread crashes and, with --history, switches
+ * between the generations in the history on SIGUSR1 and SIGUSR2.
+ */
+void setup_control() {
+	int r;
+	pthread_t thread;
+	struct sigaction act;
+
+	r = pipe2(control_pipe, O_CLOEXEC|O_NONBLOCK);
+	if(r != 0) {
+		perror(ERRORTEXT("Fatal: Failed to create control pipe"));
+		exit(EXIT_FAILURE);
+	}
+	r = pthread_create(&thread, NULL, thread_control, NULL);
+	if(r != 0) {
+		fprintf(stderr, ERRORTEXT("Fatal: Failed to create control"
+		                          " thread") ": %s\n",
+		        strerror(r));
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+
+	/* SIGUSR1 and SIGUSR2 keep their default action without a
+	 * history */
+	if(livec_opts.history == 0) {
+		return;
+	}
+	act.sa_flags = SA_SIGINFO|SA_RESTART;
+	act.sa_sigaction = handle_history_signal;
+	r = sigemptyset(&act.sa_mask);
+	if(r != 0) {
+		perror(ERRORTEXT("Fatal: Failed to clear signal mask"));
+		exit(EXIT_FAILURE);
+	}
+	r = sigaction(SIGUSR1, &act, NULL);
+	if(r != 0) {
+		perror(ERRORTEXT("Fatal: Failed to install handler for signal"
+		                 " SIGUSR1"));
+		exit(EXIT_FAILURE);
+	}
+	r = sigaction(SIGUSR2, &act, NULL);
+	if(r != 0) {
+		perror(ERRORTEXT("Fatal: Failed to install handler for signal"
+		                 " SIGUSR2"));
+		exit(EXIT_FAILURE);
+	}
+}
+
 void setup_signal_handling() {
 	int r;
 	struct sigaction act;
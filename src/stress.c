@@ -0,0 +1,403 @@
+/* stress.c Relinking under heavy call load
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <atomickit/rcp.h>
+#include <atomickit/malloc.h>
+#include <atomickit/string.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * In stress mode the file is compiled once, and copies of the DSO are then
+ * loaded over and over, each one relinking all the autolinks, while a number
+ * of threads call the program's livec_stress() function as fast as they can.
+ * The threads take turns calling it in one of three ways: through a typed
+ * autolink, through livec_autolink() as the host would, and, if the program
+ * has a livec_stress_generic() function as well, through the dispatch
+ * function of a generic autolink to that. Every so often the livec_stress
+ * autolink is destroyed and created anew under the calls. Each call is timed,
+ * and counted as made during a relink if one was under way at any point
+ * during it.
+ *
+ * The generic autolink is never destroyed, since calls through its dispatch
+ * function must not outlast it. A destroyed typed autolink's slot keeps its
+ * last generation loaded for good, so each recreation pins one.
+ */
+
+/* destroy and recreate the livec_stress autolink every this many reloads */
+#define STRESS_RELINK_SLOT 16
+
+/* the signature of livec_stress_generic() */
+#define STRESS_GENERIC_SIGNATURE "v"
+
+#define CACHE_LINE 64
+
+/* how a stress thread calls livec_stress() */
+enum stress_kind {
+	STRESS_TYPED,
+	STRESS_ACQUIRED,
+	STRESS_GENERIC,
+	STRESS_NKINDS
+};
+
+struct stress_thread {
+	pthread_t thread;
+	enum stress_kind kind; /**< How the thread calls. */
+	struct autolink_stats steady; /**< Calls made between relinks. */
+	struct autolink_stats relink; /**< Calls made during a relink. */
+	unsigned long long max_ns; /**< The slowest call. */
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct autolink_slot *stress_slot;
+
+/* the dispatch function of the livec_stress_generic autolink, or NULL */
+static void (*stress_generic)(void) = NULL;
+
+/* odd while a relink is under way */
+static unsigned long relink_seq = 0;
+
+static bool stress_done = false;
+
+static void stress_record(struct autolink_stats *stats, uint64_t ns) {
+	int bucket;
+	bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+	if(bucket >= AUTOLINK_STATS_BUCKETS) {
+		bucket = AUTOLINK_STATS_BUCKETS - 1;
+	}
+	stats->calls++;
+	stats->samples++;
+	stats->sample_ns += ns;
+	stats->histogram[bucket]++;
+}
+
+static void stress_merge(struct autolink_stats *into,
+                         struct autolink_stats *from) {
+	int i;
+	into->calls += from->calls;
+	into->samples += from->samples;
+	into->sample_ns += from->sample_ns;
+	for(i = 0; i < AUTOLINK_STATS_BUCKETS; i++) {
+		into->histogram[i] += from->histogram[i];
+	}
+}
+
+/* call livec_stress() once the way the thread does; returns false if there
+ * was nothing to call */
+static bool stress_call(struct stress_thread *st) {
+	struct autolink_slot *slot;
+	struct arcp_region *ref;
+	void (*fptr)(void);
+
+	switch(st->kind) {
+	case STRESS_TYPED:
+		slot = __atomic_load_n(&stress_slot, __ATOMIC_ACQUIRE);
+		fptr = (void (*)(void)) autolink_slot_enter(slot);
+		fptr();
+		autolink_slot_leave();
+		return true;
+	case STRESS_ACQUIRED:
+		fptr = (void (*)(void)) livec_autolink(&livec_main,
+		                                       "livec_stress", &ref);
+		if(fptr == NULL) {
+			/* destroyed and not created again yet */
+			return false;
+		}
+		fptr();
+		arcp_release(ref);
+		return true;
+	default:
+		stress_generic();
+		return true;
+	}
+}
+
+/* the content of a calling thread */
+static void *thread_stress(struct stress_thread *st) {
+	unsigned long seq;
+	uint64_t start, ns;
+	while(!__atomic_load_n(&stress_done, __ATOMIC_RELAXED)) {
+		seq = __atomic_load_n(&relink_seq, __ATOMIC_ACQUIRE);
+		start = event_clock();
+		if(!stress_call(st)) {
+			continue;
+		}
+		ns = event_clock() - start;
+		if((seq & 1) || (seq != __atomic_load_n(&relink_seq,
+		                                        __ATOMIC_ACQUIRE))) {
+			stress_record(&st->relink, ns);
+		} else {
+			stress_record(&st->steady, ns);
+		}
+		if(ns > st->max_ns) {
+			st->max_ns = ns;
+		}
+	}
+	return NULL;
+}
+
+/* run on behalf of a generation to (re-)create the livec_stress autolink */
+static void stress_link(struct autolink_slot **slot) {
+	struct dso_entry *entry;
+	void *fptr;
+	entry = (struct dso_entry *) pthread_getspecific(entry_key);
+	fptr = dlsym(entry->dlhandle, "livec_stress");
+	if(fptr == NULL) {
+		fprintf(stderr, ERRORTEXT("Could not find 'livec_stress'"
+		                          " function in %s\n"), entry->dsofile);
+		*slot = NULL;
+		return;
+	}
+	*slot = autolink_slot_create(fptr, "livec_stress");
+	if(*slot == NULL) {
+		perror(ERRORTEXT("Failed to create livec_stress autolink"));
+	}
+}
+
+/* run on behalf of a generation to destroy the livec_stress autolink and
+ * create it anew, while calls go through it */
+static void stress_relink(struct autolink_slot **slot) {
+	if(autolink_destroy("livec_stress") != 0) {
+		perror(ERRORTEXT("Failed to destroy livec_stress autolink"));
+	}
+	stress_link(slot);
+}
+
+/* run on behalf of the first generation to create the livec_stress_generic
+ * autolink, if the program has the function */
+static void stress_link_generic(void *arg __attribute__((unused))) {
+	struct dso_entry *entry;
+	void *fptr;
+	entry = (struct dso_entry *) pthread_getspecific(entry_key);
+	fptr = dlsym(entry->dlhandle, "livec_stress_generic");
+	if(fptr == NULL) {
+		fprintf(stderr, PROCTEXT("No livec_stress_generic() function;"
+		                         " not calling through a generic"
+		                         " autolink\n"));
+		return;
+	}
+	stress_generic = (void (*)(void)) autolink_create(
+		fptr, "livec_stress_generic", STRESS_GENERIC_SIGNATURE);
+	if(stress_generic == NULL) {
+		perror(ERRORTEXT("Failed to create livec_stress_generic"
+		                 " autolink"));
+	}
+}
+
+/* copy a DSO to a new temporary file, so that it is loaded anew */
+static char *stress_copy(char *dsofile) {
+	char *copy;
+	int in, out;
+	ssize_t len;
+	char buf[65536];
+
+	copy = amalloc(strlen(dsofile) + 6 /* "XXXXXX" */ + 3 /* ".so" */
+	               + 1);
+	if(copy == NULL) {
+		return NULL;
+	}
+	strcpy(copy, dsofile);
+	strcat(copy, "XXXXXX.so");
+	out = mkstemps(copy, 3);
+	if(out < 0) {
+		goto error0;
+	}
+	in = open(dsofile, O_RDONLY|O_CLOEXEC);
+	if(in < 0) {
+		goto error1;
+	}
+	while((len = read(in, buf, sizeof(buf))) > 0) {
+		if(write(out, buf, len) != len) {
+			len = -1;
+			break;
+		}
+	}
+	close(in);
+	if(len < 0) {
+		goto error1;
+	}
+	close(out);
+	return copy;
+
+error1:
+	close(out);
+	unlink(copy);
+error0:
+	afree(copy, strlen(copy) + 1);
+	return NULL;
+}
+
+static void stress_report_line(char *name, struct autolink_stats *stats) {
+	fprintf(stderr, "  %-14s %12llu %10llu %10llu %10llu %10llu\n", name,
+	        stats->calls,
+	        stats->samples == 0 ? 0 : stats->sample_ns / stats->samples,
+	        autolink_stats_percentile(stats, 0.5),
+	        autolink_stats_percentile(stats, 0.99),
+	        autolink_stats_percentile(stats, 0.999));
+}
+
+static void stress_report(struct stress_thread *threads, int nthreads,
+                          struct autolink_stats *reloads) {
+	int i;
+	struct autolink_stats steady, relink;
+	unsigned long long max_ns = 0;
+
+	memset(&steady, 0, sizeof(struct autolink_stats));
+	memset(&relink, 0, sizeof(struct autolink_stats));
+	for(i = 0; i < nthreads; i++) {
+		stress_merge(&steady, &threads[i].steady);
+		stress_merge(&relink, &threads[i].relink);
+		if(threads[i].max_ns > max_ns) {
+			max_ns = threads[i].max_ns;
+		}
+	}
+	fprintf(stderr, PROCTEXT("Stress results, %d threads:\n"), nthreads);
+	fprintf(stderr, "  %-14s %12s %10s %10s %10s %10s\n",
+	        "", "count", "mean ns", "p50 ns", "p99 ns", "p99.9 ns");
+	stress_report_line("steady calls", &steady);
+	stress_report_line("relink calls", &relink);
+	stress_report_line("reloads", reloads);
+	fprintf(stderr, "  slowest call: %llu ns\n", max_ns);
+}
+
+/**
+ * Compile the file once and then stress relinking, as configured by the
+ * stress options; exits when done.
+ */
+void stress() {
+	int i, r, nthreads;
+	struct astr *sfilename;
+	char *dsofile;
+	char *copy;
+	struct dso_entry *entry;
+	struct stress_thread *threads;
+	void *threads_base;
+	size_t threads_size;
+	struct autolink_stats reloads;
+	uint64_t start;
+
+	nthreads = livec_opts.stress;
+	sfilename = (struct astr *) arcp_load(&livec_opts.filename);
+	fprintf(stderr, PROCTEXT("Compiling %s...\n"), astr_cstr(sfilename));
+	dsofile = compile(&livec_main, sfilename, NULL, 0);
+	arcp_release(sfilename);
+	if(dsofile == NULL) {
+		fprintf(stderr, ERRORTEXT("Fatal: Compilation failed.\n"));
+		exit(EXIT_FAILURE);
+	}
+	/* keep the original around to copy from; the loaded copies are
+	 * unlinked when their generations go away */
+	copy = stress_copy(dsofile);
+	if((copy == NULL) || ((entry = load(&livec_main, copy)) == NULL)) {
+		fprintf(stderr, ERRORTEXT("Fatal: Load failed.\n"));
+		exit(EXIT_FAILURE);
+	}
+	run_sync(entry, (void (*)(void *)) stress_link, &stress_slot, -1);
+	run_sync(entry, stress_link_generic, NULL, -1);
+	arcp_release(entry);
+	if(stress_slot == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* each thread's counters get cache lines of their own */
+	threads_size = sizeof(struct stress_thread) * nthreads
+		+ CACHE_LINE - 1;
+	threads_base = amalloc(threads_size);
+	if(threads_base == NULL) {
+		perror(ERRORTEXT("Fatal: Failed to allocate memory for stress"
+		                 " threads"));
+		exit(EXIT_FAILURE);
+	}
+	threads = (struct stress_thread *)
+		(((uintptr_t) threads_base + CACHE_LINE - 1)
+		 & ~(uintptr_t) (CACHE_LINE - 1));
+	memset(threads, 0, sizeof(struct stress_thread) * nthreads);
+	for(i = 0; i < nthreads; i++) {
+		threads[i].kind = (enum stress_kind) (i % STRESS_NKINDS);
+		if((threads[i].kind == STRESS_GENERIC)
+		   && (stress_generic == NULL)) {
+			threads[i].kind = STRESS_TYPED;
+		}
+		r = pthread_create(&threads[i].thread, NULL,
+		                   (void *(*)(void *)) thread_stress,
+		                   &threads[i]);
+		if(r != 0) {
+			fprintf(stderr, ERRORTEXT("Fatal: Failed to create"
+			                          " stress thread") ": %s\n",
+			        strerror(r));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fprintf(stderr, PROCTEXT("Reloading %d times...\n"),
+	        livec_opts.stress_reloads);
+	memset(&reloads, 0, sizeof(struct autolink_stats));
+	for(i = 0; i < livec_opts.stress_reloads; i++) {
+		usleep(livec_opts.stress_interval);
+		copy = stress_copy(dsofile);
+		if(copy == NULL) {
+			perror(ERRORTEXT("Failed to copy DSO"));
+			continue;
+		}
+		__atomic_add_fetch(&relink_seq, 1, __ATOMIC_RELEASE);
+		start = event_clock();
+		entry = load(&livec_main, copy);
+		if((entry != NULL) && (i % STRESS_RELINK_SLOT == 0)) {
+			/* destroy and recreate the autolink itself; calls
+			 * still going through the old slot keep its last
+			 * generation */
+			struct autolink_slot *slot;
+			run_sync(entry, (void (*)(void *)) stress_relink, &slot,
+			         -1);
+			if(slot != NULL) {
+				__atomic_store_n(&stress_slot, slot,
+				                 __ATOMIC_RELEASE);
+			}
+		}
+		stress_record(&reloads, event_clock() - start);
+		__atomic_add_fetch(&relink_seq, 1, __ATOMIC_RELEASE);
+		if(entry == NULL) {
+			fprintf(stderr, ERRORTEXT("Load failed.\n"));
+			continue;
+		}
+		arcp_release(entry);
+	}
+
+	__atomic_store_n(&stress_done, true, __ATOMIC_RELAXED);
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	stress_report(threads, nthreads, &reloads);
+	afree(threads_base, threads_size);
+	if(unlink(dsofile) != 0) {
+		fprintf(stderr, ERRORTEXT("Failed to unlink %s") ": %s\n",
+		        dsofile, strerror(errno));
+	}
+	afree(dsofile, strlen(dsofile) + 1);
+	exit(EXIT_SUCCESS);
+}
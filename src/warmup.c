@@ -0,0 +1,131 @@
+/* warmup.c Warm up new generations before switching to them
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <link.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <atomickit/rcp.h>
+
+#include "livec.h"
+#include "local.h"
+
+/*
+ * Without a warm-up, the first calls into a new generation fault in its
+ * pages one at a time, on whatever thread makes them. With --warmup, a new
+ * generation's segments are faulted in, and its livec_warmup() function, if
+ * it has one, is run, all before anything is relinked to it.
+ */
+
+struct warmup_search {
+	uintptr_t base; /**< The load address of the DSO looked for. */
+	size_t pages; /**< Pages touched. */
+};
+
+/* fault in the readable segments of the DSO loaded at search->base */
+static int warmup_phdr_callback(struct dl_phdr_info *info,
+                                size_t size __attribute__((unused)),
+                                void *data) {
+	struct warmup_search *search = (struct warmup_search *) data;
+	uintptr_t start, end, p;
+	size_t pagesize;
+	int i;
+
+	if(info->dlpi_addr != search->base) {
+		return 0;
+	}
+	pagesize = sysconf(_SC_PAGESIZE);
+	for(i = 0; i < info->dlpi_phnum; i++) {
+		if((info->dlpi_phdr[i].p_type != PT_LOAD)
+		   || !(info->dlpi_phdr[i].p_flags & PF_R)) {
+			continue;
+		}
+		start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+		end = start + info->dlpi_phdr[i].p_memsz;
+		start &= ~(pagesize - 1);
+		if(madvise((void *) start, end - start, MADV_WILLNEED) != 0) {
+			perror(ERRORTEXT("madvise(MADV_WILLNEED) failed"));
+		}
+		/* read a byte of each page, which faults it in without
+		 * copying it */
+		for(p = start; p < end; p += pagesize) {
+			(void) *(volatile const char *) p;
+			search->pages++;
+		}
+	}
+	return 1;
+}
+
+struct warmup_call {
+	void (*hook)(void); /**< The generation's livec_warmup(). */
+};
+
+/* run the hook with ordinary scheduling, whatever the loading thread has */
+static void warmup_call(struct warmup_call *call) {
+	struct sched_param param;
+	memset(&param, 0, sizeof(struct sched_param));
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+	call->hook();
+}
+
+/**
+ * Warm up a newly loaded generation: fault in its segments, and call its
+ * livec_warmup() function, if it has one, on a thread of its own. Returns
+ * once that is done.
+ *
+ * @returns 0 on success, -1 if livec_warmup() crashed.
+ */
+int warmup(struct dso_entry *entry) {
+	struct link_map *map;
+	struct warmup_search search;
+	struct warmup_call call;
+	uint64_t start;
+
+	start = event_clock();
+	search.pages = 0;
+	if(dlinfo(entry->dlhandle, RTLD_DI_LINKMAP, &map) != 0) {
+		fprintf(stderr, ERRORTEXT("Could not find where %s is loaded:"
+		                          " %s\n"),
+		        entry->dsofile, dlerror());
+	} else {
+		search.base = map->l_addr;
+		dl_iterate_phdr(warmup_phdr_callback, &search);
+	}
+
+	call.hook = (void (*)(void)) dlsym(entry->dlhandle, "livec_warmup");
+	if((call.hook != NULL)
+	   && (run_sync(entry, (void (*)(void *)) warmup_call, &call,
+	                -1) != 0)) {
+		fprintf(stderr, ERRORTEXT("livec_warmup() of generation %lu"
+		                          " failed\n"),
+		        entry->generation);
+		return -1;
+	}
+	fprintf(stderr, PROCTEXT("Warmed up generation %lu (%zu pages) in"
+	                         " %llu us\n"),
+	        entry->generation, search.pages,
+	        (unsigned long long) (event_clock() - start) / 1000);
+	return 0;
+}
@@ -0,0 +1,44 @@
+/* stress.c Program for stressing relinking, run by make check
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Live C.
+ *
+ * Live C is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * Live C is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Live C.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Run as livec --stress n test/stress.c. Every copy of the DSO has a
+ * counter of its own, which is touched on each call, so that a call into a
+ * generation that has been unloaded shows up under the sanitizers.
+ */
+
+void livec_stress(void);
+void livec_stress_generic(void);
+int main(int argc, char **argv);
+
+static unsigned long calls = 0;
+
+void livec_stress(void) {
+	__atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+}
+
+void livec_stress_generic(void) {
+	__atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+}
+
+/* not run when stressing, but every program needs an entry function */
+int main(int argc __attribute__((unused)),
+         char **argv __attribute__((unused))) {
+	return 0;
+}